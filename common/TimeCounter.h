@@ -1,23 +1,32 @@
-
 #pragma once
 
 #include "cmdlib.h"
 
+// Wall clock and process CPU time over any number of start/stop intervals.
+// The CPU time is that of every thread of the process, so it can be well past
+// the wall clock time in a threaded pass.
 class TimeCounter {
 public:
     void start() {
-        start = I_FloatTime();
+        startTime = I_FloatTime();
+        startCpu = I_CpuTime();
     }
 
     void stop() {
         double stop = I_FloatTime();
-        accum += stop - start;
+        double stopCpu = I_CpuTime();
+        accum += stop - startTime;
+        accumCpu += stopCpu - startCpu;
     }
 
     double getTotal() const {
         return accum;
     }
 
+    double getCpuTotal() const {
+        return accumCpu;
+    }
+
     void reset() {
         memset(this, 0, sizeof(*this));
     }
@@ -32,6 +41,8 @@ public:
     // Default Copy Operator ok
 
 protected:
-    double start;
+    double startTime;
     double accum;
+    double startCpu;
+    double accumCpu;
 };
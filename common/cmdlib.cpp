@@ -20,6 +20,9 @@
 #include <cstdarg>
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
 #endif
 
 #include <cctype>
@@ -65,6 +68,63 @@ double I_FloatTime() {
 #endif
 }
 
+/*
+ * ================
+ * I_CpuTime
+ * Seconds of CPU time used by all the threads of the process so far
+ * ================
+ */
+double I_CpuTime() {
+#ifdef SYSTEM_WIN32
+    FILETIME creation, exit, kernel, user;
+    double rval;
+
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+        return 0.0;
+    }
+
+    rval = kernel.dwLowDateTime;
+    rval += user.dwLowDateTime;
+    rval += ((__int64) kernel.dwHighDateTime) << 32;
+    rval += ((__int64) user.dwHighDateTime) << 32;
+
+    return (rval / 10000000.0);
+#endif
+
+#ifdef SYSTEM_POSIX
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage)) {
+        return 0.0;
+    }
+
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+#endif
+}
+
+/*
+ * ================
+ * I_PeakMemory
+ * Most bytes the process has had resident at once, 0 where the system doesn't say
+ * ================
+ */
+double I_PeakMemory() {
+#ifdef SYSTEM_POSIX
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage)) {
+        return 0.0;
+    }
+#ifdef __APPLE__
+    return (double) usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * 1024.0;
+#endif
+#else
+    return 0.0;
+#endif
+}
+
 #ifdef SYSTEM_POSIX
 char *strupr(char *string) {
     int i;
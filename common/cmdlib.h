@@ -122,6 +122,8 @@ extern bool TerminatedString(const char *buffer, const int size);
 extern char *FlipSlashes(char *string);
 
 extern double I_FloatTime();
+extern double I_CpuTime();
+extern double I_PeakMemory();
 
 extern int CheckParm(char *check);
 
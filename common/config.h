@@ -63,14 +63,19 @@
 /* Sets the size of char* */
 #define SIZEOF_CHARP 0
 
-#if !defined(HAVE_ASM_ATOMIC_H) && !defined(HAVE_SYS_ATOMIC_H)
-#define NO_ATOMIC
-#endif
-
 #if defined(HAVE_ASM_ATOMIC_H) || defined(HAVE_SYS_ATOMIC_H)
 #define HAVE_ATOMIC
 #endif
 
+/* gcc and clang provide the __sync builtins, which is all the thread code needs */
+#if !defined(HAVE_ATOMIC) && defined(__GNUC__)
+#define HAVE_SYNC_BUILTINS
+#endif
+
+#if !defined(HAVE_ATOMIC) && !defined(HAVE_SYNC_BUILTINS)
+#define NO_ATOMIC
+#endif
+
 #if !defined(HAVE_PTHREAD_H) || defined(NO_ATOMIC)
 #define SINGLE_THREADED
 #endif
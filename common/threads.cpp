@@ -25,53 +25,279 @@
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
 #endif
+#ifdef __linux__
+#include <sched.h>
+#endif
 #endif
 
 #include "hlassert.h"
 #include <stdio.h>
 
 q_threadpriority g_threadpriority = DEFAULT_THREAD_PRIORITY;
+q_threadaffinity g_threadaffinity = DEFAULT_THREAD_AFFINITY;
 
 #define THREADTIMES_SIZE 100
 #define THREADTIMES_SIZEf (float) (THREADTIMES_SIZE)
 
-static int dispatch = 0;
+// Work items are claimed from the shared dispatch counter in blocks whose size shrinks with
+// the remaining work.  The unprocessed part of a block sits in the owning thread's queue,
+// where idle threads can steal half of it once the dispatch counter has run dry.
+#define WORK_CHUNK_DIVISOR 4
+#define WORK_CHUNK_MAX 256
+
+// Seconds between pacifier updates from the progress reporter
+#define PROGRESS_INTERVAL 0.1
+
+#ifdef SYSTEM_WIN32
+typedef __int64 q_workrange;
+#else
+typedef long long q_workrange;
+#endif
+
+#define WORKRANGE(begin, end) (((q_workrange) (begin) << 32) | (unsigned int) (end))
+#define WORKRANGE_BEGIN(range) ((int) ((range) >> 32))
+#define WORKRANGE_END(range) ((int) ((range) &0xFFFFFFFF))
+
+typedef struct {
+    volatile q_workrange range;// [begin, end) of the work items this thread still owns
+    volatile int handedout;    // work items returned by GetThreadWork on this thread
+    char padding[64 - sizeof(q_workrange) - sizeof(int)];// one cache line per queue
+} threadqueue_t;
+
+static volatile int dispatch = 0;
 static int workcount = 0;
+static int workthreads = 1;
 static int oldf = 0;
 static bool pacifier = false;
 static bool threaded = false;
 static double threadstart = 0;
 static double threadtimes[THREADTIMES_SIZE];
+static threadqueue_t *threadqueues = NULL;// one per thread, grown to fit g_numthreads
+static int numthreadqueues = 0;
+static double *threadbusy = NULL;// seconds each thread spent working, over every RunThreadsOn
+static double threadruntime = 0; // seconds spent in RunThreadsOn
+static THREADLOCAL int threadindex = 0;
 
-int GetThreadWork() {
-    int r, f, i;
-    double ct, finish, finish2, finish3;
+/*
+ * =============
+ * Atomic helpers
+ * =============
+ */
+#ifdef SYSTEM_WIN32
+int ThreadAtomicAdd(volatile int *value, int amount) {
+    return InterlockedExchangeAdd((volatile LONG *) value, amount);
+}
+
+static bool WorkRangeCompareExchange(volatile q_workrange *range, q_workrange comparand, q_workrange exchange) {
+    return InterlockedCompareExchange64(range, exchange, comparand) == comparand;
+}
+#else
+int ThreadAtomicAdd(volatile int *value, int amount) {
+    return __sync_fetch_and_add(value, amount);
+}
 
-    ThreadLock();
+static bool WorkRangeCompareExchange(volatile q_workrange *range, q_workrange comparand, q_workrange exchange) {
+    return __sync_bool_compare_and_swap(range, comparand, exchange);
+}
+#endif
+
+static void SetWorkRange(threadqueue_t *queue, q_workrange range) {
+    q_workrange old;
+
+    do {
+        old = queue->range;
+    } while (!WorkRangeCompareExchange(&queue->range, old, range));
+}
 
-    if (dispatch == 0) {
-        oldf = 0;
+// Parses the argument of -affinity
+bool ThreadSetAffinity(const char *const mode) {
+    if (!strcasecmp(mode, "none")) {
+        g_threadaffinity = eThreadAffinityNone;
+    } else if (!strcasecmp(mode, "pin")) {
+        g_threadaffinity = eThreadAffinityPin;
+    } else if (!strcasecmp(mode, "numa")) {
+        g_threadaffinity = eThreadAffinityNuma;
+    } else {
+        return false;
     }
+    return true;
+}
 
-    if (dispatch > workcount) {
-        Developer(DEVELOPER_LEVEL_ERROR, "dispatch > workcount!!!\n");
-        ThreadUnlock();
-        return -1;
+const char *ThreadAffinityName(q_threadaffinity type) {
+    switch (type) {
+        case eThreadAffinityPin:
+            return "pin";
+        case eThreadAffinityNuma:
+            return "numa";
+        case eThreadAffinityNone:
+        default:
+            return "none";
+    }
+}
+
+/*
+ * =============
+ * Work dispatch
+ * =============
+ */
+static void ResetThreadWork(int workcnt, int numthreads, bool showpacifier) {
+    int i;
+
+    for (i = 0; i < THREADTIMES_SIZE; i++) {
+        threadtimes[i] = 0;
+    }
+    if (numthreads > numthreadqueues) {
+        threadqueues = (threadqueue_t *) realloc(threadqueues, numthreads * sizeof(threadqueue_t));
+        hlassume(threadqueues != NULL, assume_NoMemory);
+        threadbusy = (double *) realloc(threadbusy, numthreads * sizeof(double));
+        hlassume(threadbusy != NULL, assume_NoMemory);
+        for (i = numthreadqueues; i < numthreads; i++) {
+            threadbusy[i] = 0;
+        }
+        numthreadqueues = numthreads;
+    }
+    for (i = 0; i < numthreads; i++) {
+        threadqueues[i].range = WORKRANGE(0, 0);
+        threadqueues[i].handedout = 0;
+    }
+
+    if (workcnt < 0) {
+        Developer(DEVELOPER_LEVEL_ERROR, "RunThreadsOn: negative workcount(%i)\n", workcnt);
+    }
+    hlassume(workcnt >= 0, assume_BadWorkcount);
+
+    dispatch = 0;
+    workcount = workcnt;
+    workthreads = numthreads;
+    oldf = 0;
+    pacifier = showpacifier;
+    threadstart = I_FloatTime();
+}
+
+// Runs a thread's share of the work, keeping track of how long it was busy
+static void RunThreadEntry(q_threadfunction func, int index) {
+    double start = I_FloatTime();
+
+    func(index);
+    threadbusy[index] += I_FloatTime() - start;
+}
+
+double ThreadRunTime() {
+    return threadruntime;
+}
+
+double ThreadBusyTime(int thread) {
+    return thread < numthreadqueues ? threadbusy[thread] : 0.0;
+}
+
+// Take the next item from this thread's own block
+static int PopThreadWork(threadqueue_t *queue) {
+    q_workrange range;
+    int begin, end;
+
+    for (;;) {
+        range = queue->range;
+        begin = WORKRANGE_BEGIN(range);
+        end = WORKRANGE_END(range);
+        if (begin >= end) {
+            return -1;
+        }
+        if (WorkRangeCompareExchange(&queue->range, range, WORKRANGE(begin + 1, end))) {
+            return begin;
+        }
     }
-    if (dispatch == workcount) {
-        Developer(DEVELOPER_LEVEL_MESSAGE, "dispatch == workcount, work is complete\n");
-        ThreadUnlock();
+}
+
+// Claim a fresh block from the dispatch counter, keeping everything but its first item queued
+static int ClaimThreadWork(threadqueue_t *queue) {
+    int begin, end, chunk;
+
+    chunk = dispatch;
+    if (chunk >= workcount) {
         return -1;
     }
-    if (dispatch < 0) {
-        Developer(DEVELOPER_LEVEL_ERROR, "negative dispatch!!!\n");
-        ThreadUnlock();
+    chunk = (workcount - chunk) / (workthreads * WORK_CHUNK_DIVISOR);
+    if (chunk > WORK_CHUNK_MAX) {
+        chunk = WORK_CHUNK_MAX;
+    }
+    if (chunk < 1) {
+        chunk = 1;
+    }
+
+    begin = ThreadAtomicAdd(&dispatch, chunk);
+    if (begin >= workcount) {
         return -1;
     }
+    end = begin + chunk;
+    if (end > workcount) {
+        end = workcount;
+    }
+    SetWorkRange(queue, WORKRANGE(begin + 1, end));
+    return begin;
+}
 
-    f = THREADTIMES_SIZE * dispatch / workcount;
+// Split the largest block still owned by another thread and take its upper half
+static int StealThreadWork(threadqueue_t *queue) {
+    threadqueue_t *victim;
+    q_workrange range, victimrange;
+    int i, size, victimsize, begin, end, half;
+
+    for (;;) {
+        victim = NULL;
+        victimsize = 0;
+        victimrange = 0;
+        for (i = 0; i < workthreads; i++) {
+            range = threadqueues[i].range;
+            size = WORKRANGE_END(range) - WORKRANGE_BEGIN(range);
+            if (size > victimsize) {
+                victim = &threadqueues[i];
+                victimsize = size;
+                victimrange = range;
+            }
+        }
+        if (!victim) {
+            return -1;
+        }
+
+        begin = WORKRANGE_BEGIN(victimrange);
+        end = WORKRANGE_END(victimrange);
+        half = (end - begin + 1) / 2;
+        if (WorkRangeCompareExchange(&victim->range, victimrange, WORKRANGE(begin, end - half))) {
+            SetWorkRange(queue, WORKRANGE(end - half + 1, end));
+            return end - half;
+        }
+    }
+}
+
+static int ThreadWorkHandedOut() {
+    int i, total;
+
+    total = 0;
+    for (i = 0; i < workthreads; i++) {
+        total += threadqueues[i].handedout;
+    }
+    return total;
+}
+
+/*
+ * =============
+ * UpdatePacifier
+ * Only ever called from the progress reporter (or the thread that owns the
+ * RunThreadsOn call), so worker threads never wait on stdout.
+ * =============
+ */
+static void UpdatePacifier() {
+    int done, f, i;
+    double ct, finish, finish2, finish3;
+
+    if (workcount <= 0) {
+        return;
+    }
+
+    done = ThreadWorkHandedOut();
+    f = THREADTIMES_SIZE * done / workcount;
     if (pacifier) {
-        printf("\r%6d /%6d", dispatch, workcount);
+        printf("\r%6d /%6d", done, workcount);
 #ifdef ZHLT_PROGRESSFILE// AJM
         if (g_progressfile) {
         }
@@ -80,15 +306,15 @@ int GetThreadWork() {
         if (f != oldf) {
             ct = I_FloatTime();
             /* Fill in current time for threadtimes record */
-            for (i = oldf; i <= f; i++) {
+            for (i = oldf; i <= f && i < THREADTIMES_SIZE; i++) {
                 if (threadtimes[i] < 1) {
                     threadtimes[i] = ct;
                 }
             }
             oldf = f;
 
-            if (f > 10) {
-                finish = (ct - threadtimes[0]) * (THREADTIMES_SIZEf - f) / f;
+            if (f > 10 && f < THREADTIMES_SIZE) {
+                finish = (ct - threadstart) * (THREADTIMES_SIZEf - f) / f;
                 finish2 = 10.0 * (ct - threadtimes[f - 10]) * (THREADTIMES_SIZEf - f) / THREADTIMES_SIZEf;
                 finish3 = THREADTIMES_SIZEf * (ct - threadtimes[f - 1]) * (THREADTIMES_SIZEf - f) / THREADTIMES_SIZEf;
 
@@ -110,42 +336,50 @@ int GetThreadWork() {
             }
         }
     } else {
-        if (f != oldf) {
-            oldf = f;
-            switch (f) {
-                case 10:
-                case 20:
-                case 30:
-                case 40:
-                case 50:
-                case 60:
-                case 70:
-                case 80:
-                case 90:
-                case 100:
-                    /*
-            case 5:
-            case 15:
-            case 25:
-            case 35:
-            case 45:
-            case 55:
-            case 65:
-            case 75:
-            case 85:
-            case 95:
-*/
-                    printf("%d%%...", f);
-                default:
-                    break;
+        // The reporter samples coarsely, so print every 10% mark passed since the last update
+        for (i = oldf + 1; i <= f && i < THREADTIMES_SIZE; i++) {
+            if (i % 10 == 0) {
+                printf("%d%%...", i);
             }
         }
+        if (f > oldf) {
+            oldf = f;
+        }
+    }
+}
+
+int GetThreadWork() {
+    threadqueue_t *queue;
+    int r;
+
+    queue = &threadqueues[threadindex];
+
+    r = PopThreadWork(queue);
+    if (r == -1) {
+        r = ClaimThreadWork(queue);
+    }
+    if (r == -1) {
+        r = StealThreadWork(queue);
+    }
+    if (r == -1) {
+        Developer(DEVELOPER_LEVEL_MESSAGE, "thread %d found no more work\n", threadindex);
+        return -1;
     }
 
-    r = dispatch;
-    dispatch++;
+    queue->handedout++;// only the owning thread writes this, the reporter just samples it
+
+#ifdef SINGLE_THREADED
+    {
+        static double lastupdate = 0;
+        double ct = I_FloatTime();
+
+        if (ct - lastupdate >= PROGRESS_INTERVAL) {
+            lastupdate = ct;
+            UpdatePacifier();
+        }
+    }
+#endif
 
-    ThreadUnlock();
     return r;
 }
 
@@ -240,10 +474,15 @@ void ThreadSetDefault() {
     {
         GetSystemInfo(&info);
         g_numthreads = info.dwNumberOfProcessors;
-        if (g_numthreads < 1 || g_numthreads > 32) {
+        if (g_numthreads < 1) {
             g_numthreads = 1;
         }
     }
+    if (g_threadaffinity != eThreadAffinityNone) {
+        Warning("Thread affinity is not supported on this platform, -affinity %s ignored\n",
+                ThreadAffinityName(g_threadaffinity));
+        g_threadaffinity = eThreadAffinityNone;
+    }
 }
 
 void ThreadLock() {
@@ -271,10 +510,42 @@ void ThreadUnlock() {
 q_threadfunction q_entry;
 
 static DWORD WINAPI ThreadEntryStub(LPVOID pParam) {
-    q_entry((int) pParam);
+    threadindex = (int) pParam;
+    RunThreadEntry(q_entry, threadindex);
     return 0;
 }
 
+static HANDLE reporterhandle;
+static HANDLE reporterstop;
+
+static DWORD WINAPI ThreadReporterStub(LPVOID pParam) {
+    while (WaitForSingleObject(reporterstop, (DWORD) (PROGRESS_INTERVAL * 1000)) == WAIT_TIMEOUT) {
+        UpdatePacifier();
+    }
+    return 0;
+}
+
+static void StartProgressReporter() {
+    DWORD threadid;
+
+    reporterstop = CreateEvent(NULL, TRUE, FALSE, NULL);
+    reporterhandle = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) ThreadReporterStub, NULL, 0, &threadid);
+    if (reporterhandle == NULL) {
+        Developer(DEVELOPER_LEVEL_WARNING, "CreateThread for progress reporter failed\n");
+    }
+}
+
+static void StopProgressReporter() {
+    SetEvent(reporterstop);
+    if (reporterhandle != NULL) {
+        WaitForSingleObject(reporterhandle, INFINITE);
+        CloseHandle(reporterhandle);
+        reporterhandle = NULL;
+    }
+    CloseHandle(reporterstop);
+    UpdatePacifier();
+}
+
 void threads_InitCrit() {
     InitializeCriticalSection(&crit);
     threaded = true;
@@ -285,28 +556,19 @@ void threads_UninitCrit() {
 }
 
 void RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func) {
-    DWORD threadid[MAX_THREADS];
-    HANDLE threadhandle[MAX_THREADS];
+    DWORD *threadid;
+    HANDLE *threadhandle;
     int i;
     double start, end;
 
-    threadstart = I_FloatTime();
+    threadid = (DWORD *) Alloc(g_numthreads * sizeof(DWORD));
+    threadhandle = (HANDLE *) Alloc(g_numthreads * sizeof(HANDLE));
+
+    ResetThreadWork(workcnt, g_numthreads, showpacifier);
     start = threadstart;
-    for (i = 0; i < THREADTIMES_SIZE; i++) {
-        threadtimes[i] = 0;
-    }
-    dispatch = 0;
-    workcount = workcnt;
-    oldf = -1;
-    pacifier = showpacifier;
     threaded = true;
     q_entry = func;
 
-    if (workcount < dispatch) {
-        Developer(DEVELOPER_LEVEL_ERROR, "RunThreadsOn: Workcount(%i) < dispatch(%i)\n", workcount, dispatch);
-    }
-    hlassume(workcount >= dispatch, assume_BadWorkcount);
-
     //
     // Create all the threads (suspended)
     //
@@ -340,6 +602,8 @@ void RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func) {
     }
     CheckFatal();
 
+    StartProgressReporter();
+
     // Start all the threads
     for (i = 0; i < g_numthreads; i++) {
         if (ResumeThread(threadhandle[i]) == 0xFFFFFFFF) {
@@ -366,7 +630,10 @@ void RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func) {
         Developer(DEVELOPER_LEVEL_MESSAGE, "WaitForSingleObject on thread #%d [%08X]\n", i, threadhandle[i]);
         WaitForSingleObject(threadhandle[i], INFINITE);
     }
+    StopProgressReporter();
     threads_UninitCrit();
+    Free(threadid);
+    Free(threadhandle);
 
     q_entry = NULL;
     threaded = false;
@@ -374,6 +641,7 @@ void RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func) {
     if (pacifier) {
         printf("\r%60s\r", "");
     }
+    threadruntime += end - start;
     Log(" (%.2f seconds)\n", end - start);
 }
 
@@ -392,14 +660,12 @@ void RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func) {
 
 int g_numthreads = DEFAULT_NUMTHREADS;
 
-void ThreadSetPriority(q_threadpriority type) {
+static void ApplyThreadPriority(q_threadpriority type) {
     int val;
 
-    g_threadpriority = type;
-
     // Currently in Linux land users are incapable of raising the priority level of their processes
     // Unless you are root -high is useless . . .
-    switch (g_threadpriority) {
+    switch (type) {
         case eThreadPriorityLow:
             val = PRIO_MAX;
             break;
@@ -416,13 +682,331 @@ void ThreadSetPriority(q_threadpriority type) {
     setpriority(PRIO_PROCESS, 0, val);
 }
 
+// Linux keeps the nice value per thread, so pool threads reapply it when it changes
+void ThreadSetPriority(q_threadpriority type) {
+    g_threadpriority = type;
+    ApplyThreadPriority(type);
+}
+
+/*====================
+| Thread affinity
+=*/
+#ifdef __linux__
+
+static cpu_set_t affinityset;// CPUs the worker threads may run on
+static int affinitycpus[CPU_SETSIZE];
+static int numaffinitycpus = 0;
+
+// Parses a sysfs cpulist such as "0-15,32-47"
+static bool ReadNodeCpus(int node, cpu_set_t *set) {
+    char path[_MAX_PATH];
+    FILE *f;
+    int first, last, sep;
+
+    safe_snprintf(path, _MAX_PATH, "/sys/devices/system/node/node%d/cpulist", node);
+    f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+
+    CPU_ZERO(set);
+    while (fscanf(f, "%d", &first) == 1) {
+        last = first;
+        sep = fgetc(f);
+        if (sep == '-') {
+            if (fscanf(f, "%d", &last) != 1) {
+                break;
+            }
+            sep = fgetc(f);
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, set);
+        }
+        if (sep != ',') {
+            break;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+// Finds the CPUs of the NUMA node the calling thread is running on
+static bool FindCurrentNodeCpus(cpu_set_t *set) {
+    int cpu, node;
+
+    cpu = sched_getcpu();
+    if (cpu < 0) {
+        return false;
+    }
+    for (node = 0; node < CPU_SETSIZE; node++) {
+        if (ReadNodeCpus(node, set) && CPU_ISSET(cpu, set)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void SetupThreadAffinity() {
+    cpu_set_t nodeset;
+    int i;
+
+    if (g_threadaffinity == eThreadAffinityNone) {
+        return;
+    }
+    if (sched_getaffinity(0, sizeof(affinityset), &affinityset) != 0) {
+        Warning("Unable to query the CPU affinity, -affinity %s ignored\n", ThreadAffinityName(g_threadaffinity));
+        g_threadaffinity = eThreadAffinityNone;
+        return;
+    }
+
+    if (g_threadaffinity == eThreadAffinityNuma) {
+        if (FindCurrentNodeCpus(&nodeset)) {
+            CPU_AND(&affinityset, &affinityset, &nodeset);
+        } else {
+            Warning("No NUMA topology found, -affinity numa ignored\n");
+            g_threadaffinity = eThreadAffinityNone;
+            return;
+        }
+    }
+
+    numaffinitycpus = 0;
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &affinityset)) {
+            affinitycpus[numaffinitycpus++] = i;
+        }
+    }
+    if (numaffinitycpus < g_numthreads) {
+        Developer(DEVELOPER_LEVEL_WARNING, "%d threads share %d CPUs\n", g_numthreads, numaffinitycpus);
+    }
+}
+
+static void ApplyThreadAffinity(int index) {
+    cpu_set_t set;
+
+    switch (g_threadaffinity) {
+        case eThreadAffinityPin:
+            CPU_ZERO(&set);
+            CPU_SET(affinitycpus[index % numaffinitycpus], &set);
+            break;
+        case eThreadAffinityNuma:
+            set = affinityset;
+            break;
+        case eThreadAffinityNone:
+        default:
+            return;
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        Developer(DEVELOPER_LEVEL_WARNING, "pthread_setaffinity_np failed for thread %d\n", index);
+    }
+}
+
+#else
+
+static void SetupThreadAffinity() {
+    if (g_threadaffinity != eThreadAffinityNone) {
+        Warning("Thread affinity is not supported on this platform, -affinity %s ignored\n",
+                ThreadAffinityName(g_threadaffinity));
+        g_threadaffinity = eThreadAffinityNone;
+    }
+}
+
+static void ApplyThreadAffinity(int index) {
+}
+
+#endif
+/*=
+| End Thread affinity
+=====================*/
+
+/*====================
+| Thread pool
+|   Worker threads are created once and sleep between RunThreadsOn calls.
+|   The thread calling RunThreadsOn works as thread 0, the pool supplies
+|   threads 1 to g_numthreads - 1.
+=*/
+q_threadfunction q_entry;
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    int generation;// pool_generation when the thread was created
+} poolthread_t;
+
+static poolthread_t *pool_threads = NULL;
+static int pool_size = 0;
+static int pool_generation = 0;// bumped to wake the pool for the next RunThreadsOn
+static int pool_busy = 0;      // pool threads still working on the current generation
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+
+static void *CDECL ThreadPoolWorker(void *pParam) {
+    int generation;
+    q_threadpriority priority;
+
+    pthread_mutex_lock(&pool_mutex);
+    threadindex = pool_threads[(long) pParam].index;
+    generation = pool_threads[(long) pParam].generation;
+    pthread_mutex_unlock(&pool_mutex);
+
+    ApplyThreadAffinity(threadindex);
+    priority = DEFAULT_THREAD_PRIORITY;
+
+    pthread_mutex_lock(&pool_mutex);
+    for (;;) {
+        while (pool_generation == generation) {
+            pthread_cond_wait(&pool_wake, &pool_mutex);
+        }
+        generation = pool_generation;
+        pthread_mutex_unlock(&pool_mutex);
+
+        if (priority != g_threadpriority) {
+            priority = g_threadpriority;
+            ApplyThreadPriority(priority);
+        }
+        if (threadindex < workthreads) {
+            RunThreadEntry(q_entry, threadindex);
+        }
+
+        pthread_mutex_lock(&pool_mutex);
+        if (--pool_busy == 0) {
+            pthread_cond_signal(&pool_idle);
+        }
+    }
+    return NULL;
+}
+
+// Grows the pool to g_numthreads - 1 workers, it never shrinks
+static void ThreadPoolCreate() {
+    pthread_attr_t attrib;
+    int i;
+
+    if (pool_size >= g_numthreads - 1) {
+        return;
+    }
+    if (!pool_threads) {
+        SetupThreadAffinity();
+        ApplyThreadAffinity(0);
+    }
+
+    if (pthread_attr_init(&attrib) != 0) {
+        Error("pthread_attr_init failed");
+    }
+#ifdef _POSIX_THREAD_ATTR_STACKSIZE
+    if (pthread_attr_setstacksize(&attrib, 0x400000) != 0) {
+        Error("pthread_attr_setstacksize failed");
+    }
+#endif
+    if (pthread_attr_setdetachstate(&attrib, PTHREAD_CREATE_DETACHED) != 0) {
+        Error("pthread_attr_setdetachstate failed");
+    }
+
+    // Workers look up their slot under pool_mutex, so the array may move while we hold it
+    pthread_mutex_lock(&pool_mutex);
+    pool_threads = (poolthread_t *) realloc(pool_threads, (g_numthreads - 1) * sizeof(poolthread_t));
+    hlassume(pool_threads != NULL, assume_NoMemory);
+    for (i = pool_size; i < g_numthreads - 1; i++) {
+        pool_threads[i].index = i + 1;
+        pool_threads[i].generation = pool_generation;
+        if (pthread_create(&pool_threads[i].thread, &attrib, ThreadPoolWorker, (void *) (long) i) != 0) {
+            Error("pthread_create failed");
+        }
+    }
+    pool_size = g_numthreads - 1;
+    pthread_mutex_unlock(&pool_mutex);
+
+    pthread_attr_destroy(&attrib);
+}
+/*=
+| End Thread pool
+=====================*/
+
+/*
+ * =============
+ * CountCpuQuota
+ * The number of CPUs worth of time a cgroup (docker, kubernetes, systemd slice)
+ * lets us use, 0 when there is no limit.  Only the cgroup mounted at
+ * /sys/fs/cgroup is checked, which is our own cgroup inside a container.
+ * =============
+ */
+static int CountCpuQuota() {
+#ifdef __linux__
+    FILE *f;
+    char quota[32];
+    long long max, period;
+    int cpus;
+
+    max = -1;
+    period = 0;
+
+    // cgroup v2: "max 100000" or "<quota> <period>"
+    f = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (f) {
+        if (fscanf(f, "%31s %lld", quota, &period) == 2 && strcmp(quota, "max")) {
+            max = atoll(quota);
+        }
+        fclose(f);
+    } else {
+        // cgroup v1: quota of -1 means unlimited
+        f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+        if (f) {
+            if (fscanf(f, "%lld", &max) != 1) {
+                max = -1;
+            }
+            fclose(f);
+        }
+        f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+        if (f) {
+            if (fscanf(f, "%lld", &period) != 1) {
+                period = 0;
+            }
+            fclose(f);
+        }
+    }
+
+    if (max <= 0 || period <= 0) {
+        return 0;
+    }
+    cpus = (int) ((max + period - 1) / period);
+    return cpus < 1 ? 1 : cpus;
+#else
+    return 0;
+#endif
+}
+
+// CPUs this process may run on, honouring taskset/cpuset restrictions where we can see them
+static int CountOnlineCpus() {
+    int cpus;
+
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        cpus = CPU_COUNT(&set);
+        if (cpus > 0) {
+            return cpus;
+        }
+    }
+#endif
+    cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : cpus;
+}
+
 void ThreadSetDefault() {
-    if (g_numthreads == -1) {
-        g_numthreads = 1;
+    int quota;
+
+    if (g_numthreads == -1)// not set manually
+    {
+        g_numthreads = CountOnlineCpus();
+        quota = CountCpuQuota();
+        if (quota > 0 && quota < g_numthreads) {
+            Developer(DEVELOPER_LEVEL_MESSAGE, "cgroup cpu quota limits threads from %d to %d\n", g_numthreads, quota);
+            g_numthreads = quota;
+        }
     }
+    ThreadPoolCreate();
 }
 
-typedef void *pthread_addr_t;
 pthread_mutex_t *my_mutex;
 
 void ThreadLock() {
@@ -437,13 +1021,52 @@ void ThreadUnlock() {
     }
 }
 
-q_threadfunction q_entry;
-
-static void *CDECL ThreadEntryStub(void *pParam) {
-    q_entry((int) pParam);
+static pthread_t reporterthread;
+static pthread_mutex_t reportermutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reportercond = PTHREAD_COND_INITIALIZER;
+static bool reporting = false;
+
+static void *CDECL ThreadReporterStub(void *unused) {
+    struct timeval now;
+    struct timespec timeout;
+
+    pthread_mutex_lock(&reportermutex);
+    while (reporting) {
+        gettimeofday(&now, NULL);
+        timeout.tv_sec = now.tv_sec;
+        timeout.tv_nsec = now.tv_usec * 1000 + (long) (PROGRESS_INTERVAL * 1000000000.0);
+        if (timeout.tv_nsec >= 1000000000) {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&reportercond, &reportermutex, &timeout);
+        if (reporting) {
+            UpdatePacifier();
+        }
+    }
+    pthread_mutex_unlock(&reportermutex);
     return NULL;
 }
 
+static void StartProgressReporter() {
+    reporting = true;
+    if (pthread_create(&reporterthread, NULL, ThreadReporterStub, NULL) != 0) {
+        Developer(DEVELOPER_LEVEL_WARNING, "pthread_create for progress reporter failed\n");
+        reporting = false;
+    }
+}
+
+static void StopProgressReporter() {
+    if (reporting) {
+        pthread_mutex_lock(&reportermutex);
+        reporting = false;
+        pthread_cond_signal(&reportercond);
+        pthread_mutex_unlock(&reportermutex);
+        pthread_join(reporterthread, NULL);
+    }
+    UpdatePacifier();
+}
+
 void threads_InitCrit() {
     pthread_mutexattr_t mattrib;
 
@@ -469,52 +1092,39 @@ void threads_UninitCrit() {
  * =============
  */
 void RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func) {
-    int i;
-    pthread_t work_threads[MAX_THREADS];
-    pthread_addr_t status;
-    pthread_attr_t attrib;
     double start, end;
 
-    threadstart = I_FloatTime();
-    start = threadstart;
-    for (i = 0; i < THREADTIMES_SIZE; i++) {
-        threadtimes[i] = 0;
-    }
+    ThreadPoolCreate();
 
-    dispatch = 0;
-    workcount = workcnt;
-    oldf = -1;
-    pacifier = showpacifier;
+    ResetThreadWork(workcnt, g_numthreads, showpacifier);
+    start = threadstart;
     threaded = true;
-    q_entry = func;
 
     if (pacifier) {
         setbuf(stdout, NULL);
     }
 
     threads_InitCrit();
+    StartProgressReporter();
 
-    if (pthread_attr_init(&attrib) == -1) {
-        Error("pthread_attr_init failed");
-    }
-#ifdef _POSIX_THREAD_ATTR_STACKSIZE
-    if (pthread_attr_setstacksize(&attrib, 0x400000) == -1) {
-        Error("pthread_attr_setstacksize failed");
-    }
-#endif
+    // Wake the pool, then do our share of the work as thread 0
+    pthread_mutex_lock(&pool_mutex);
+    q_entry = func;
+    pool_busy = pool_size;
+    pool_generation++;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_mutex);
 
-    for (i = 0; i < g_numthreads; i++) {
-        if (pthread_create(&work_threads[i], &attrib, ThreadEntryStub, (void *) i) == -1) {
-            Error("pthread_create failed");
-        }
-    }
+    threadindex = 0;
+    RunThreadEntry(func, 0);
 
-    for (i = 0; i < g_numthreads; i++) {
-        if (pthread_join(work_threads[i], &status) == -1) {
-            Error("pthread_join failed");
-        }
+    pthread_mutex_lock(&pool_mutex);
+    while (pool_busy > 0) {
+        pthread_cond_wait(&pool_idle, &pool_mutex);
     }
+    pthread_mutex_unlock(&pool_mutex);
 
+    StopProgressReporter();
     threads_UninitCrit();
 
     q_entry = NULL;
@@ -525,6 +1135,7 @@ void RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func) {
         printf("\r%60s\r", "");
     }
 
+    threadruntime += end - start;
     Log(" (%.2f seconds)\n", end - start);
 }
 
@@ -563,23 +1174,16 @@ void ThreadUnlock() {
 }
 
 void RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func) {
-    int i;
     double start, end;
 
-    dispatch = 0;
-    workcount = workcnt;
-    oldf = -1;
-    pacifier = showpacifier;
-    threadstart = I_FloatTime();
+    ResetThreadWork(workcnt, 1, showpacifier);
     start = threadstart;
-    for (i = 0; i < THREADTIMES_SIZE; i++) {
-        threadtimes[i] = 0.0;
-    }
 
     if (pacifier) {
         setbuf(stdout, NULL);
     }
-    func(0);
+    RunThreadEntry(func, 0);
+    UpdatePacifier();
 
     end = I_FloatTime();
 
@@ -587,6 +1191,7 @@ void RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction func) {
         printf("\r%60s\r", "");
     }
 
+    threadruntime += end - start;
     Log(" (%.2f seconds)\n", end - start);
 }
 
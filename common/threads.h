@@ -5,37 +5,53 @@
 #pragma once
 #endif
 
-#define MAX_THREADS 64
-
 typedef enum {
     eThreadPriorityLow = -1,
     eThreadPriorityNormal,
     eThreadPriorityHigh
 } q_threadpriority;
 
+typedef enum {
+    eThreadAffinityNone = 0,// let the scheduler place worker threads
+    eThreadAffinityPin,     // pin each worker thread to its own CPU
+    eThreadAffinityNuma     // keep all worker threads on the NUMA node the program started on
+} q_threadaffinity;
+
 typedef void (*q_threadfunction)(int);
 
+// storage class of per thread variables
 #ifdef SYSTEM_WIN32
-#define DEFAULT_NUMTHREADS -1
-#endif
-#ifdef SYSTEM_POSIX
-#define DEFAULT_NUMTHREADS 1
+#define THREADLOCAL __declspec(thread)
+#else
+#define THREADLOCAL __thread
 #endif
 
+// -1 means one thread per available CPU, see ThreadSetDefault
+#define DEFAULT_NUMTHREADS -1
+
 #define DEFAULT_THREAD_PRIORITY eThreadPriorityNormal
+#define DEFAULT_THREAD_AFFINITY eThreadAffinityNone
 
 extern int g_numthreads;
 extern q_threadpriority g_threadpriority;
+extern q_threadaffinity g_threadaffinity;
 
 extern void ThreadSetPriority(q_threadpriority type);
+extern bool ThreadSetAffinity(const char *const mode);
+extern const char *ThreadAffinityName(q_threadaffinity type);
 extern void ThreadSetDefault();
 extern int GetThreadWork();
+extern int ThreadAtomicAdd(volatile int *value, int amount);// returns the ORIGINAL value
 extern void ThreadLock();
 extern void ThreadUnlock();
 
 extern void RunThreadsOnIndividual(int workcnt, bool showpacifier, q_threadfunction);
 extern void RunThreadsOn(int workcnt, bool showpacifier, q_threadfunction);
 
+// Totals over every RunThreadsOn so far, for profiling
+extern double ThreadRunTime();           // seconds spent in RunThreadsOn
+extern double ThreadBusyTime(int thread);// of those, the seconds the thread was working
+
 #ifdef ZHLT_NETVIS
 extern void threads_InitCrit();
 extern void threads_UninitCrit();
@@ -781,6 +781,7 @@ static void Usage() {
     Log("    -low | -high   : run program an altered priority level\n");
     Log("    -nolog         : don't generate the compile logfiles\n");
     Log("    -threads #     : manually specify the number of threads to run\n");
+    Log("    -affinity mode : none, pin threads to CPUs, or keep them on one numa node\n");
 #ifdef SYSTEM_WIN32
     Log("    -estimate      : display estimated time during compile\n");
 #endif
@@ -847,6 +848,7 @@ static void Settings() {
             break;
     }
     Log("priority            [ %7s ] [ %7s ]\n", tmp, "Normal");
+    Log("affinity            [ %7s ] [ %7s ]\n", ThreadAffinityName(g_threadaffinity), ThreadAffinityName(DEFAULT_THREAD_AFFINITY));
     Log("\n");
 
     // HLBSP Specific Settings
@@ -934,7 +936,7 @@ int main(const int argc, char **argv) {
     for (i = 1; i < argc; i++) {
         if (!strcasecmp(argv[i], "-threads")) {
             if (i < argc) {
-                int g_numthreads = atoi(argv[++i]);
+                g_numthreads = atoi(argv[++i]);
 
                 if (g_numthreads < 1) {
                     Log("Expected value of at least 1 for '-threads'\n");
@@ -1002,6 +1004,15 @@ int main(const int argc, char **argv) {
             g_threadpriority = eThreadPriorityLow;
         } else if (!strcasecmp(argv[i], "-high")) {
             g_threadpriority = eThreadPriorityHigh;
+        } else if (!strcasecmp(argv[i], "-affinity")) {
+            if (i + 1 < argc) {
+                if (!ThreadSetAffinity(argv[++i])) {
+                    Log("Expected none, pin or numa for '-affinity'\n");
+                    Usage();
+                }
+            } else {
+                Usage();
+            }
         } else if (!strcasecmp(argv[i], "-nolog")) {
             g_log = false;
         }
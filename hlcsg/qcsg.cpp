@@ -992,6 +992,7 @@ static void Usage() {
     Log("    -low | -high     : run program an altered priority level\n");
     Log("    -nolog           : don't generate the compile logfiles\n");
     Log("    -threads #       : manually specify the number of threads to run\n");
+    Log("    -affinity mode   : none, pin threads to CPUs, or keep them on one numa node\n");
 #ifdef SYSTEM_WIN32
     Log("    -estimate        : display estimated time during compile\n");
 #endif
@@ -1081,6 +1082,7 @@ static void Settings() {
             break;
     }
     Log("priority              [ %7s ] [ %7s ]\n", tmp, "Normal");
+    Log("affinity              [ %7s ] [ %7s ]\n", ThreadAffinityName(g_threadaffinity), ThreadAffinityName(DEFAULT_THREAD_AFFINITY));
     Log("\n");
 
     // HLCSG Specific Settings
@@ -1206,6 +1208,15 @@ int main(const int argc, char **argv) {
             g_threadpriority = eThreadPriorityLow;
         } else if (!strcasecmp(argv[i], "-high")) {
             g_threadpriority = eThreadPriorityHigh;
+        } else if (!strcasecmp(argv[i], "-affinity")) {
+            if (i + 1 < argc) {
+                if (!ThreadSetAffinity(argv[++i])) {
+                    Log("Expected none, pin or numa for '-affinity'\n");
+                    Usage();
+                }
+            } else {
+                Usage();
+            }
         } else if (!strcasecmp(argv[i], "-nolog")) {
             g_log = false;
         } else if (!strcasecmp(argv[i], "-skyclip")) {
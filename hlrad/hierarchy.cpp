@@ -0,0 +1,477 @@
+#include "qrad.h"
+
+/*
+ * Hierarchical transfers
+ *
+ * The patches of every face form a cluster.  A patch gathers from a whole
+ * cluster through a single transfer when the face looks small from it (its
+ * bounding radius over its distance is below g_hierarchy_error) and the face is
+ * either fully visible or fully hidden from it, judged by a few sample patches
+ * spread over the face.  Everything else, nearby or partly shadowed faces, is
+ * refined into the usual patch to patch transfers.
+ *
+ * Cluster transfers point past the last patch, at g_num_patches + cluster, and
+ * BounceLight keeps the light those indices emit up to date, as the weighted sum
+ * of what the patches of the cluster emit (see GetClusterWeights).
+ *
+ * The lists are built directly as gather lists, so there is no SwapTransfers.
+ */
+
+#define CLUSTER_SAMPLES 3
+
+typedef struct {
+    unsigned firstpatch;
+    unsigned numpatches;
+    vec3_t origin;// area weighted centre of the patches
+    vec3_t normal;
+    vec_t planedist;// PatchPlaneDist of the patches on the face
+    vec_t radius;   // distance from origin to the farthest patch origin
+    unsigned samples[CLUSTER_SAMPLES];
+    unsigned numsamples;
+} cluster_t;
+
+unsigned g_num_clusters = 0;
+
+static cluster_t *s_clusters = NULL;
+static unsigned *s_patchcluster = NULL;
+static vec_t *s_patchtotals = NULL;  // light sent by each patch, as total in MakeScales
+static vec_t *s_clustertotals = NULL;// light sent through the transfers to each cluster
+static vec_t *s_clusterweights = NULL;
+static vec_t *s_clusterscales = NULL;// average weight of the patches of each cluster
+
+static unsigned s_cluster_links = 0;
+static unsigned s_patch_links = 0;
+
+// =====================================================================================
+//  CreateClusters
+//      SortPatches put the patches in face order, so each face is one run
+// =====================================================================================
+static void CreateClusters() {
+    unsigned i, k;
+    patch_t *patch;
+    cluster_t *cluster;
+
+    s_clusters = (cluster_t *) AllocBlock(sizeof(cluster_t) * (g_num_patches + 1));
+    s_patchcluster = (unsigned *) AllocBlock(sizeof(unsigned) * (g_num_patches + 1));
+    hlassume(s_clusters != NULL && s_patchcluster != NULL, assume_NoMemory);
+
+    g_num_clusters = 0;
+    for (i = 0, patch = g_patches; i < g_num_patches; i++, patch++) {
+        cluster = g_num_clusters ? &s_clusters[g_num_clusters - 1] : NULL;
+
+        if (!cluster || g_patches[cluster->firstpatch].faceNumber != patch->faceNumber) {
+            cluster = &s_clusters[g_num_clusters++];
+            cluster->firstpatch = i;
+            cluster->numpatches = 0;
+            VectorCopy(getPlaneFromFaceNumber(patch->faceNumber)->normal, cluster->normal);
+            cluster->planedist = PatchPlaneDist(patch);
+        }
+        cluster->numpatches++;
+        s_patchcluster[i] = g_num_clusters - 1;
+    }
+    hlassume(g_num_patches + g_num_clusters < MAX_PATCHES, assume_MAX_PATCHES);
+
+    for (i = 0, cluster = s_clusters; i < g_num_clusters; i++, cluster++) {
+        vec_t area = 0;
+        vec_t dist, best;
+        vec3_t delta;
+        const unsigned end = cluster->firstpatch + cluster->numpatches;
+
+        VectorClear(cluster->origin);
+        for (k = cluster->firstpatch; k < end; k++) {
+            VectorMA(cluster->origin, g_patches[k].area, g_patches[k].origin, cluster->origin);
+            area += g_patches[k].area;
+        }
+        if (area > 0) {
+            VectorScale(cluster->origin, 1.0 / area, cluster->origin);
+        } else {
+            VectorCopy(g_patches[cluster->firstpatch].origin, cluster->origin);
+        }
+
+        // the samples are the patch nearest to the centre, the one farthest from it,
+        // and the one farthest from that
+        cluster->radius = 0;
+        cluster->samples[0] = cluster->samples[1] = cluster->firstpatch;
+        best = -1;
+        for (k = cluster->firstpatch; k < end; k++) {
+            VectorSubtract(g_patches[k].origin, cluster->origin, delta);
+            dist = VectorLength(delta);
+            if (best < 0 || dist < best) {
+                best = dist;
+                cluster->samples[0] = k;
+            }
+            if (dist > cluster->radius) {
+                cluster->radius = dist;
+                cluster->samples[1] = k;
+            }
+        }
+        cluster->samples[2] = cluster->samples[1];
+        best = 0;
+        for (k = cluster->firstpatch; k < end; k++) {
+            VectorSubtract(g_patches[k].origin, g_patches[cluster->samples[1]].origin, delta);
+            dist = VectorLength(delta);
+            if (dist > best) {
+                best = dist;
+                cluster->samples[2] = k;
+            }
+        }
+
+        cluster->numsamples = 1;
+        if (cluster->samples[1] != cluster->samples[0]) {
+            cluster->samples[cluster->numsamples++] = cluster->samples[1];
+        }
+        if (cluster->samples[2] != cluster->samples[0] && cluster->samples[2] != cluster->samples[1]) {
+            cluster->samples[cluster->numsamples++] = cluster->samples[2];
+        }
+    }
+}
+
+// =====================================================================================
+//  FreeClusters
+// =====================================================================================
+void FreeClusters() {
+    if (s_clusters) {
+        FreeBlock(s_clusters);
+        FreeBlock(s_patchcluster);
+    }
+    if (s_patchtotals) {
+        FreeBlock(s_patchtotals);
+        FreeBlock(s_clustertotals);
+        FreeBlock(s_clusterweights);
+        FreeBlock(s_clusterscales);
+    }
+    s_clusters = NULL;
+    s_patchcluster = NULL;
+    s_patchtotals = NULL;
+    s_clustertotals = NULL;
+    s_clusterweights = NULL;
+    s_clusterscales = NULL;
+    g_num_clusters = 0;
+}
+
+// =====================================================================================
+//  GetClusterWeights
+//      What each patch of cluster emits counts into the cluster with its weight,
+//      area * 0.5 / total of the patch, so that gathering cluster light with the
+//      plain form factor matches gathering from each patch with its normalized one.
+//      The weights are divided by their average and the cluster transfers carry it
+//      instead, which keeps those in the range of the patch transfers for -transferbits
+// =====================================================================================
+const vec_t *GetClusterWeights(const unsigned cluster, unsigned *firstpatch, unsigned *numpatches) {
+    *firstpatch = s_clusters[cluster].firstpatch;
+    *numpatches = s_clusters[cluster].numpatches;
+    return s_clusterweights + s_clusters[cluster].firstpatch;
+}
+
+// =====================================================================================
+//  CountVisibleSamples
+//      How many sample patches of cluster origin sees, or -1 when one is seen
+//      through a custom shadow, which can't be told apart from the cluster level
+// =====================================================================================
+static int CountVisibleSamples(const vec3_t origin, const cluster_t *const cluster) {
+    unsigned s;
+    int visible = 0;
+
+    for (s = 0; s < cluster->numsamples; s++) {
+        const vec_t *sample = g_patches[cluster->samples[s]].origin;
+#ifdef HLRAD_HULLU
+        vec3_t transparency = {1.0, 1.0, 1.0};
+#endif
+
+        if (TestLine(origin, sample) != CONTENTS_EMPTY) {
+            continue;
+        }
+#ifdef HLRAD_HULLU
+        if (TestSegmentAgainstOpaqueList(origin, sample, transparency)) {
+            continue;
+        }
+        if (g_customshadow_with_bouncelight && (transparency[0] != 1.0 || transparency[1] != 1.0 || transparency[2] != 1.0)) {
+            return -1;
+        }
+#else
+        if (TestSegmentAgainstOpaqueList(origin, sample)) {
+            continue;
+        }
+#endif
+        visible++;
+    }
+    return visible;
+}
+
+// =====================================================================================
+//  MakeHierarchicalLinks
+//      Builds the gather list of each patch, holding the raw form factors,
+//      capped like MakeScales does, until the totals are known
+// =====================================================================================
+#ifdef SYSTEM_WIN32
+#pragma warning(push)
+#pragma warning(disable : 4100)// unreferenced formal parameter
+#endif
+static void MakeHierarchicalLinks(int threadnum) {
+    int j;
+    unsigned c, k;
+    patch_t *patch;
+    vec3_t origin;
+    vec3_t delta;
+    vec_t dist, dot1, dot2, trans, area;
+    const vec_t *normal;
+    vec_t planedist;
+    const cluster_t *cluster;
+    unsigned cluster_links = 0;
+    unsigned patch_links = 0;
+
+    transfer_raw_index_t *tIndex_All = (transfer_raw_index_t *) AllocBlock(sizeof(transfer_raw_index_t) * (g_num_patches + 1));
+    transfer_data_t *tData_All = (transfer_data_t *) AllocBlock(sizeof(transfer_data_t) * (g_num_patches + 1));
+
+    hlassume(tIndex_All != NULL && tData_All != NULL, assume_NoMemory);
+
+    while (1) {
+        j = GetThreadWork();
+        if (j == -1) {
+            break;
+        }
+
+        patch = &g_patches[j];
+        patch->iIndex = 0;
+        patch->iData = 0;
+
+        VectorCopy(patch->origin, origin);
+        normal = s_clusters[s_patchcluster[j]].normal;
+        planedist = s_clusters[s_patchcluster[j]].planedist;
+        area = patch->area;
+
+        for (c = 0, cluster = s_clusters; c < g_num_clusters; c++, cluster++) {
+            vec_t front;
+
+            if (c == s_patchcluster[j]) {
+                continue;
+            }
+            if (DotProduct(origin, cluster->normal) <= cluster->planedist + MINIMUM_PATCH_DISTANCE) {
+                continue;// patch is behind this face
+            }
+            front = DotProduct(cluster->origin, normal) - planedist;
+            if (front + cluster->radius <= MINIMUM_PATCH_DISTANCE) {
+                continue;// the whole face is behind the patch
+            }
+
+            if (cluster->numpatches > 1 && front - cluster->radius > MINIMUM_PATCH_DISTANCE) {
+                VectorSubtract(origin, cluster->origin, delta);
+                dist = VectorNormalize(delta);
+
+                if (dist > 0 && cluster->radius < dist * g_hierarchy_error) {
+                    int visible = CountVisibleSamples(origin, cluster);
+
+                    if (visible == 0) {
+                        continue;
+                    }
+                    if (visible == (int) cluster->numsamples) {
+                        dot1 = DotProduct(delta, cluster->normal);
+                        dot2 = -DotProduct(delta, normal);
+                        trans = (dot1 * dot2) / (dist * dist);
+
+                        if (trans > 0) {
+                            if (trans * area > 0.4f) {
+                                trans = 0.4f / area;
+                            }
+                            tIndex_All[patch->iData] = g_num_patches + c;
+                            tData_All[patch->iData] = trans;
+                            patch->iData++;
+                            cluster_links++;
+                        }
+                        continue;
+                    }
+                }
+            }
+
+            // refine into the patches of the face
+            for (k = cluster->firstpatch; k < cluster->firstpatch + cluster->numpatches; k++) {
+                const vec_t *origin2 = g_patches[k].origin;
+#ifdef HLRAD_HULLU
+                vec3_t transparency = {1.0, 1.0, 1.0};
+#endif
+
+                if (DotProduct(origin2, normal) <= planedist + MINIMUM_PATCH_DISTANCE) {
+                    continue;
+                }
+                if (TestLine(origin, origin2) != CONTENTS_EMPTY) {
+                    continue;
+                }
+#ifdef HLRAD_HULLU
+                if (TestSegmentAgainstOpaqueList(origin, origin2, transparency)) {
+                    continue;
+                }
+#else
+                if (TestSegmentAgainstOpaqueList(origin, origin2)) {
+                    continue;
+                }
+#endif
+
+                VectorSubtract(origin, origin2, delta);
+                dist = VectorNormalize(delta);
+                dot1 = DotProduct(delta, cluster->normal);
+                dot2 = -DotProduct(delta, normal);
+
+                trans = (dot1 * dot2) / (dist * dist);
+
+#ifdef HLRAD_HULLU
+                if (g_customshadow_with_bouncelight) {
+                    trans = trans * VectorAvg(transparency);
+                }
+#endif
+
+                if (trans > 0) {
+                    if (trans * area > 0.4f) {
+                        trans = 0.4f / area;
+                    }
+                    tIndex_All[patch->iData] = k;
+                    tData_All[patch->iData] = trans;
+                    patch->iData++;
+                    patch_links++;
+                }
+            }
+        }
+
+        if (patch->iData) {
+            unsigned data_size = patch->iData * sizeof(transfer_data_t);
+
+            patch->tData = (transfer_data_t *) AllocBlock(data_size);
+            patch->tIndex = CompressTransferIndicies(tIndex_All, patch->iData, &patch->iIndex);
+
+            hlassume(patch->tData != NULL, assume_NoMemory);
+            hlassume(patch->tIndex != NULL, assume_NoMemory);
+
+            memcpy(patch->tData, tData_All, data_size);
+
+            ThreadLock();
+            g_transfer_data_bytes += data_size;
+            ThreadUnlock();
+        }
+    }
+
+    FreeBlock(tIndex_All);
+    FreeBlock(tData_All);
+
+    ThreadLock();
+    s_cluster_links += cluster_links;
+    s_patch_links += patch_links;
+    g_total_transfer += cluster_links + patch_links;
+    ThreadUnlock();
+}
+
+// =====================================================================================
+//  SumHierarchicalTotals
+//      Adds up the light each patch sends, the way total is in MakeScales.  Light
+//      sent through a cluster transfer counts for every patch of the cluster.
+//      Single threaded so that the sums don't depend on the thread timing.
+// =====================================================================================
+static void SumHierarchicalTotals() {
+    unsigned i, j, x, y;
+    patch_t *patch;
+
+    s_patchtotals = (vec_t *) AllocBlock(sizeof(vec_t) * (g_num_patches + 1));
+    s_clustertotals = (vec_t *) AllocBlock(sizeof(vec_t) * (g_num_clusters + 1));
+    s_clusterweights = (vec_t *) AllocBlock(sizeof(vec_t) * (g_num_patches + 1));
+    s_clusterscales = (vec_t *) AllocBlock(sizeof(vec_t) * (g_num_clusters + 1));
+    hlassume(s_patchtotals != NULL && s_clustertotals != NULL && s_clusterweights != NULL && s_clusterscales != NULL, assume_NoMemory);
+
+    for (j = 0, patch = g_patches; j < g_num_patches; j++, patch++) {
+        const transfer_index_t *tIndex = patch->tIndex;
+        const transfer_data_t *tData = patch->tData;
+
+        for (x = 0; x < patch->iIndex; x++, tIndex++) {
+            unsigned size = tIndex->size + 1;
+            unsigned patchnum = tIndex->index;
+
+            for (y = 0; y < size; y++, tData++, patchnum++) {
+                if (patchnum < g_num_patches) {
+                    s_patchtotals[patchnum] += (*tData) * patch->area;
+                } else {
+                    s_clustertotals[patchnum - g_num_patches] += (*tData) * patch->area;
+                }
+            }
+        }
+    }
+
+    for (i = 0, patch = g_patches; i < g_num_patches; i++, patch++) {
+        s_patchtotals[i] += s_clustertotals[s_patchcluster[i]];
+        if (s_patchtotals[i] > 0) {
+            s_clusterweights[i] = patch->area * 0.5 / s_patchtotals[i];
+            s_clusterscales[s_patchcluster[i]] += s_clusterweights[i];
+        }
+    }
+
+    for (i = 0; i < g_num_clusters; i++) {
+        const cluster_t *cluster = &s_clusters[i];
+
+        s_clusterscales[i] /= cluster->numpatches;
+        if (s_clusterscales[i] > 0) {
+            for (j = cluster->firstpatch; j < cluster->firstpatch + cluster->numpatches; j++) {
+                s_clusterweights[j] /= s_clusterscales[i];
+            }
+        }
+    }
+}
+
+// =====================================================================================
+//  NormalizeHierarchicalLinks
+//      Scales the raw form factors like MakeScales does, patch transfers by the
+//      area and total of the patch sending, cluster transfers by the average of
+//      the weights GetClusterWeights hands out
+// =====================================================================================
+static void NormalizeHierarchicalLinks(int patchnum) {
+    patch_t *patch = &g_patches[patchnum];
+    transfer_index_t *tIndex = patch->tIndex;
+    transfer_data_t *tData = patch->tData;
+    unsigned x, y;
+
+    for (x = 0; x < patch->iIndex; x++, tIndex++) {
+        unsigned size = tIndex->size + 1;
+        unsigned patchnum2 = tIndex->index;
+
+        for (y = 0; y < size; y++, tData++, patchnum2++) {
+            if (patchnum2 < g_num_patches) {
+                vec_t trans = (*tData) * g_patches[patchnum2].area * INVERSE_TRANSFER_SCALE;
+
+                if (trans >= TRANSFER_SCALE_MAX) {
+                    trans = TRANSFER_SCALE_MAX;
+                }
+                (*tData) = trans * 0.5 / s_patchtotals[patchnum2];
+            } else {
+                (*tData) = (*tData) * INVERSE_TRANSFER_SCALE * s_clusterscales[patchnum2 - g_num_patches];
+            }
+        }
+    }
+}
+
+#ifdef SYSTEM_WIN32
+#pragma warning(pop)
+#endif
+
+// =====================================================================================
+//  MakeScalesHierarchical
+// =====================================================================================
+void MakeScalesHierarchical() {
+    hlassume(g_num_patches < MAX_PATCHES, assume_MAX_PATCHES);
+
+    if (g_incremental) {
+        Warning("-incremental is not supported by -hierarchical, the transfers will not be cached");
+    }
+#ifdef HLRAD_HULLU
+    if (g_rgb_transfers) {
+        Warning("-rgbtransfers is not supported by -hierarchical, using single channel transfers");
+        g_rgb_transfers = false;
+    }
+#endif
+
+    FreeClusters();
+    CreateClusters();
+
+    s_cluster_links = 0;
+    s_patch_links = 0;
+
+    NamedRunThreadsOn(g_num_patches, g_estimate, MakeHierarchicalLinks);
+    SumHierarchicalTotals();
+    NamedRunThreadsOnIndividual(g_num_patches, g_estimate, NormalizeHierarchicalLinks);
+
+    Log("%u face clusters, %u cluster transfers, %u patch transfers\n", g_num_clusters, s_cluster_links, s_patch_links);
+}
@@ -195,6 +195,10 @@ SOURCE=..\common\winding.cpp
 # End Group
 # Begin Source File
 
+SOURCE=.\hierarchy.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\lerp.cpp
 # End Source File
 # Begin Source File
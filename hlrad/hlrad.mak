@@ -50,6 +50,8 @@ CLEAN :
 	-@erase "$(INTDIR)\cmdlib.sbr"
 	-@erase "$(INTDIR)\filelib.obj"
 	-@erase "$(INTDIR)\filelib.sbr"
+	-@erase "$(INTDIR)\hierarchy.obj"
+	-@erase "$(INTDIR)\hierarchy.sbr"
 	-@erase "$(INTDIR)\lerp.obj"
 	-@erase "$(INTDIR)\lerp.sbr"
 	-@erase "$(INTDIR)\lightmap.obj"
@@ -108,6 +110,7 @@ BSC32_SBRS= \
 	"$(INTDIR)\scriplib.sbr" \
 	"$(INTDIR)\threads.sbr" \
 	"$(INTDIR)\winding.sbr" \
+	"$(INTDIR)\hierarchy.sbr" \
 	"$(INTDIR)\lerp.sbr" \
 	"$(INTDIR)\lightmap.sbr" \
 	"$(INTDIR)\mathutil.sbr" \
@@ -139,6 +142,7 @@ LINK32_OBJS= \
 	"$(INTDIR)\scriplib.obj" \
 	"$(INTDIR)\threads.obj" \
 	"$(INTDIR)\winding.obj" \
+	"$(INTDIR)\hierarchy.obj" \
 	"$(INTDIR)\lerp.obj" \
 	"$(INTDIR)\lightmap.obj" \
 	"$(INTDIR)\mathutil.obj" \
@@ -176,6 +180,8 @@ CLEAN :
 	-@erase "$(INTDIR)\cmdlib.sbr"
 	-@erase "$(INTDIR)\filelib.obj"
 	-@erase "$(INTDIR)\filelib.sbr"
+	-@erase "$(INTDIR)\hierarchy.obj"
+	-@erase "$(INTDIR)\hierarchy.sbr"
 	-@erase "$(INTDIR)\lerp.obj"
 	-@erase "$(INTDIR)\lerp.sbr"
 	-@erase "$(INTDIR)\lightmap.obj"
@@ -236,6 +242,7 @@ BSC32_SBRS= \
 	"$(INTDIR)\scriplib.sbr" \
 	"$(INTDIR)\threads.sbr" \
 	"$(INTDIR)\winding.sbr" \
+	"$(INTDIR)\hierarchy.sbr" \
 	"$(INTDIR)\lerp.sbr" \
 	"$(INTDIR)\lightmap.sbr" \
 	"$(INTDIR)\mathutil.sbr" \
@@ -267,6 +274,7 @@ LINK32_OBJS= \
 	"$(INTDIR)\scriplib.obj" \
 	"$(INTDIR)\threads.obj" \
 	"$(INTDIR)\winding.obj" \
+	"$(INTDIR)\hierarchy.obj" \
 	"$(INTDIR)\lerp.obj" \
 	"$(INTDIR)\lightmap.obj" \
 	"$(INTDIR)\mathutil.obj" \
@@ -304,6 +312,8 @@ CLEAN :
 	-@erase "$(INTDIR)\cmdlib.sbr"
 	-@erase "$(INTDIR)\filelib.obj"
 	-@erase "$(INTDIR)\filelib.sbr"
+	-@erase "$(INTDIR)\hierarchy.obj"
+	-@erase "$(INTDIR)\hierarchy.sbr"
 	-@erase "$(INTDIR)\lerp.obj"
 	-@erase "$(INTDIR)\lerp.sbr"
 	-@erase "$(INTDIR)\lightmap.obj"
@@ -364,6 +374,7 @@ BSC32_SBRS= \
 	"$(INTDIR)\scriplib.sbr" \
 	"$(INTDIR)\threads.sbr" \
 	"$(INTDIR)\winding.sbr" \
+	"$(INTDIR)\hierarchy.sbr" \
 	"$(INTDIR)\lerp.sbr" \
 	"$(INTDIR)\lightmap.sbr" \
 	"$(INTDIR)\mathutil.sbr" \
@@ -395,6 +406,7 @@ LINK32_OBJS= \
 	"$(INTDIR)\scriplib.obj" \
 	"$(INTDIR)\threads.obj" \
 	"$(INTDIR)\winding.obj" \
+	"$(INTDIR)\hierarchy.obj" \
 	"$(INTDIR)\lerp.obj" \
 	"$(INTDIR)\lightmap.obj" \
 	"$(INTDIR)\mathutil.obj" \
@@ -432,6 +444,8 @@ CLEAN :
 	-@erase "$(INTDIR)\cmdlib.sbr"
 	-@erase "$(INTDIR)\filelib.obj"
 	-@erase "$(INTDIR)\filelib.sbr"
+	-@erase "$(INTDIR)\hierarchy.obj"
+	-@erase "$(INTDIR)\hierarchy.sbr"
 	-@erase "$(INTDIR)\lerp.obj"
 	-@erase "$(INTDIR)\lerp.sbr"
 	-@erase "$(INTDIR)\lightmap.obj"
@@ -492,6 +506,7 @@ BSC32_SBRS= \
 	"$(INTDIR)\scriplib.sbr" \
 	"$(INTDIR)\threads.sbr" \
 	"$(INTDIR)\winding.sbr" \
+	"$(INTDIR)\hierarchy.sbr" \
 	"$(INTDIR)\lerp.sbr" \
 	"$(INTDIR)\lightmap.sbr" \
 	"$(INTDIR)\mathutil.sbr" \
@@ -523,6 +538,7 @@ LINK32_OBJS= \
 	"$(INTDIR)\scriplib.obj" \
 	"$(INTDIR)\threads.obj" \
 	"$(INTDIR)\winding.obj" \
+	"$(INTDIR)\hierarchy.obj" \
 	"$(INTDIR)\lerp.obj" \
 	"$(INTDIR)\lightmap.obj" \
 	"$(INTDIR)\mathutil.obj" \
@@ -649,6 +665,11 @@ SOURCE=..\common\winding.cpp
 	$(CPP) $(CPP_PROJ) $(SOURCE)
 
 
+SOURCE=.\hierarchy.cpp
+
+"$(INTDIR)\hierarchy.obj"	"$(INTDIR)\hierarchy.sbr" : $(SOURCE) "$(INTDIR)"
+
+
 SOURCE=.\lerp.cpp
 
 "$(INTDIR)\lerp.obj"	"$(INTDIR)\lerp.sbr" : $(SOURCE) "$(INTDIR)"
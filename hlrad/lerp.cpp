@@ -143,35 +143,103 @@ static void LerpTriangle(const lerpTriangulation_t *const trian, const vec3_t po
     }
 }
 
+// =====================================================================================
+//  InsertNearest
+//      Keeps best[] sorted by distance, ties going to the lower point index
+// =====================================================================================
+static void InsertNearest(lerpDist_t *best, unsigned *numbest, const unsigned maxbest, const vec_t dist, const unsigned patch) {
+    unsigned x = *numbest;
+
+    if (x == maxbest) {
+        if (dist > best[x - 1].dist || (dist == best[x - 1].dist && patch > best[x - 1].patch)) {
+            return;
+        }
+        x--;
+    } else {
+        (*numbest)++;
+    }
+
+    for (; x > 0 && (dist < best[x - 1].dist || (dist == best[x - 1].dist && patch < best[x - 1].patch)); x--) {
+        best[x] = best[x - 1];
+    }
+    best[x].dist = dist;
+    best[x].patch = patch;
+}
+
+// =====================================================================================
+//  FindNearest_r
+//      Walks the k-d tree built by BuildLerpTree, the node for [lo, hi) being the
+//      point at the middle. facenum < 0 accepts points of any face.
+// =====================================================================================
+static void FindNearest_r(const lerpTriangulation_t *const trian, const vec3_t point, unsigned lo, unsigned hi,
+                          lerpDist_t *best, unsigned *numbest, const unsigned maxbest, const int facenum) {
+    while (lo < hi) {
+        const unsigned mid = (lo + hi) / 2;
+        const unsigned x = trian->kdorder[mid];
+        const patch_t *patch = trian->points[x];
+        const int axis = trian->kdaxis[mid];
+        vec_t d;
+
+        if (facenum < 0 || patch->faceNumber == facenum) {
+            vec3_t delta;
+
+            VectorSubtract(patch->origin, point, delta);
+            InsertNearest(best, numbest, maxbest, VectorLength(delta), x);
+        }
+
+        // search the side of the split the point is on first, then the other if it can still be closer
+        d = point[axis] - patch->origin[axis];
+        if (d < 0) {
+            FindNearest_r(trian, point, lo, mid, best, numbest, maxbest, facenum);
+            if (*numbest == maxbest && -d > best[*numbest - 1].dist + ON_EPSILON) {
+                return;
+            }
+            lo = mid + 1;
+        } else {
+            FindNearest_r(trian, point, mid + 1, hi, best, numbest, maxbest, facenum);
+            if (*numbest == maxbest && d > best[*numbest - 1].dist + ON_EPSILON) {
+                return;
+            }
+            hi = mid;
+        }
+    }
+}
+
+// =====================================================================================
+//  FindDists
+//      Fills in trian->dists with the LERP_NEAREST_POINTS points closest to point
+// =====================================================================================
+static void FindDists(const lerpTriangulation_t *const trian, const vec3_t point) {
+    unsigned numbest = 0;
+
+    FindNearest_r(trian, point, 0, trian->numpoints, trian->dists, &numbest, LERP_NEAREST_POINTS, -1);
+}
+
 // =====================================================================================
 //  LerpNearest
 // =====================================================================================
 #ifdef ZHLT_TEXLIGHT
-static void LerpNearest(const lerpTriangulation_t *const trian, vec3_t result, int style)//LRC
+static void LerpNearest(const lerpTriangulation_t *const trian, const vec3_t point, vec3_t result, int style)//LRC
 #else
-static void LerpNearest(const lerpTriangulation_t *const trian, vec3_t result)
+static void LerpNearest(const lerpTriangulation_t *const trian, const vec3_t point, vec3_t result)
 #endif
 {
-    unsigned x;
-    unsigned numpoints = trian->numpoints;
-    patch_t *patch;
+    lerpDist_t nearest;
+    unsigned found = 0;
 
     // Find nearest in original face
-    for (x = 0; x < numpoints; x++) {
-        patch = trian->points[trian->dists[x].patch];
-
-        if (patch->faceNumber == trian->facenum) {
+    FindNearest_r(trian, point, 0, trian->numpoints, &nearest, &found, 1, trian->facenum);
+    if (found) {
 #ifdef ZHLT_TEXLIGHT
-            VectorCopy(*GetTotalLight(patch, style), result);//LRC
+        VectorCopy(*GetTotalLight(trian->points[nearest.patch], style), result);//LRC
 #else
-            VectorCopy(patch->totallight, result);
+        VectorCopy(trian->points[nearest.patch]->totallight, result);
 #endif
-            return;
-        }
+        return;
     }
 
     // If none in nearest face, settle for nearest
-    if (numpoints) {
+    if (trian->numpoints) {
 #ifdef ZHLT_TEXLIGHT
         VectorCopy(*GetTotalLight(trian->points[trian->dists[0].patch], style), result);//LRC
 #else
@@ -273,41 +341,6 @@ static bool LerpEdge(const lerpTriangulation_t *const trian, const vec3_t point,
 //
 // =====================================================================================
 
-// =====================================================================================
-//  dist_sorter
-// =====================================================================================
-static int CDECL dist_sorter(const void *p1, const void *p2) {
-    lerpDist_t *dist1 = (lerpDist_t *) p1;
-    lerpDist_t *dist2 = (lerpDist_t *) p2;
-
-    if (dist1->dist < dist2->dist) {
-        return -1;
-    } else if (dist1->dist > dist2->dist) {
-        return 1;
-    } else {
-        return 0;
-    }
-}
-
-// =====================================================================================
-//  FindDists
-// =====================================================================================
-static void FindDists(const lerpTriangulation_t *const trian, const vec3_t point) {
-    unsigned x;
-    unsigned numpoints = trian->numpoints;
-    patch_t **patch = trian->points;
-    lerpDist_t *dists = trian->dists;
-    vec3_t delta;
-
-    for (x = 0; x < numpoints; x++, patch++, dists++) {
-        VectorSubtract((*patch)->origin, point, delta);
-        dists->dist = VectorLength(delta);
-        dists->patch = x;
-    }
-
-    qsort((void *) trian->dists, (size_t) numpoints, sizeof(lerpDist_t), dist_sorter);
-}
-
 // =====================================================================================
 //  SampleTriangulation
 // =====================================================================================
@@ -317,6 +350,9 @@ void SampleTriangulation(const lerpTriangulation_t *const trian, vec3_t point, v
 void SampleTriangulation(const lerpTriangulation_t *const trian, vec3_t point, vec3_t result)
 #endif
 {
+    vec3_t unsnapped;// the nearest patch is looked up from where the sample really is
+
+    VectorCopy(point, unsnapped);
     FindDists(trian, point);
 
     if ((trian->numpoints > 3) && (g_lerp_enabled)) {
@@ -360,9 +396,9 @@ void SampleTriangulation(const lerpTriangulation_t *const trian, vec3_t point, v
     }
 
 #ifdef ZHLT_TEXLIGHT
-    LerpNearest(trian, result, style);//LRC
+    LerpNearest(trian, unsnapped, result, style);//LRC
 #else
-    LerpNearest(trian, result);
+    LerpNearest(trian, unsnapped, result);
 #endif
 }
 
@@ -374,11 +410,8 @@ static void AddPatchToTriangulation(lerpTriangulation_t *trian, patch_t *patch)
         int pnum = trian->numpoints;
 
         if (pnum >= trian->maxpoints) {
-            trian->points = (patch_t **) realloc(trian->points, sizeof(patch_t *) * (trian->maxpoints + DEFAULT_MAX_LERP_POINTS));
-
-            hlassume(trian->points != NULL, assume_NoMemory);
-            memset(trian->points + trian->maxpoints, 0, sizeof(patch_t *) * DEFAULT_MAX_LERP_POINTS);// clear the new block
-
+            trian->points = (patch_t **) FaceRealloc(trian->points, sizeof(patch_t *) * trian->maxpoints,
+                                                     sizeof(patch_t *) * (trian->maxpoints + DEFAULT_MAX_LERP_POINTS));
             trian->maxpoints += DEFAULT_MAX_LERP_POINTS;
         }
 
@@ -424,10 +457,8 @@ static void CreateWalls(lerpTriangulation_t *trian, const dface_t *const face) {
                 lerpWall_t *wall;
 
                 if (trian->numwalls >= trian->maxwalls) {
-                    trian->walls =
-                            (lerpWall_t *) realloc(trian->walls, sizeof(lerpWall_t) * (trian->maxwalls + DEFAULT_MAX_LERP_WALLS));
-                    hlassume(trian->walls != NULL, assume_NoMemory);
-                    memset(trian->walls + trian->maxwalls, 0, sizeof(lerpWall_t) * DEFAULT_MAX_LERP_WALLS);// clear the new block
+                    trian->walls = (lerpWall_t *) FaceRealloc(trian->walls, sizeof(lerpWall_t) * trian->maxwalls,
+                                                              sizeof(lerpWall_t) * (trian->maxwalls + DEFAULT_MAX_LERP_WALLS));
                     trian->maxwalls += DEFAULT_MAX_LERP_WALLS;
                 }
 
@@ -472,36 +503,108 @@ static void CreateWalls(lerpTriangulation_t *trian, const dface_t *const face) {
 }
 
 // =====================================================================================
-//  AllocTriangulation
+//  BuildLerpTree_r
+//      Sorts kdorder[lo, hi) into an implicit k-d tree: the middle point splits the
+//      range on the axis along which the points spread the most
 // =====================================================================================
-static lerpTriangulation_t *AllocTriangulation() {
-    lerpTriangulation_t *trian = (lerpTriangulation_t *) calloc(1, sizeof(lerpTriangulation_t));
+static void BuildLerpTree_r(lerpTriangulation_t *trian, unsigned lo, unsigned hi) {
+    unsigned *order = trian->kdorder;
+    vec3_t mins;
+    vec3_t maxs;
+    unsigned mid;
+    unsigned left;
+    unsigned right;
+    unsigned x;
+    int axis;
 
-    trian->maxpoints = DEFAULT_MAX_LERP_POINTS;
-    trian->maxwalls = DEFAULT_MAX_LERP_WALLS;
+    if (lo >= hi) {
+        return;
+    }
 
-    trian->points = (patch_t **) calloc(DEFAULT_MAX_LERP_POINTS, sizeof(patch_t *));
+    VectorFill(mins, 99999);
+    VectorFill(maxs, -99999);
+    for (x = lo; x < hi; x++) {
+        const vec_t *origin = trian->points[order[x]]->origin;
+        int i;
 
-    trian->walls = (lerpWall_t *) calloc(DEFAULT_MAX_LERP_WALLS, sizeof(lerpWall_t));
+        for (i = 0; i < 3; i++) {
+            if (origin[i] < mins[i]) {
+                mins[i] = origin[i];
+            }
+            if (origin[i] > maxs[i]) {
+                maxs[i] = origin[i];
+            }
+        }
+    }
+    axis = 0;
+    if (maxs[1] - mins[1] > maxs[axis] - mins[axis]) {
+        axis = 1;
+    }
+    if (maxs[2] - mins[2] > maxs[axis] - mins[axis]) {
+        axis = 2;
+    }
 
-    hlassume(trian->points != NULL, assume_NoMemory);
-    hlassume(trian->walls != NULL, assume_NoMemory);
+    // quickselect the median on that axis
+    mid = (lo + hi) / 2;
+    left = lo;
+    right = hi - 1;
+    while (left < right) {
+        const vec_t pivot = trian->points[order[(left + right) / 2]]->origin[axis];
+        unsigned i = left;
+        unsigned j = right;
+
+        while (i <= j) {
+            while (trian->points[order[i]]->origin[axis] < pivot) {
+                i++;
+            }
+            while (trian->points[order[j]]->origin[axis] > pivot) {
+                j--;
+            }
+            if (i <= j) {
+                const unsigned tmp = order[i];
+
+                order[i] = order[j];
+                order[j] = tmp;
+                i++;
+                if (j == 0) {
+                    break;
+                }
+                j--;
+            }
+        }
+        if (mid <= j) {
+            right = j;
+        } else if (mid >= i) {
+            left = i;
+        } else {
+            break;
+        }
+    }
 
-    return trian;
+    trian->kdaxis[mid] = axis;
+    BuildLerpTree_r(trian, lo, mid);
+    BuildLerpTree_r(trian, mid + 1, hi);
 }
 
 // =====================================================================================
-//  FreeTriangulation
+//  AllocTriangulation
 // =====================================================================================
-void FreeTriangulation(lerpTriangulation_t *trian) {
-    free(trian->dists);
-    free(trian->points);
-    free(trian->walls);
-    free(trian);
+static lerpTriangulation_t *AllocTriangulation() {
+    lerpTriangulation_t *trian = (lerpTriangulation_t *) FaceAlloc(sizeof(lerpTriangulation_t));
+
+    trian->maxpoints = DEFAULT_MAX_LERP_POINTS;
+    trian->maxwalls = DEFAULT_MAX_LERP_WALLS;
+
+    trian->points = (patch_t **) FaceAlloc(DEFAULT_MAX_LERP_POINTS * sizeof(patch_t *));
+
+    trian->walls = (lerpWall_t *) FaceAlloc(DEFAULT_MAX_LERP_WALLS * sizeof(lerpWall_t));
+
+    return trian;
 }
 
 // =====================================================================================
 //  CreateTriangulation
+//      Lives in the face arena of the calling thread, until its next ResetFaceArena
 // =====================================================================================
 lerpTriangulation_t *CreateTriangulation(const unsigned int facenum) {
     const dface_t *f = g_dfaces + facenum;
@@ -542,12 +645,21 @@ lerpTriangulation_t *CreateTriangulation(const unsigned int facenum) {
         }
     }
 
-    trian->dists = (lerpDist_t *) calloc(trian->numpoints, sizeof(lerpDist_t));
+    trian->dists = (lerpDist_t *) FaceAlloc(LERP_NEAREST_POINTS * sizeof(lerpDist_t));
+
 #ifdef HLRAD_HULLU
     //Get rid off error that seems to happen with some opaque faces (when opaque face have all edges 'out' of map)
     if (trian->numpoints != 0)
 #endif
-        hlassume(trian->dists != NULL, assume_NoMemory);
+    {
+        trian->kdorder = (unsigned *) FaceAlloc(trian->numpoints * sizeof(unsigned));
+        trian->kdaxis = (unsigned char *) FaceAlloc(trian->numpoints * sizeof(unsigned char));
+
+        for (j = 0; j < trian->numpoints; j++) {
+            trian->kdorder[j] = j;
+        }
+        BuildLerpTree_r(trian, 0, trian->numpoints);
+    }
 
     return trian;
 }
@@ -3,6 +3,7 @@
 edgeshare_t g_edgeshare[MAX_MAP_EDGES];
 vec3_t g_face_centroids[MAX_MAP_EDGES];
 bool g_sky_lighting_fix = DEFAULT_SKY_LIGHTING_FIX;
+bool g_skycache = DEFAULT_SKY_CACHE;
 
 #define TEXTURE_STEP 16.0
 
@@ -101,19 +102,14 @@ static const char *TextureNameFromFace(const dface_t *const f) {
 }
 
 // =====================================================================================
-//  CalcFaceExtents
-//      Fills in s->texmins[] and s->texsize[]
-//      also sets exactmins[] and exactmaxs[]
+//  GetFaceTexBounds
+//      The texture space bounds of a face's vertexes
 // =====================================================================================
-static void CalcFaceExtents(lightinfo_t *l) {
-    const int facenum = l->surfnum;
-    dface_t *s;
-    vec_t mins[2], maxs[2], val;
+static void GetFaceTexBounds(const dface_t *const s, vec_t mins[2], vec_t maxs[2]) {
+    vec_t val;
     int i, j, e;
-    dvertex_t *v;
-    texinfo_t *tex;
-
-    s = l->face;
+    const dvertex_t *v;
+    const texinfo_t *tex;
 
     mins[0] = mins[1] = 999999;
     maxs[0] = maxs[1] = -99999;
@@ -139,6 +135,24 @@ static void CalcFaceExtents(lightinfo_t *l) {
             }
         }
     }
+}
+
+// =====================================================================================
+//  CalcFaceExtents
+//      Fills in s->texmins[] and s->texsize[]
+//      also sets exactmins[] and exactmaxs[]
+// =====================================================================================
+static void CalcFaceExtents(lightinfo_t *l) {
+    const int facenum = l->surfnum;
+    dface_t *s;
+    vec_t mins[2], maxs[2];
+    int i, e;
+    dvertex_t *v;
+    texinfo_t *tex;
+
+    s = l->face;
+    tex = &g_texinfo[s->texinfo];
+    GetFaceTexBounds(s, mins, maxs);
 
     for (i = 0; i < 2; i++) {
         l->exactmins[i] = mins[i];
@@ -730,11 +744,129 @@ typedef struct {
 } facelight_t;
 
 static directlight_t *directlights[MAX_MAP_LEAFS];
+static directlight_t **leaflights[MAX_MAP_LEAFS];// NULL terminated lights a sample in the leaf has to consider
+static directlight_t **leaflightpool;
 static facelight_t facelight[MAX_MAP_FACES];
 static int numdlights;
 
 #define DIRECT_SCALE 0.1f
 
+// =====================================================================================
+//  SetLightRange
+//      GatherSampleLight drops styled lights that don't get above g_coring, and a light
+//      can never deliver more than intensity / (fade * dist ^ falloff), so past this
+//      distance it can be skipped without doing the math
+// =====================================================================================
+static void SetLightRange(directlight_t *dl) {
+    vec_t fade;
+    vec_t limit;
+
+    dl->range = 0;// unlimited
+    if (dl->type == emit_skylight || !dl->style || g_coring <= 0) {
+        return;
+    }
+
+    limit = VectorMaximum(dl->intensity);
+    if (dl->type == emit_surface) {
+        fade = g_fade;
+        limit = limit / (fade * g_coring);
+        if (g_falloff == 2) {
+            limit = sqrt(limit);
+        }
+    } else {
+        fade = dl->fade;
+        limit = limit / (fade * g_coring);
+        if (dl->falloff == 2) {
+            limit = sqrt(limit);
+        }
+    }
+
+    if (fade > 0 && limit > 0) {
+        dl->range = limit * 1.01 + 1.0;// some slack for the rounding in the lighting math
+    }
+}
+
+// =====================================================================================
+//  DirectLightHash
+//      What the facelight cache knows a light by, see FaceLightsHash
+// =====================================================================================
+static cache_uint64_t DirectLightHash(const directlight_t *const dl) {
+    cache_uint64_t hash = (cache_uint64_t) 0xCBF29CE484222325ULL;
+
+    hash = HashBytes(hash, &dl->type, sizeof(dl->type));
+    hash = HashBytes(hash, &dl->style, sizeof(dl->style));
+    hash = HashBytes(hash, dl->origin, sizeof(vec3_t));
+    hash = HashBytes(hash, dl->intensity, sizeof(vec3_t));
+    hash = HashBytes(hash, dl->normal, sizeof(vec3_t));
+    hash = HashBytes(hash, &dl->stopdot, sizeof(dl->stopdot));
+    hash = HashBytes(hash, &dl->stopdot2, sizeof(dl->stopdot2));
+    hash = HashBytes(hash, &dl->fade, sizeof(dl->fade));
+    hash = HashBytes(hash, &dl->falloff, sizeof(dl->falloff));
+    hash = HashBytes(hash, &dl->range, sizeof(dl->range));
+#ifdef HLRAD_WHOME
+    hash = HashBytes(hash, dl->diffuse_intensity, sizeof(vec3_t));
+#endif
+    return hash;
+}
+
+// =====================================================================================
+//  CreateLeafLights
+//      Flattens the PVS filtered lights of every leaf into one list, so that
+//      GatherSampleLight doesn't have to walk all leafs for every sample
+// =====================================================================================
+static void CreateLeafLights() {
+    byte pvs[(MAX_MAP_LEAFS + 7) / 8];
+    unsigned total;
+    int pass;
+    int leafnum;
+    int i;
+
+    // first pass counts, second pass fills in
+    for (pass = 0; pass < 2; pass++) {
+        total = 0;
+        for (leafnum = 0; leafnum < g_numleafs; leafnum++) {
+            if (!g_visdatasize) {
+                if (leafnum > 0) {
+                    leaflights[leafnum] = leaflights[0];
+                    continue;
+                }
+                memset(pvs, 255, (g_numleafs + 7) / 8);
+            } else if (g_dleafs[leafnum].visofs == -1) {
+                memset(pvs, 0, (g_numleafs + 7) / 8);
+            } else {
+                DecompressVis(&g_dvisdata[g_dleafs[leafnum].visofs], pvs, sizeof(pvs));
+            }
+
+            if (pass) {
+                leaflights[leafnum] = leaflightpool + total;
+            }
+            for (i = 1; i < g_numleafs; i++) {
+                directlight_t *l = directlights[i];
+
+                if (l && (((l->type == emit_skylight) && (g_sky_lighting_fix)) || (pvs[(i - 1) >> 3] & (1 << ((i - 1) & 7))))) {
+                    for (; l; l = l->next) {
+                        if (pass) {
+                            leaflightpool[total] = l;
+                        }
+                        total++;
+                    }
+                }
+            }
+            if (pass) {
+                leaflightpool[total] = NULL;
+            }
+            total++;
+        }
+
+        if (!pass) {
+            leaflightpool = (directlight_t **) calloc(total, sizeof(directlight_t *));
+            hlassume(leaflightpool != NULL, assume_NoMemory);
+        }
+    }
+
+    Developer(DEVELOPER_LEVEL_MESSAGE, "%u leaf light entries\n", total);
+}
+
 // =====================================================================================
 //  CreateDirectLights
 // =====================================================================================
@@ -1029,6 +1161,14 @@ void CreateDirectLights() {
 
     hlassume(numdlights, assume_NoLights);
     Log("%i direct lights\n", numdlights);
+
+    for (i = 0; i < (unsigned) g_numleafs; i++) {
+        for (dl = directlights[i]; dl; dl = dl->next) {
+            SetLightRange(dl);
+            dl->hash = DirectLightHash(dl);
+        }
+    }
+    CreateLeafLights();
 }
 
 // =====================================================================================
@@ -1045,7 +1185,10 @@ void DeleteDirectLights() {
             free(dl);
             dl = directlights[l];
         }
+        leaflights[l] = NULL;
     }
+    free(leaflightpool);
+    leaflightpool = NULL;
 
     // AJM: todo: strip light entities out at this point
 }
@@ -1057,8 +1200,106 @@ void DeleteDirectLights() {
 double r_avertexnormals[NUMVERTEXNORMALS][3] = {
 #include "../common/anorms.h"
 };
-static void GatherSampleLight(const vec3_t pos, const byte *const pvs, const vec3_t normal, vec3_t *sample, byte *styles) {
-    int i;
+
+// =====================================================================================
+//  Sky visibility cache
+//      The g_indirect_sun pass traces NUMVERTEXNORMALS rays for every sample. Instead,
+//      every direction is traced from a lattice of every SKY_CACHE_STEP'th sample of the
+//      face, and a sample in between only traces the directions on which the lattice
+//      points around it disagree, i.e. the ones near the edge of an occluder.
+//      An occluder that falls between lattice points is missed, so the lightmaps can
+//      change by a good deal more than rounding. That's why it takes -skycache.
+// =====================================================================================
+#define SKY_CACHE_STEP 4
+#define SKY_MASK_WORDS ((NUMVERTEXNORMALS + 31) / 32)
+
+typedef struct {
+    bool traced;
+    unsigned visible[SKY_MASK_WORDS];// bit set if the direction reaches the sky
+} skypoint_t;
+
+typedef struct {
+    const vec3_t *surfpt;
+    int width;       // lightmap size in samples
+    int height;
+    int latticewidth;// lattice size in points
+    int latticeheight;
+    int sample;      // sample GatherSampleLight is working on
+    skypoint_t *points;
+} skycache_t;
+
+typedef struct {
+    unsigned visible[SKY_MASK_WORDS];
+    unsigned known[SKY_MASK_WORDS];// bit set if 'visible' can be used instead of a trace
+} skyhint_t;
+
+static void InitSkyCache(skycache_t *sky, const vec3_t *surfpt, const int width, const int height) {
+    sky->surfpt = surfpt;
+    sky->width = width;
+    sky->height = height;
+    sky->latticewidth = (width - 1 + SKY_CACHE_STEP - 1) / SKY_CACHE_STEP + 1;
+    sky->latticeheight = (height - 1 + SKY_CACHE_STEP - 1) / SKY_CACHE_STEP + 1;
+    sky->sample = 0;
+    sky->points = NULL;
+    if (g_skycache && g_indirect_sun != 0.0) {
+        sky->points = (skypoint_t *) FaceAlloc(sky->latticewidth * sky->latticeheight * sizeof(skypoint_t));
+    }
+}
+
+static const unsigned *GetSkyPoint(skycache_t *sky, const int column, const int row) {
+    skypoint_t *point = &sky->points[row * sky->latticewidth + column];
+
+    if (!point->traced) {
+        const int s = Min(column * SKY_CACHE_STEP, sky->width - 1);
+        const int t = Min(row * SKY_CACHE_STEP, sky->height - 1);
+        const vec_t *pos = sky->surfpt[t * sky->width + s];
+        vec3_t delta;
+        int j;
+
+        for (j = 0; j < NUMVERTEXNORMALS; j++) {
+            VectorScale(r_avertexnormals[j], -10000, delta);
+            VectorAdd(pos, delta, delta);
+            if (TestLine(pos, delta) == CONTENTS_SKY) {
+                point->visible[j >> 5] |= 1U << (j & 31);
+            }
+        }
+        point->traced = true;
+    }
+    return point->visible;
+}
+
+static void GetSkyHint(skycache_t *sky, skyhint_t *hint) {
+    // -extra samples lie up to a third of the way towards the neighbouring samples
+    const int reach = g_extra ? 1 : 0;
+    const int s = sky->sample % sky->width;
+    const int t = sky->sample / sky->width;
+    const int firstcolumn = Max(s - reach, 0) / SKY_CACHE_STEP;
+    const int lastcolumn = (Min(s + reach, sky->width - 1) + SKY_CACHE_STEP - 1) / SKY_CACHE_STEP;
+    const int firstrow = Max(t - reach, 0) / SKY_CACHE_STEP;
+    const int lastrow = (Min(t + reach, sky->height - 1) + SKY_CACHE_STEP - 1) / SKY_CACHE_STEP;
+    const unsigned *first = GetSkyPoint(sky, firstcolumn, firstrow);
+    int column;
+    int row;
+    int w;
+
+    for (w = 0; w < SKY_MASK_WORDS; w++) {
+        hint->visible[w] = first[w];
+        hint->known[w] = ~0U;
+    }
+
+    // only the directions that all surrounding lattice points agree on are known
+    for (row = firstrow; row <= lastrow; row++) {
+        for (column = firstcolumn; column <= lastcolumn; column++) {
+            const unsigned *point = GetSkyPoint(sky, column, row);
+
+            for (w = 0; w < SKY_MASK_WORDS; w++) {
+                hint->known[w] &= ~(point[w] ^ first[w]);
+            }
+        }
+    }
+}
+
+static void GatherSampleLight(const vec3_t pos, directlight_t *const *lights, const vec3_t normal, vec3_t *sample, byte *styles, skycache_t *sky) {
     directlight_t *l;
     vec3_t add;
     vec3_t delta;
@@ -1071,172 +1312,170 @@ static void GatherSampleLight(const vec3_t pos, const byte *const pvs, const vec
     int style_index;
     directlight_t *sky_used = NULL;
 
-    for (i = 1; i < g_numleafs; i++) {
-        l = directlights[i];
-        if (l) {
-            if (((l->type == emit_skylight) && (g_sky_lighting_fix)) || (pvs[(i - 1) >> 3] & (1 << ((i - 1) & 7)))) {
-                for (; l; l = l->next) {
-                    // skylights work fundamentally differently than normal lights
-                    if (l->type == emit_skylight) {
-                        // only allow one of each sky type to hit any given point
-                        if (sky_used) {
-                            continue;
-                        }
-                        sky_used = l;
+    for (; *lights; lights++) {
+        l = *lights;
 
-                        // make sure the angle is okay
-                        dot = -DotProduct(normal, l->normal);
-                        if (dot <= ON_EPSILON / 10) {
-                            continue;
-                        }
+        // skylights work fundamentally differently than normal lights
+        if (l->type == emit_skylight) {
+            // only allow one of each sky type to hit any given point
+            if (sky_used) {
+                continue;
+            }
+            sky_used = l;
 
-                        // search back to see if we can hit a sky brush
-                        VectorScale(l->normal, -10000, delta);
-                        VectorAdd(pos, delta, delta);
-                        if (TestLine(pos, delta) != CONTENTS_SKY) {
-                            continue;// occluded
-                        }
+            // make sure the angle is okay
+            dot = -DotProduct(normal, l->normal);
+            if (dot <= ON_EPSILON / 10) {
+                continue;
+            }
+
+            // search back to see if we can hit a sky brush
+            VectorScale(l->normal, -10000, delta);
+            VectorAdd(pos, delta, delta);
+            if (TestLine(pos, delta) != CONTENTS_SKY) {
+                continue;// occluded
+            }
 
 #ifdef HLRAD_HULLU
-                        vec3_t transparency = {1.0, 1.0, 1.0};
-                        if (TestSegmentAgainstOpaqueList(pos, delta, transparency))
+            vec3_t transparency = {1.0, 1.0, 1.0};
+            if (TestSegmentAgainstOpaqueList(pos, delta, transparency))
 #else
-                        if (TestSegmentAgainstOpaqueList(pos, delta))
+            if (TestSegmentAgainstOpaqueList(pos, delta))
 #endif
-                        {
-                            continue;
-                        }
+            {
+                continue;
+            }
 
-                        VectorScale(l->intensity, dot, add);
+            VectorScale(l->intensity, dot, add);
 #ifdef HLRAD_HULLU
-                        VectorMultiply(add, transparency, add);
+            VectorMultiply(add, transparency, add);
 #endif
 
-                    } else {
-                        float denominator;
-
-                        VectorSubtract(l->origin, pos, delta);
-                        dist = VectorNormalize(delta);
-                        dot = DotProduct(delta, normal);
-                        //                        if (dot <= 0.0)
-                        //                            continue;
-                        if (dot <= ON_EPSILON / 10) {
-                            continue;// behind sample surface
-                        }
+        } else {
+            float denominator;
 
-                        if (dist < 1.0) {
-                            dist = 1.0;
-                        }
+            VectorSubtract(l->origin, pos, delta);
+            if (l->range && DotProduct(delta, delta) > l->range * l->range) {
+                continue;// too far away to get above g_coring
+            }
+            dist = VectorNormalize(delta);
+            dot = DotProduct(delta, normal);
+            //                        if (dot <= 0.0)
+            //                            continue;
+            if (dot <= ON_EPSILON / 10) {
+                continue;// behind sample surface
+            }
 
-                        // Variable power falloff (1 = inverse linear, 2 = inverse square
-                        denominator = dist * l->fade;
-                        if (l->falloff == 2) {
-                            denominator *= dist;
-                        }
+            if (dist < 1.0) {
+                dist = 1.0;
+            }
 
-                        switch (l->type) {
-                            case emit_point: {
-                                // Variable power falloff (1 = inverse linear, 2 = inverse square
-                                vec_t denominator = dist * l->fade;
+            // Variable power falloff (1 = inverse linear, 2 = inverse square
+            denominator = dist * l->fade;
+            if (l->falloff == 2) {
+                denominator *= dist;
+            }
 
-                                if (l->falloff == 2) {
-                                    denominator *= dist;
-                                }
-                                ratio = dot / denominator;
-                                VectorScale(l->intensity, ratio, add);
-                                break;
-                            }
+            switch (l->type) {
+                case emit_point: {
+                    // Variable power falloff (1 = inverse linear, 2 = inverse square
+                    vec_t denominator = dist * l->fade;
 
-                            case emit_surface: {
-                                dot2 = -DotProduct(delta, l->normal);
-                                if (dot2 <= ON_EPSILON / 10) {
-                                    continue;// behind light surface
-                                }
+                    if (l->falloff == 2) {
+                        denominator *= dist;
+                    }
+                    ratio = dot / denominator;
+                    VectorScale(l->intensity, ratio, add);
+                    break;
+                }
 
-                                // Variable power falloff (1 = inverse linear, 2 = inverse square
-                                vec_t denominator = dist * g_fade;
-                                if (g_falloff == 2) {
-                                    denominator *= dist;
-                                }
-                                ratio = dot * dot2 / denominator;
+                case emit_surface: {
+                    dot2 = -DotProduct(delta, l->normal);
+                    if (dot2 <= ON_EPSILON / 10) {
+                        continue;// behind light surface
+                    }
 
-                                VectorScale(l->intensity, ratio, add);
-                                break;
-                            }
+                    // Variable power falloff (1 = inverse linear, 2 = inverse square
+                    vec_t denominator = dist * g_fade;
+                    if (g_falloff == 2) {
+                        denominator *= dist;
+                    }
+                    ratio = dot * dot2 / denominator;
 
-                            case emit_spotlight: {
-                                dot2 = -DotProduct(delta, l->normal);
-                                if (dot2 <= l->stopdot2) {
-                                    continue;// outside light cone
-                                }
+                    VectorScale(l->intensity, ratio, add);
+                    break;
+                }
 
-                                // Variable power falloff (1 = inverse linear, 2 = inverse square
-                                vec_t denominator = dist * l->fade;
-                                if (l->falloff == 2) {
-                                    denominator *= dist;
-                                }
-                                ratio = dot * dot2 / denominator;
+                case emit_spotlight: {
+                    dot2 = -DotProduct(delta, l->normal);
+                    if (dot2 <= l->stopdot2) {
+                        continue;// outside light cone
+                    }
 
-                                if (dot2 <= l->stopdot) {
-                                    ratio *= (dot2 - l->stopdot2) / (l->stopdot - l->stopdot2);
-                                }
-                                VectorScale(l->intensity, ratio, add);
-                                break;
-                            }
+                    // Variable power falloff (1 = inverse linear, 2 = inverse square
+                    vec_t denominator = dist * l->fade;
+                    if (l->falloff == 2) {
+                        denominator *= dist;
+                    }
+                    ratio = dot * dot2 / denominator;
 
-                            default: {
-                                hlassume(false, assume_BadLightType);
-                                break;
-                            }
-                        }
+                    if (dot2 <= l->stopdot) {
+                        ratio *= (dot2 - l->stopdot2) / (l->stopdot - l->stopdot2);
                     }
+                    VectorScale(l->intensity, ratio, add);
+                    break;
+                }
+
+                default: {
+                    hlassume(false, assume_BadLightType);
+                    break;
+                }
+            }
+        }
 
-                    if (VectorMaximum(add) > (l->style ? g_coring : 0)) {
+        if (VectorMaximum(add) > (l->style ? g_coring : 0)) {
 #ifdef HLRAD_HULLU
-                        vec3_t transparency = {1.0, 1.0, 1.0};
+            vec3_t transparency = {1.0, 1.0, 1.0};
 #endif
 
-                        if (l->type != emit_skylight && TestLine(pos, l->origin) != CONTENTS_EMPTY) {
-                            continue;// occluded
-                        }
+            if (l->type != emit_skylight && TestLine(pos, l->origin) != CONTENTS_EMPTY) {
+                continue;// occluded
+            }
 
-                        if (l->type != emit_skylight) {// Don't test from light_environment entities to face, the special sky code occludes correctly
+            if (l->type != emit_skylight) {// Don't test from light_environment entities to face, the special sky code occludes correctly
 #ifdef HLRAD_HULLU
-                            if (TestSegmentAgainstOpaqueList(pos, l->origin, transparency))
+                if (TestSegmentAgainstOpaqueList(pos, l->origin, transparency))
 #else
-                            if (TestSegmentAgainstOpaqueList(pos, l->origin))
+                if (TestSegmentAgainstOpaqueList(pos, l->origin))
 #endif
-                            {
-                                continue;
-                            }
-                        }
+                {
+                    continue;
+                }
+            }
 
 #ifdef HLRAD_OPACITY
-                        //VectorScale(add, l_opacity, add);
+            //VectorScale(add, l_opacity, add);
 #endif
 
-                        for (style_index = 0; style_index < MAXLIGHTMAPS; style_index++) {
-                            if (styles[style_index] == l->style || styles[style_index] == 255) {
-                                break;
-                            }
-                        }
+            for (style_index = 0; style_index < MAXLIGHTMAPS; style_index++) {
+                if (styles[style_index] == l->style || styles[style_index] == 255) {
+                    break;
+                }
+            }
 
-                        if (style_index == MAXLIGHTMAPS) {
-                            Warning("Too many direct light styles on a face(%f,%f,%f)", pos[0], pos[1], pos[2]);
-                            continue;
-                        }
+            if (style_index == MAXLIGHTMAPS) {
+                Warning("Too many direct light styles on a face(%f,%f,%f)", pos[0], pos[1], pos[2]);
+                continue;
+            }
 
-                        if (styles[style_index] == 255) {
-                            styles[style_index] = l->style;
-                        }
+            if (styles[style_index] == 255) {
+                styles[style_index] = l->style;
+            }
 
 #ifdef HLRAD_HULLU
-                        VectorMultiply(add, transparency, add);
+            VectorMultiply(add, transparency, add);
 #endif
-                        VectorAdd(sample[style_index], add, sample[style_index]);
-                    }
-                }
-            }
+            VectorAdd(sample[style_index], add, sample[style_index]);
         }
     }
 
@@ -1244,6 +1483,7 @@ static void GatherSampleLight(const vec3_t pos, const byte *const pvs, const vec
         vec3_t total;
         int j;
         vec3_t sky_intensity;
+        skyhint_t hint;
 
         // -----------------------------------------------------------------------------------
         // Changes by Adam Foster - afoster@compsoc.man.ac.uk
@@ -1257,6 +1497,10 @@ static void GatherSampleLight(const vec3_t pos, const byte *const pvs, const vec
         // AJM: It DOES actually work. Havent you ever heard of beta testing....
         // -----------------------------------------------------------------------------------
 
+        if (sky) {
+            GetSkyHint(sky, &hint);
+        }
+
         total[0] = total[1] = total[2] = 0.0;
         for (j = 0; j < NUMVERTEXNORMALS; j++) {
             // make sure the angle is okay
@@ -1265,11 +1509,17 @@ static void GatherSampleLight(const vec3_t pos, const byte *const pvs, const vec
                 continue;
             }
 
-            // search back to see if we can hit a sky brush
-            VectorScale(r_avertexnormals[j], -10000, delta);
-            VectorAdd(pos, delta, delta);
-            if (TestLine(pos, delta) != CONTENTS_SKY) {
-                continue;// occluded
+            if (sky && (hint.known[j >> 5] & (1U << (j & 31)))) {
+                if (!(hint.visible[j >> 5] & (1U << (j & 31)))) {
+                    continue;// occluded
+                }
+            } else {
+                // search back to see if we can hit a sky brush
+                VectorScale(r_avertexnormals[j], -10000, delta);
+                VectorAdd(pos, delta, delta);
+                if (TestLine(pos, delta) != CONTENTS_SKY) {
+                    continue;// occluded
+                }
             }
 
             VectorScale(sky_intensity, dot, add);
@@ -1296,6 +1546,52 @@ static void GatherSampleLight(const vec3_t pos, const byte *const pvs, const vec
     }
 }
 
+// =====================================================================================
+//  MarkExtraLuxels
+//      With -extraadaptive, a luxel is oversampled only where the light at its centre is
+//      further than g_extra_threshold from the average of two opposite neighbours, along
+//      the rows, columns or diagonals. That's where the shadow edges and sharp falloff are,
+//      the oversampling of a luxel on an even gradient would hardly change it.
+// =====================================================================================
+static bool *MarkExtraLuxels(const vec3_t *centrelight, const byte *styles, const int width, const int height) {
+    static const int dirs[4][2] = {{1, 0}, {0, 1}, {1, 1}, {1, -1}};
+    bool *refine = (bool *) FaceAlloc(width * height * sizeof(bool));
+    int s, t;
+    int d, j, k;
+
+    for (t = 0; t < height; t++) {
+        for (s = 0; s < width; s++) {
+            const int i = t * width + s;
+            bool *r = &refine[i];
+
+            for (d = 0; d < 4 && !*r; d++) {
+                const int s1 = s + dirs[d][0], t1 = t + dirs[d][1];
+                const int s2 = s - dirs[d][0], t2 = t - dirs[d][1];
+                // a missing neighbour counts as the centre itself
+                const int n1 = (s1 >= 0 && s1 < width && t1 >= 0 && t1 < height) ? t1 * width + s1 : i;
+                const int n2 = (s2 >= 0 && s2 < width && t2 >= 0 && t2 < height) ? t2 * width + s2 : i;
+
+                if (n1 == i && n2 == i) {
+                    continue;
+                }
+                for (j = 0; j < MAXLIGHTMAPS && styles[j] != 255 && !*r; j++) {
+                    const vec_t *c = centrelight[i * MAXLIGHTMAPS + j];
+                    const vec_t *a = centrelight[n1 * MAXLIGHTMAPS + j];
+                    const vec_t *b = centrelight[n2 * MAXLIGHTMAPS + j];
+
+                    for (k = 0; k < 3; k++) {
+                        if (fabs(c[k] - (a[k] + b[k]) * 0.5) > g_extra_threshold) {
+                            *r = true;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return refine;
+}
+
 // =====================================================================================
 //  AddSampleToPatch
 //      Take the sample's collected light and add it back into the apropriate patch for the radiosity pass.
@@ -1315,8 +1611,10 @@ static void AddSampleToPatch(const sample_t *const s, const int facenum)
     }
 
     for (patch = g_face_patches[facenum]; patch; patch = patch->next) {
+        patchbuild_t *build = PatchBuild(patch);
+
         // see if the point is in this patch (roughly)
-        patch->winding->getBounds(bounds);
+        build->winding->getBounds(bounds);
         for (i = 0; i < 3; i++) {
             if (bounds.m_Mins[i] > s->pos[i] + 16) {
                 goto nextpatch;
@@ -1340,13 +1638,13 @@ static void AddSampleToPatch(const sample_t *const s, const int facenum)
                 patch->totalstyle[i] = style;
             }
 
-            patch->samples[i]++;
-            VectorAdd(patch->samplelight[i], s->light, patch->samplelight[i]);
+            build->samples[i]++;
+            VectorAdd(build->samplelight[i], s->light, build->samplelight[i]);
         }
         //LRC (ends)
 #else
-        patch->samples++;
-        VectorAdd(patch->samplelight, s->light, patch->samplelight);
+        build->samples++;
+        VectorAdd(build->samplelight, s->light, build->samplelight);
 #endif
         //return;
 
@@ -1489,6 +1787,518 @@ const vec3_t s_circuscolors[] = {
         {100000.0, 100000.0, 0.0}      // yellow
 };
 
+// =====================================================================================
+//
+//      FACELIGHT CACHE
+//      The .dlc file written by -incremental keeps the direct lighting of every face:
+//          header
+//          one facelightcache_face_t per face
+//          for each lit face the sample light of each of its styles, then one
+//          facelightcache_patch_t per patch of the face
+//      A face is keyed by FaceLightsHash, the hash of the lights that can reach it, so
+//      moving or retuning a light only relights the faces it touches. The header
+//      carries the geometry and options, a change there relights everything.
+//
+// =====================================================================================
+
+#define FACELIGHT_CACHE_MAGIC "HLFL"
+#define FACELIGHT_CACHE_VERSION 1
+#define FACELIGHT_CACHE_BYTEORDER 0x01020304
+
+typedef struct {
+    char magic[4];
+    unsigned version;
+    unsigned byteorder;
+    unsigned vecsize;// sizeof(vec_t)
+    unsigned numfaces;
+    unsigned numpatches;
+    cache_uint64_t hash;
+    cache_uint64_t filesize;
+} facelightcache_header_t;
+
+typedef struct {
+    cache_uint64_t hash;  // FaceLightsHash, 0 for faces that aren't lit
+    cache_uint64_t offset;// of the sample light in the file
+    int numsamples;
+    int numpatches;
+    byte styles[MAXLIGHTMAPS];
+} facelightcache_face_t;
+
+typedef struct {
+#ifdef ZHLT_TEXLIGHT
+    int totalstyle[MAXLIGHTMAPS];
+    vec3_t totallight[MAXLIGHTMAPS];
+    vec3_t directlight[MAXLIGHTMAPS];
+#else
+    vec3_t totallight;
+    vec3_t directlight;
+#endif
+} facelightcache_patch_t;
+
+static cache_uint64_t s_facelight_hashes[MAX_MAP_FACES];
+static byte *s_facelight_cache = NULL;// contents of the file readfacelights accepted
+static volatile int s_facelights_reused = 0;
+
+// =====================================================================================
+//  MixHash
+//      64 bit finalizer, spreads a hash over all bits so that sums of hashes
+//      don't cancel out
+// =====================================================================================
+static cache_uint64_t MixHash(cache_uint64_t hash) {
+    hash ^= hash >> 30;
+    hash *= (cache_uint64_t) 0xBF58476D1CE4E5B9ULL;
+    hash ^= hash >> 27;
+    hash *= (cache_uint64_t) 0x94D049BB133111EBULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+// =====================================================================================
+//  FacelightCacheHash
+//      The geometry and the options BuildFacelights depends on
+// =====================================================================================
+static cache_uint64_t FacelightCacheHash() {
+    cache_uint64_t hash = GeometryHash(g_num_patches);
+    int options[7];
+    vec_t values[8];
+
+    memset(options, 0, sizeof(options));
+    options[0] = g_extra;
+    options[1] = g_circus;
+    options[2] = g_sky_lighting_fix;
+    options[3] = g_skycache;
+    options[4] = g_numbounce > 0;// whether the patches collect the sample light
+    options[5] = g_falloff;
+    options[6] = g_extra_adaptive;
+    hash = HashBytes(hash, options, sizeof(options));
+
+    values[0] = g_ambient[0];
+    values[1] = g_ambient[1];
+    values[2] = g_ambient[2];
+    values[3] = g_indirect_sun;
+    values[4] = g_smoothing_threshold;
+    values[5] = g_fade;
+    values[6] = g_coring;
+    values[7] = g_extra_threshold;
+    hash = HashBytes(hash, values, sizeof(values));
+
+    return hash;
+}
+
+// =====================================================================================
+//  FaceLightsHash
+//      Hashes the lights in the PVS of the samples of a face, leaving out lights
+//      whose range ends before the face, together with the face's own emission
+// =====================================================================================
+static cache_uint64_t FaceLightsHash(const lightinfo_t *const l, const int facenum) {
+    directlight_t *const *lists[MAX_SINGLEMAP];
+    int numlists = 0;
+    vec3_t mins;
+    vec3_t maxs;
+    cache_uint64_t hash = (cache_uint64_t) 0xCBF29CE484222325ULL;
+    const patch_t *patch;
+    int i;
+    int j;
+
+    for (patch = g_face_patches[facenum]; patch; patch = patch->next) {
+        hash = HashBytes(hash, patch->baselight, sizeof(vec3_t));
+#ifdef ZHLT_TEXLIGHT
+        hash = HashBytes(hash, &patch->emitstyle, sizeof(patch->emitstyle));
+#endif
+    }
+
+    VectorFill(mins, 99999);
+    VectorFill(maxs, -99999);
+    for (i = 0; i < l->numsurfpt; i++) {
+        directlight_t *const *lights;
+
+        for (j = 0; j < 3; j++) {
+            if (l->surfpt[i][j] < mins[j]) {
+                mins[j] = l->surfpt[i][j];
+            }
+            if (l->surfpt[i][j] > maxs[j]) {
+                maxs[j] = l->surfpt[i][j];
+            }
+        }
+
+        if (!g_visdatasize) {
+            lights = leaflights[0];
+        } else {
+            lights = leaflights[PointInLeaf(l->surfpt[i]) - g_dleafs];
+        }
+        for (j = 0; j < numlists; j++) {
+            if (lists[j] == lights) {
+                break;
+            }
+        }
+        if (j == numlists) {
+            lists[numlists++] = lights;
+        }
+    }
+
+    // the same lists in a different order are the same lighting
+    for (i = 0; i < numlists; i++) {
+        cache_uint64_t listhash = (cache_uint64_t) 0xCBF29CE484222325ULL;
+        directlight_t *const *lights;
+
+        for (lights = lists[i]; *lights; lights++) {
+            const directlight_t *dl = *lights;
+
+            if (dl->range > 0) {
+                vec_t dist = 0;
+
+                for (j = 0; j < 3; j++) {
+                    if (dl->origin[j] < mins[j]) {
+                        dist += (mins[j] - dl->origin[j]) * (mins[j] - dl->origin[j]);
+                    } else if (dl->origin[j] > maxs[j]) {
+                        dist += (dl->origin[j] - maxs[j]) * (dl->origin[j] - maxs[j]);
+                    }
+                }
+                if (dist > dl->range * dl->range) {
+                    continue;
+                }
+            }
+            listhash = HashBytes(listhash, &dl->hash, sizeof(dl->hash));
+        }
+        hash += MixHash(listhash);
+    }
+
+    return hash ? hash : 1;
+}
+
+// =====================================================================================
+//  ReuseFacelight
+//      Fills in the facelight and the patches of a face from the cache when the lights
+//      it depends on didn't change
+// =====================================================================================
+static bool ReuseFacelight(const lightinfo_t *const l, const int facenum) {
+    const facelightcache_face_t *entry;
+    const byte *data;
+    dface_t *f = &g_dfaces[facenum];
+    patch_t *patch;
+    int numpatches;
+    int i;
+    int j;
+
+    if (!s_facelight_cache) {
+        return false;
+    }
+
+    entry = (const facelightcache_face_t *) (s_facelight_cache + sizeof(facelightcache_header_t)) + facenum;
+    if (entry->hash != s_facelight_hashes[facenum] || entry->numsamples != l->numsurfpt) {
+        return false;
+    }
+    for (numpatches = 0, patch = g_face_patches[facenum]; patch; patch = patch->next) {
+        numpatches++;
+    }
+    if (entry->numpatches != numpatches) {
+        return false;
+    }
+
+    data = s_facelight_cache + entry->offset;
+    for (j = 0; j < MAXLIGHTMAPS; j++) {
+        f->styles[j] = entry->styles[j];
+        for (i = 0; i < l->numsurfpt; i++) {
+            VectorCopy(l->surfpt[i], facelight[facenum].samples[j][i].pos);
+        }
+    }
+    for (j = 0; j < MAXLIGHTMAPS && f->styles[j] != 255; j++) {
+        for (i = 0; i < l->numsurfpt; i++, data += sizeof(vec3_t)) {
+            VectorCopy((const vec_t *) data, facelight[facenum].samples[j][i].light);
+        }
+    }
+
+    for (patch = g_face_patches[facenum]; patch; patch = patch->next, data += sizeof(facelightcache_patch_t)) {
+        const facelightcache_patch_t *cached = (const facelightcache_patch_t *) data;
+
+#ifdef ZHLT_TEXLIGHT
+        memcpy(patch->totalstyle, cached->totalstyle, sizeof(patch->totalstyle));
+        memcpy(patch->totallight, cached->totallight, sizeof(patch->totallight));
+        memcpy(patch->directlight, cached->directlight, sizeof(patch->directlight));
+#else
+        VectorCopy(cached->totallight, patch->totallight);
+        VectorCopy(cached->directlight, patch->directlight);
+#endif
+    }
+
+    ThreadAtomicAdd(&s_facelights_reused, 1);
+    return true;
+}
+
+// =====================================================================================
+//  FacelightSize
+//      Bytes a face takes up in the payload of the cache
+// =====================================================================================
+static cache_uint64_t FacelightSize(const facelightcache_face_t *const entry) {
+    int numstyles;
+
+    for (numstyles = 0; numstyles < MAXLIGHTMAPS && entry->styles[numstyles] != 255; numstyles++)
+        ;
+    return (cache_uint64_t) numstyles * entry->numsamples * sizeof(vec3_t) + (cache_uint64_t) entry->numpatches * sizeof(facelightcache_patch_t);
+}
+
+// =====================================================================================
+//  readfacelights
+//      Loads the cache for BuildFacelights, returns false when there is nothing usable
+// =====================================================================================
+bool readfacelights(const char *const facelightfile) {
+    FILE *file;
+    facelightcache_header_t header;
+    const facelightcache_face_t *table;
+    const char *reason;
+    int filesize;
+    int i;
+
+    free(s_facelight_cache);
+    s_facelight_cache = NULL;
+    s_facelights_reused = 0;
+
+    file = fopen(facelightfile, "rb");
+    if (file == NULL) {
+        Warning("Failed to open direct light file [%s]\n", facelightfile);
+        return false;
+    }
+
+    Log("Reading direct light file [%s]\n", facelightfile);
+
+    filesize = q_filelength(file);
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, FACELIGHT_CACHE_MAGIC, sizeof(header.magic))) {
+        reason = "not a direct light cache";
+    } else if (header.version != FACELIGHT_CACHE_VERSION || header.byteorder != FACELIGHT_CACHE_BYTEORDER || header.vecsize != sizeof(vec_t)) {
+        reason = "written by an incompatible hlrad";
+    } else if ((cache_uint64_t) filesize != header.filesize || header.filesize < sizeof(header) + header.numfaces * sizeof(facelightcache_face_t)) {
+        reason = "truncated";
+    } else if (header.numfaces != (unsigned) g_numfaces || header.numpatches != g_num_patches || header.hash != FacelightCacheHash()) {
+        reason = "the map, its patches or the options changed";
+    } else {
+        reason = NULL;
+    }
+
+    if (!reason) {
+        s_facelight_cache = (byte *) malloc(filesize);
+        hlassume(s_facelight_cache != NULL, assume_NoMemory);
+        fseek(file, 0, SEEK_SET);
+        if (fread(s_facelight_cache, 1, filesize, file) != (size_t) filesize) {
+            reason = "truncated";
+        }
+    }
+    fclose(file);
+
+    if (!reason) {
+        table = (const facelightcache_face_t *) (s_facelight_cache + sizeof(header));
+        for (i = 0; i < g_numfaces; i++) {
+            if (table[i].hash
+                && (table[i].numsamples < 0 || table[i].numsamples > MAX_SINGLEMAP || table[i].numpatches < 0
+                    || table[i].offset < sizeof(header) + header.numfaces * sizeof(facelightcache_face_t)
+                    || table[i].offset + FacelightSize(&table[i]) > header.filesize)) {
+                reason = "truncated";
+                break;
+            }
+        }
+    }
+
+    if (reason) {
+        Log("Direct light file [%s] is out of date (%s), relighting all faces\n", facelightfile, reason);
+        free(s_facelight_cache);
+        s_facelight_cache = NULL;
+        unlink(facelightfile);
+        return false;
+    }
+
+    return true;
+}
+
+// =====================================================================================
+//  writefacelights
+// =====================================================================================
+void writefacelights(const char *const facelightfile) {
+    FILE *file;
+    facelightcache_header_t header;
+    facelightcache_face_t *table;
+    cache_uint64_t offset;
+    int numlit = 0;
+    patch_t *patch;
+    int i;
+    int j;
+    int k;
+
+    table = (facelightcache_face_t *) calloc(g_numfaces ? g_numfaces : 1, sizeof(facelightcache_face_t));
+    hlassume(table != NULL, assume_NoMemory);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FACELIGHT_CACHE_MAGIC, sizeof(header.magic));
+    header.version = FACELIGHT_CACHE_VERSION;
+    header.byteorder = FACELIGHT_CACHE_BYTEORDER;
+    header.vecsize = sizeof(vec_t);
+    header.numfaces = g_numfaces;
+    header.numpatches = g_num_patches;
+    header.hash = FacelightCacheHash();
+
+    // lay out the payload
+    offset = sizeof(header) + g_numfaces * sizeof(facelightcache_face_t);
+    for (i = 0; i < g_numfaces; i++) {
+        memset(table[i].styles, 255, sizeof(table[i].styles));
+        table[i].hash = s_facelight_hashes[i];
+        if (!table[i].hash) {
+            continue;
+        }
+        numlit++;
+        table[i].offset = offset;
+        table[i].numsamples = facelight[i].numsamples;
+        for (patch = g_face_patches[i]; patch; patch = patch->next) {
+            table[i].numpatches++;
+        }
+        for (j = 0; j < MAXLIGHTMAPS; j++) {
+            table[i].styles[j] = g_dfaces[i].styles[j];
+        }
+        offset += FacelightSize(&table[i]);
+    }
+    header.filesize = offset;
+
+    Log("%i of %i faces relit\n", numlit - s_facelights_reused, numlit);
+    free(s_facelight_cache);
+    s_facelight_cache = NULL;
+
+    file = fopen(facelightfile, "w+b");
+    if (file == NULL) {
+        Error("Failed to open incremenetal file [%s] for writing\n", facelightfile);
+    }
+
+    Log("Writing direct light file [%s]\n", facelightfile);
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        goto FailedWrite;
+    }
+    if (g_numfaces && fwrite(table, sizeof(facelightcache_face_t), g_numfaces, file) != (size_t) g_numfaces) {
+        goto FailedWrite;
+    }
+
+    for (i = 0; i < g_numfaces; i++) {
+        if (!table[i].hash) {
+            continue;
+        }
+        for (j = 0; j < MAXLIGHTMAPS && table[i].styles[j] != 255; j++) {
+            for (k = 0; k < table[i].numsamples; k++) {
+                if (fwrite(facelight[i].samples[j][k].light, sizeof(vec3_t), 1, file) != 1) {
+                    goto FailedWrite;
+                }
+            }
+        }
+        for (patch = g_face_patches[i]; patch; patch = patch->next) {
+            facelightcache_patch_t cached;
+
+            memset(&cached, 0, sizeof(cached));
+#ifdef ZHLT_TEXLIGHT
+            memcpy(cached.totalstyle, patch->totalstyle, sizeof(cached.totalstyle));
+            memcpy(cached.totallight, patch->totallight, sizeof(cached.totallight));
+            memcpy(cached.directlight, patch->directlight, sizeof(cached.directlight));
+#else
+            VectorCopy(patch->totallight, cached.totallight);
+            VectorCopy(patch->directlight, cached.directlight);
+#endif
+            if (fwrite(&cached, sizeof(cached), 1, file) != 1) {
+                goto FailedWrite;
+            }
+        }
+    }
+
+    free(table);
+    fclose(file);
+    return;
+
+FailedWrite:
+    free(table);
+    fclose(file);
+    unlink(facelightfile);
+    Warning("Failed to generate incremental file [%s] (probably ran out of disk space)\n", facelightfile);
+}
+
+// =====================================================================================
+//  AllocFacelights
+//      Lays the samples of all faces out in one block, each face getting
+//      MAXLIGHTMAPS runs of its sample count, so BuildFacelights doesn't have to
+//      allocate from its threads
+// =====================================================================================
+static sample_t *s_facelight_samples = NULL;
+
+void AllocFacelights() {
+    unsigned total = 0;
+    int facenum;
+
+    for (facenum = 0; facenum < g_numfaces; facenum++) {
+        const dface_t *f = &g_dfaces[facenum];
+        vec_t mins[2], maxs[2];
+        int texsize[2];
+        int i;
+
+        facelight[facenum].numsamples = 0;
+        if (g_texinfo[f->texinfo].flags & TEX_SPECIAL) {
+            continue;
+        }
+
+        // the same sizes CalcFaceExtents and CalcPoints come up with
+        GetFaceTexBounds(f, mins, maxs);
+        for (i = 0; i < 2; i++) {
+            texsize[i] = (int) ceil(maxs[i] / 16.0) - (int) floor(mins[i] / 16.0);
+        }
+        facelight[facenum].numsamples = (texsize[0] + 1) * (texsize[1] + 1);
+        if (facelight[facenum].numsamples > MAX_SINGLEMAP) {
+            facelight[facenum].numsamples = 0;// BuildFacelights will complain about it
+        }
+        total += facelight[facenum].numsamples * MAXLIGHTMAPS;
+    }
+
+    s_facelight_samples = (sample_t *) AllocBlock((total + 1) * sizeof(sample_t));
+    hlassume(s_facelight_samples != NULL, assume_NoMemory);
+
+    total = 0;
+    for (facenum = 0; facenum < g_numfaces; facenum++) {
+        int k;
+
+        for (k = 0; k < MAXLIGHTMAPS; k++) {
+            facelight[facenum].samples[k] = s_facelight_samples + total;
+            total += facelight[facenum].numsamples;
+        }
+    }
+
+    Developer(DEVELOPER_LEVEL_MESSAGE, "%u facelight samples\n", total);
+}
+
+// =====================================================================================
+//  FreeFacelights
+// =====================================================================================
+void FreeFacelights() {
+    FreeBlock(s_facelight_samples);
+    s_facelight_samples = NULL;
+    memset(facelight, 0, sizeof(facelight));
+}
+
+// =====================================================================================
+//  GetSampleLights
+//      The lights in the PVS of the sample
+// =====================================================================================
+static directlight_t *const *GetSampleLights(const vec_t *spot) {
+    dleaf_t *leaf;
+
+    if (!g_visdatasize) {
+        return leaflights[0];
+    }
+    leaf = PointInLeaf(spot);
+    hlassert(leaf->visofs != -1);
+    return leaflights[leaf - g_dleafs];
+}
+
+// =====================================================================================
+//  GetExtraSamplePos
+//      The point one third of the way from luxel i toward luxel subsample, for -extra
+// =====================================================================================
+static void GetExtraSamplePos(const lightinfo_t *const l, const int i, const int subsample, vec3_t pos) {
+    VectorCopy(l->surfpt[i], pos);
+    VectorAdd(pos, l->surfpt[i], pos);
+    VectorAdd(pos, l->surfpt[subsample], pos);
+    VectorScale(pos, 1.0 / 3.0, pos);
+}
+
 // =====================================================================================
 //  BuildFacelights
 // =====================================================================================
@@ -1503,8 +2313,12 @@ void BuildFacelights(const int facenum) {
     vec_t *spot;
     patch_t *patch;
     const dplane_t *plane;
-    byte pvs[(MAX_MAP_LEAFS + 7) / 8];
-    int thisoffset = -1, lastoffset = -1;
+    directlight_t *const *lights;
+    skycache_t sky;
+    vec3_t pos;
+    vec3_t *centrelight = NULL;
+    bool *refine = NULL;
+    bool adaptive;
     int lightmapwidth;
     int lightmapheight;
     int size;
@@ -1571,42 +2385,60 @@ void BuildFacelights(const int facenum) {
 
     size = lightmapwidth * lightmapheight;
     hlassume(size <= MAX_SINGLEMAP, assume_MAX_SINGLEMAP);
+    hlassume(facelight[facenum].numsamples == l.numsurfpt, assume_GENERIC);// see AllocFacelights
+
+    if (g_incremental) {
+        s_facelight_hashes[facenum] = FaceLightsHash(&l, facenum);
+        if (ReuseFacelight(&l, facenum)) {
+            return;
+        }
+    }
+
+    ResetFaceArena();
+    InitSkyCache(&sky, l.surfpt, lightmapwidth, lightmapheight);
 
-    facelight[facenum].numsamples = l.numsurfpt;
+    //
+    // with -extraadaptive, light the centre of every luxel first and only oversample
+    // the luxels the centres say need it
+    //
+    adaptive = g_extra && g_extra_adaptive;
+    if (adaptive) {
+        centrelight = (vec3_t *) FaceAlloc(l.numsurfpt * MAXLIGHTMAPS * sizeof(vec3_t));
 
-    for (k = 0; k < MAXLIGHTMAPS; k++) {
-        facelight[facenum].samples[k] = (sample_t *) calloc(l.numsurfpt, sizeof(sample_t));
+        for (i = 0; i < l.numsurfpt; i++) {
+            vec3_t pointnormal = {0, 0, 0};
+
+            sky.sample = i;
+            GetExtraSamplePos(&l, i, i, pos);
+            GetPhongNormal(facenum, pos, pointnormal);
+            GatherSampleLight(pos, GetSampleLights(l.surfpt[i]), pointnormal, &centrelight[i * MAXLIGHTMAPS], f->styles, sky.points ? &sky : NULL);
+        }
+
+        refine = MarkExtraLuxels(centrelight, f->styles, lightmapwidth, lightmapheight);
     }
 
     spot = l.surfpt[0];
     for (i = 0; i < l.numsurfpt; i++, spot += 3) {
         vec3_t pointnormal = {0, 0, 0};
 
+        sky.sample = i;
+
         for (k = 0; k < MAXLIGHTMAPS; k++) {
             VectorCopy(spot, facelight[facenum].samples[k][i].pos);
         }
 
-        // get the PVS for the pos to limit the number of checks
-        if (!g_visdatasize) {
-            memset(pvs, 255, (g_numleafs + 7) / 8);
-            lastoffset = -1;
-        } else {
-            dleaf_t *leaf = PointInLeaf(spot);
-
-            thisoffset = leaf->visofs;
-            if (i == 0 || thisoffset != lastoffset) {
-                hlassert(thisoffset != -1);
-                DecompressVis(&g_dvisdata[leaf->visofs], pvs, sizeof(pvs));
-            }
-            lastoffset = thisoffset;
-        }
+        // get the lights in the PVS of the pos to limit the number of checks
+        lights = GetSampleLights(spot);
 
         memset(sampled, 0, sizeof(sampled));
 
-        // If we are doing "extra" samples, oversample the direct light around the point.
-        if (g_extra) {
+        if (adaptive && !refine[i]) {
+            for (j = 0; j < MAXLIGHTMAPS; j++) {
+                VectorCopy(centrelight[i * MAXLIGHTMAPS + j], sampled[j]);
+            }
+        } else if (g_extra) {
+            // If we are doing "extra" samples, oversample the direct light around the point.
             int weighting[3][3] = {{5, 9, 5}, {9, 16, 9}, {5, 9, 5}};
-            vec3_t pos;
             int s, t, subsamples = 0;
 
             for (t = -1; t <= 1; t++) {
@@ -1618,18 +2450,19 @@ void BuildFacelights(const int facenum) {
                     if ((0 <= s + sample_s) && (s + sample_s < lightmapwidth) && (0 <= t + sample_t) && (t + sample_t < lightmapheight)) {
                         vec3_t subsampled[MAXLIGHTMAPS];
 
-                        for (j = 0; j < MAXLIGHTMAPS; j++) {
-                            VectorFill(subsampled[j], 0);
-                        }
-
-                        // Calculate the point one third of the way toward the "subsample point"
-                        VectorCopy(l.surfpt[i], pos);
-                        VectorAdd(pos, l.surfpt[i], pos);
-                        VectorAdd(pos, l.surfpt[subsample], pos);
-                        VectorScale(pos, 1.0 / 3.0, pos);
+                        if (adaptive && !s && !t) {
+                            for (j = 0; j < MAXLIGHTMAPS; j++) {
+                                VectorCopy(centrelight[i * MAXLIGHTMAPS + j], subsampled[j]);
+                            }
+                        } else {
+                            for (j = 0; j < MAXLIGHTMAPS; j++) {
+                                VectorFill(subsampled[j], 0);
+                            }
 
-                        GetPhongNormal(facenum, pos, pointnormal);
-                        GatherSampleLight(pos, pvs, pointnormal, subsampled, f->styles);
+                            GetExtraSamplePos(&l, i, subsample, pos);
+                            GetPhongNormal(facenum, pos, pointnormal);
+                            GatherSampleLight(pos, lights, pointnormal, subsampled, f->styles, sky.points ? &sky : NULL);
+                        }
                         for (j = 0; j < MAXLIGHTMAPS && (f->styles[j] != 255); j++) {
                             VectorScale(subsampled[j], weighting[s + 1][t + 1], subsampled[j]);
                             VectorAdd(sampled[j], subsampled[j], sampled[j]);
@@ -1643,7 +2476,7 @@ void BuildFacelights(const int facenum) {
             }
         } else {
             GetPhongNormal(facenum, spot, pointnormal);
-            GatherSampleLight(spot, pvs, pointnormal, sampled, f->styles);
+            GatherSampleLight(spot, lights, pointnormal, sampled, f->styles, sky.points ? &sky : NULL);
         }
 
         for (j = 0; j < MAXLIGHTMAPS && (f->styles[j] != 255); j++) {
@@ -1668,24 +2501,25 @@ void BuildFacelights(const int facenum) {
     // average up the direct light on each patch for radiosity
     if (g_numbounce > 0) {
         for (patch = g_face_patches[facenum]; patch; patch = patch->next) {
+            const patchbuild_t *build = PatchBuild(patch);
 #ifdef ZHLT_TEXLIGHT
             //LRC:
             unsigned istyle;
             for (istyle = 0; istyle < MAXLIGHTMAPS && patch->totalstyle[istyle] != 255; istyle++) {
-                if (patch->samples[istyle]) {
+                if (build->samples[istyle]) {
                     vec3_t v;// BUGBUG: Use a weighted average instead?
 
-                    VectorScale(patch->samplelight[istyle], (1.0f / patch->samples[istyle]), v);
+                    VectorScale(build->samplelight[istyle], (1.0f / build->samples[istyle]), v);
                     VectorAdd(patch->totallight[istyle], v, patch->totallight[istyle]);
                     VectorAdd(patch->directlight[istyle], v, patch->directlight[istyle]);
                 }
             }
             //LRC (ends)
 #else
-            if (patch->samples) {
+            if (build->samples) {
                 vec3_t v;// BUGBUG: Use a weighted average instead?
 
-                VectorScale(patch->samplelight, (1.0f / patch->samples), v);
+                VectorScale(build->samplelight, (1.0f / build->samples), v);
                 VectorAdd(patch->totallight, v, patch->totallight);
                 VectorAdd(patch->directlight, v, patch->directlight);
             }
@@ -1877,6 +2711,7 @@ void FinalLightFace(const int facenum) {
     // set up the triangulation
     //
     if (g_numbounce) {
+        ResetFaceArena();
         trian = CreateTriangulation(facenum);
     }
     //
@@ -2014,10 +2849,6 @@ void FinalLightFace(const int facenum) {
             }
         }
     }
-
-    if (g_numbounce) {
-        FreeTriangulation(trian);
-    }
 }
 
 #ifdef ZHLT_TEXLIGHT
@@ -15,8 +15,8 @@ bool point_in_winding(const Winding &w, const dplane_t &plane, const vec_t *cons
         VectorSubtract(w.m_Points[(x + 1) % numpoints], point, A);
         VectorSubtract(w.m_Points[x], point, B);
         CrossProduct(A, B, normal);
-        VectorNormalize(normal);
 
+        // only the sign matters, so the edge normal needs no normalizing
         if (DotProduct(normal, plane.normal) < 0.0) {
             return false;
         }
@@ -156,6 +156,217 @@ void plane_from_points(const vec3_t p1, const vec3_t p2, const vec3_t p3, dplane
     VectorCopy(normal, plane->normal);
 }
 
+// =====================================================================================
+//  Opaque face tree
+//      Bounding volume hierarchy over g_opaque_face_list, built once by MakePatches.
+//      Nodes are stored depth first: an interior node's first child directly follows
+//      it, and 'second' is the index of the other one.
+// =====================================================================================
+#define OPAQUE_LEAF_FACES  4
+#define OPAQUE_MAX_DEPTH   32// past this depth faces are split by count, which bounds the tree depth
+#define OPAQUE_STACK_SIZE  64
+#define OPAQUE_BOX_EPSILON 1.0
+
+typedef struct {
+    vec3_t mins;
+    vec3_t maxs;
+    unsigned second;  // interior nodes: index of the second child
+    unsigned firstface;// leaves: first entry in s_opaque_order
+    unsigned numfaces;// 0 for interior nodes
+} opaquenode_t;
+
+static opaquenode_t *s_opaque_nodes = NULL;
+static unsigned s_opaque_numnodes = 0;
+static unsigned *s_opaque_order = NULL;
+static vec3_t *s_opaque_mins = NULL;
+static vec3_t *s_opaque_maxs = NULL;
+
+// =====================================================================================
+//  BuildOpaqueNode_r
+// =====================================================================================
+static void BuildOpaqueNode_r(const unsigned first, const unsigned count, const unsigned depth) {
+    opaquenode_t *node = &s_opaque_nodes[s_opaque_numnodes++];
+    vec3_t centermins;
+    vec3_t centermaxs;
+    unsigned split;
+    unsigned i;
+    int axis;
+
+    VectorFill(node->mins, 99999);
+    VectorFill(node->maxs, -99999);
+    VectorFill(centermins, 99999);
+    VectorFill(centermaxs, -99999);
+
+    for (i = first; i < first + count; i++) {
+        const unsigned x = s_opaque_order[i];
+        int k;
+
+        for (k = 0; k < 3; k++) {
+            const vec_t center = (s_opaque_mins[x][k] + s_opaque_maxs[x][k]) * 0.5;
+
+            if (s_opaque_mins[x][k] < node->mins[k]) {
+                node->mins[k] = s_opaque_mins[x][k];
+            }
+            if (s_opaque_maxs[x][k] > node->maxs[k]) {
+                node->maxs[k] = s_opaque_maxs[x][k];
+            }
+            if (center < centermins[k]) {
+                centermins[k] = center;
+            }
+            if (center > centermaxs[k]) {
+                centermaxs[k] = center;
+            }
+        }
+    }
+
+    node->second = 0;
+    node->firstface = first;
+    node->numfaces = count;
+    if (count <= OPAQUE_LEAF_FACES) {
+        return;
+    }
+
+    // split at the middle of the longest axis of the face centers
+    axis = 0;
+    for (i = 1; i < 3; i++) {
+        if (centermaxs[i] - centermins[i] > centermaxs[axis] - centermins[axis]) {
+            axis = i;
+        }
+    }
+
+    split = first;
+    if (depth < OPAQUE_MAX_DEPTH && centermaxs[axis] > centermins[axis]) {
+        const vec_t mid = (centermins[axis] + centermaxs[axis]) * 0.5;
+        unsigned last = first + count;
+
+        while (split < last) {
+            const unsigned x = s_opaque_order[split];
+
+            if ((s_opaque_mins[x][axis] + s_opaque_maxs[x][axis]) * 0.5 < mid) {
+                split++;
+            } else {
+                last--;
+                s_opaque_order[split] = s_opaque_order[last];
+                s_opaque_order[last] = x;
+            }
+        }
+    }
+    if (split == first || split == first + count) {
+        split = first + count / 2;
+    }
+
+    node->numfaces = 0;
+    BuildOpaqueNode_r(first, split - first, depth + 1);
+    node->second = s_opaque_numnodes;
+    BuildOpaqueNode_r(split, first + count - split, depth + 1);
+}
+
+// =====================================================================================
+//  BuildOpaqueFaceTree
+// =====================================================================================
+void BuildOpaqueFaceTree() {
+    unsigned x;
+
+    FreeOpaqueFaceTree();
+    if (!g_opaque_face_count) {
+        return;
+    }
+
+    s_opaque_nodes = (opaquenode_t *) calloc(2 * g_opaque_face_count, sizeof(opaquenode_t));
+    s_opaque_order = (unsigned *) calloc(g_opaque_face_count, sizeof(unsigned));
+    s_opaque_mins = (vec3_t *) calloc(g_opaque_face_count, sizeof(vec3_t));
+    s_opaque_maxs = (vec3_t *) calloc(g_opaque_face_count, sizeof(vec3_t));
+    hlassume(s_opaque_nodes != NULL && s_opaque_order != NULL && s_opaque_mins != NULL && s_opaque_maxs != NULL, assume_NoMemory);
+
+    for (x = 0; x < g_opaque_face_count; x++) {
+        const Winding *winding = g_opaque_face_list[x].winding;
+        unsigned p;
+
+        s_opaque_order[x] = x;
+        VectorFill(s_opaque_mins[x], 99999);
+        VectorFill(s_opaque_maxs[x], -99999);
+        for (p = 0; p < winding->m_NumPoints; p++) {
+            int k;
+
+            for (k = 0; k < 3; k++) {
+                if (winding->m_Points[p][k] < s_opaque_mins[x][k]) {
+                    s_opaque_mins[x][k] = winding->m_Points[p][k];
+                }
+                if (winding->m_Points[p][k] > s_opaque_maxs[x][k]) {
+                    s_opaque_maxs[x][k] = winding->m_Points[p][k];
+                }
+            }
+        }
+
+        // leave room for the rounding in the segment/plane intersection
+        for (p = 0; p < 3; p++) {
+            s_opaque_mins[x][p] -= OPAQUE_BOX_EPSILON;
+            s_opaque_maxs[x][p] += OPAQUE_BOX_EPSILON;
+        }
+    }
+
+    BuildOpaqueNode_r(0, g_opaque_face_count, 0);
+
+    Developer(DEVELOPER_LEVEL_MESSAGE, "%u opaque face tree nodes\n", s_opaque_numnodes);
+}
+
+// =====================================================================================
+//  FreeOpaqueFaceTree
+// =====================================================================================
+void FreeOpaqueFaceTree() {
+    free(s_opaque_nodes);
+    free(s_opaque_order);
+    free(s_opaque_mins);
+    free(s_opaque_maxs);
+
+    s_opaque_nodes = NULL;
+    s_opaque_order = NULL;
+    s_opaque_mins = NULL;
+    s_opaque_maxs = NULL;
+    s_opaque_numnodes = 0;
+}
+
+// =====================================================================================
+//  SegmentCrossesBox
+//      Slab test of the segment start + t * delta, 0 <= t <= 1
+// =====================================================================================
+static bool SegmentCrossesBox(const vec3_t start, const vec3_t delta, const vec3_t invdelta, const vec3_t mins, const vec3_t maxs) {
+    vec_t enter = 0.0;
+    vec_t leave = 1.0;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        vec_t t1;
+        vec_t t2;
+
+        if (delta[i] == 0.0) {
+            if (start[i] < mins[i] || start[i] > maxs[i]) {
+                return false;
+            }
+            continue;
+        }
+
+        t1 = (mins[i] - start[i]) * invdelta[i];
+        t2 = (maxs[i] - start[i]) * invdelta[i];
+        if (t1 > t2) {
+            vec_t tmp = t1;
+            t1 = t2;
+            t2 = tmp;
+        }
+        if (t1 > enter) {
+            enter = t1;
+        }
+        if (t2 < leave) {
+            leave = t2;
+        }
+        if (enter > leave) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 // =====================================================================================
 //  TestSegmentAgainstOpaqueList
 //      Returns true if the segment intersects an item in the opaque list
@@ -166,36 +377,68 @@ bool TestSegmentAgainstOpaqueList(const vec_t *p1, const vec_t *p2, vec3_t &scal
 bool TestSegmentAgainstOpaqueList(const vec_t *p1, const vec_t *p2)
 #endif
 {
-    unsigned x;
-    vec3_t point;
-    const dplane_t *plane;
-    const Winding *winding;
+    unsigned stack[OPAQUE_STACK_SIZE];
+    int stackdepth;
+    vec3_t delta;
+    vec3_t invdelta;
+    int i;
 
 #ifdef HLRAD_HULLU
     vec3_t scale = {1.0, 1.0, 1.0};
 #endif
 
-    for (x = 0; x < g_opaque_face_count; x++) {
-        plane = &g_opaque_face_list[x].plane;
-        winding = g_opaque_face_list[x].winding;
+    if (!s_opaque_numnodes) {
+#ifdef HLRAD_HULLU
+        VectorCopy(scale, scaleout);
+#endif
+        return false;
+    }
+    ProfileCount(eProfileOpaqueTests, 1);
+
+    VectorSubtract(p2, p1, delta);
+    for (i = 0; i < 3; i++) {
+        invdelta[i] = delta[i] != 0.0 ? 1.0 / delta[i] : 0.0;
+    }
+
+    stack[0] = 0;
+    stackdepth = 1;
+    while (stackdepth) {
+        const opaquenode_t *node = &s_opaque_nodes[stack[--stackdepth]];
+        unsigned f;
+
+        if (!SegmentCrossesBox(p1, delta, invdelta, node->mins, node->maxs)) {
+            continue;
+        }
+
+        if (!node->numfaces) {
+            stack[stackdepth++] = node->second;
+            stack[stackdepth++] = (node - s_opaque_nodes) + 1;
+            continue;
+        }
+
+        for (f = node->firstface; f < node->firstface + node->numfaces; f++) {
+            const unsigned x = s_opaque_order[f];
+            const dplane_t *plane = &g_opaque_face_list[x].plane;
+            vec_t d1;
+            vec_t d2;
+            vec3_t point;
 
 #ifdef HLRAD_OPACITY// AJM
-        l_opacity = g_opaque_face_list[x].l_opacity;
-#endif
-        if (intersect_linesegment_plane(plane, p1, p2, point)) {
-#if 0
-      Log
-          ("Ray from (%4.3f %4.3f %4.3f) to (%4.3f %4.3f %4.3f) hits plane at (%4.3f %4.3f %4.3f)\n Plane (%4.3f %4.3f %4.3f) %4.3f\n",
-           p1[0], p1[1], p1[2], p2[0], p2[1], p2[2], point[0], point[1], point[2], plane->normal[0],
-           plane->normal[1], plane->normal[2], plane->dist);
-#endif
-            if (point_in_winding(*winding, *plane, point)) {
-#if 0
-        Log("Ray from (%4.3f %4.3f %4.3f) to (%4.3f %4.3f %4.3f) blocked by face %u @ (%4.3f %4.3f %4.3f)\n",
-            p1[0], p1[1], p1[2],
-            p2[0], p2[1], p2[2], g_opaque_face_list[x].facenum, point[0], point[1], point[2]);
+            l_opacity = g_opaque_face_list[x].l_opacity;
 #endif
+            if (node->numfaces > 1 && !SegmentCrossesBox(p1, delta, invdelta, s_opaque_mins[x], s_opaque_maxs[x])) {
+                continue;
+            }
+
+            // the segment has to end up with exactly one endpoint on the back side
+            d1 = DotProduct(plane->normal, p1);
+            d2 = DotProduct(plane->normal, p2);
+            if ((d1 <= plane->dist) == (d2 <= plane->dist)) {
+                continue;
+            }
+            intersect_line_plane(plane, p1, p2, point);
 
+            if (point_in_winding(*g_opaque_face_list[x].winding, *plane, point)) {
 #ifdef HLRAD_HULLU
                 if (g_opaque_face_list[x].transparency) {
                     VectorMultiply(scale, g_opaque_face_list[x].transparency_scale, scale);
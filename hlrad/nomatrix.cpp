@@ -52,7 +52,7 @@ static bool CheckVisBitNoVismatrix(unsigned patchnum1, unsigned patchnum2)
             //  if v2 is not behind light plane
             //  && v2 is visible from v1
             if (
-                    (DotProduct(patch2->origin, plane->normal) > (PatchPlaneDist(patch) + MINIMUM_PATCH_DISTANCE)) && (TestLine_r(0, patch->origin, patch2->origin) == CONTENTS_EMPTY)
+                    (DotProduct(patch2->origin, plane->normal) > (PatchPlaneDist(patch) + MINIMUM_PATCH_DISTANCE)) && (TestLine(patch->origin, patch2->origin) == CONTENTS_EMPTY)
 #ifdef HLRAD_HULLU
                     && (!TestSegmentAgainstOpaqueList(patch->origin, patch2->origin, transparency)))
 #else
@@ -112,6 +112,5 @@ void MakeScalesNoVismatrix() {
         } else {
             unlink(transferfile);
         }
-        DumpTransfersMemoryUsage();
     }
 }
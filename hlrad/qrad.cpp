@@ -27,7 +27,8 @@
 typedef enum {
     eMethodVismatrix,
     eMethodSparseVismatrix,
-    eMethodNoVismatrix
+    eMethodNoVismatrix,
+    eMethodHierarchical
 } eVisMethods;
 
 eVisMethods g_method = eMethodVismatrix;
@@ -38,15 +39,21 @@ int g_falloff = DEFAULT_FALLOFF;
 patch_t *g_face_patches[MAX_MAP_FACES];
 entity_t *g_face_entity[MAX_MAP_FACES];
 eModelLightmodes g_face_lightmode[MAX_MAP_FACES];
-patch_t g_patches[MAX_PATCHES];
+patch_t *g_patches = NULL;
+patchbuild_t *g_patch_build = NULL;
 unsigned g_num_patches;
+static unsigned s_max_patches = 0;// allocated size of g_patches and g_patch_build
 
+// indexed by patch, then by cluster (see GetClusterWeights), see AllocBounceLight
 #ifdef ZHLT_TEXLIGHT
-static vec3_t emitlight[MAX_PATCHES][MAXLIGHTMAPS];//LRC
-static vec3_t addlight[MAX_PATCHES][MAXLIGHTMAPS]; //LRC
+// one array per style slot, so that a bounce streams through emitlight[slot] in patch order
+static vec3_t *emitlight[MAXLIGHTMAPS];//LRC
+static vec3_t *addlight[MAXLIGHTMAPS]; //LRC
+// compact copy of g_patches[].totalstyle, kept in step with it while gathering
+static byte (*emitstyles)[MAXLIGHTMAPS];
 #else
-static vec3_t emitlight[MAX_PATCHES];
-static vec3_t addlight[MAX_PATCHES];
+static vec3_t *emitlight;
+static vec3_t *addlight;
 #endif
 
 vec3_t g_face_offset[MAX_MAP_FACES];// for rotating bmodels
@@ -54,6 +61,9 @@ vec3_t g_face_offset[MAX_MAP_FACES];// for rotating bmodels
 vec_t g_direct_scale = DEFAULT_DLIGHT_SCALE;
 
 unsigned g_numbounce = DEFAULT_BOUNCE;// 3; /* Originally this was 8 */
+vec_t g_bounce_converge = DEFAULT_BOUNCE_CONVERGE;
+bool g_progressive = DEFAULT_PROGRESSIVE;
+unsigned g_progressive_passes = DEFAULT_PROGRESSIVE_PASSES;
 
 static bool g_dumppatches = DEFAULT_DUMPPATCHES;
 
@@ -67,11 +77,17 @@ char g_source[_MAX_PATH] = "";
 
 char g_vismatfile[_MAX_PATH] = "";
 bool g_incremental = DEFAULT_INCREMENTAL;
+int g_transfer_bits = DEFAULT_TRANSFER_BITS;
+vec_t g_hierarchy_error = DEFAULT_HIERARCHY_ERROR;
+bool g_matrix_file = DEFAULT_MATRIX_FILE;
+bool g_profile = DEFAULT_PROFILE;
 #ifndef HLRAD_WHOME
 float g_qgamma = DEFAULT_GAMMA;
 #endif
 float g_indirect_sun = DEFAULT_INDIRECT_SUN;
 bool g_extra = DEFAULT_EXTRA;
+bool g_extra_adaptive = DEFAULT_EXTRA_ADAPTIVE;
+float g_extra_threshold = DEFAULT_EXTRA_THRESHOLD;
 bool g_texscale = DEFAULT_TEXSCALE;
 
 float g_smoothing_threshold;
@@ -267,6 +283,7 @@ void GetParamsFromEnt(entity_t *mapent) {
       0 : "No Vismatrix"
       1 : "Sparse Vismatrix"
       2 : "Normal"
+      3 : "Hierarchical"
   ]
   */
     iTmp = IntForKey(mapent, "sparse");
@@ -276,9 +293,12 @@ void GetParamsFromEnt(entity_t *mapent) {
         g_method = eMethodNoVismatrix;
     } else if (iTmp == 2) {
         g_method = eMethodVismatrix;
+    } else if (iTmp == 3) {
+        g_method = eMethodHierarchical;
     }
     Log("%30s [ %-9s ]\n", "Sparse Vismatrix", g_method == eMethodSparseVismatrix ? "on" : "off");
     Log("%30s [ %-9s ]\n", "NoVismatrix", g_method == eMethodNoVismatrix ? "on" : "off");
+    Log("%30s [ %-9s ]\n", "Hierarchical", g_method == eMethodHierarchical ? "on" : "off");
 
     /*
   circus(choices) : "Circus RAD lighting" : 0 =
@@ -615,15 +635,17 @@ static void cutWindingWithGrid(patch_t *patch, const dplane_t *const plA, const
     unsigned int count;
     unsigned int x;
 
+    patchbuild_t *build = PatchBuild(patch);
+
     g_numwindings = 0;
-    if (CreateStrips(patch->winding, plA, patch->chop)) {
-        delete patch->winding;
-        patch->winding = NULL;// Invalidated by CreateStrips routine
+    if (CreateStrips(build->winding, plA, build->chop)) {
+        delete build->winding;
+        build->winding = NULL;// Invalidated by CreateStrips routine
     }
     count = g_numwindings;
 
     for (x = 0, winding = windingArray; x < count; x++, winding++) {
-        if (CreateStrips(*winding, plB, patch->chop)) {
+        if (CreateStrips(*winding, plB, build->chop)) {
             delete *winding;
             *winding = NULL;
         }
@@ -661,16 +683,40 @@ static void getGridPlanes(const patch_t *const p, dplane_t *const pl) {
     }
 }
 
+// =====================================================================================
+//  AllocPatch
+//      Grows g_patches and g_patch_build as needed, which moves them, so callers
+//      must not hold on to patch pointers across it. SortPatches relinks the faces.
+// =====================================================================================
+static unsigned AllocPatch() {
+    hlassume(g_num_patches < MAX_PATCHES, assume_MAX_PATCHES);
+
+    if (g_num_patches == s_max_patches) {
+        s_max_patches = s_max_patches ? s_max_patches * 2 : 4096;
+        if (s_max_patches > MAX_PATCHES) {
+            s_max_patches = MAX_PATCHES;
+        }
+        g_patches = (patch_t *) realloc(g_patches, s_max_patches * sizeof(patch_t));
+        g_patch_build = (patchbuild_t *) realloc(g_patch_build, s_max_patches * sizeof(patchbuild_t));
+        hlassume(g_patches != NULL && g_patch_build != NULL, assume_NoMemory);
+    }
+
+    memset(&g_patches[g_num_patches], 0, sizeof(patch_t));
+    memset(&g_patch_build[g_num_patches], 0, sizeof(patchbuild_t));
+    return g_num_patches++;
+}
+
 // =====================================================================================
 //  SubdividePatch
 // =====================================================================================
-static void SubdividePatch(patch_t *patch) {
+static void SubdividePatch(const unsigned patchnum) {
     dplane_t planes[2];
     dplane_t *plA = &planes[0];
     dplane_t *plB = &planes[1];
     Winding **winding;
     unsigned x;
-    patch_t *new_patch;
+    patch_t *patch = &g_patches[patchnum];
+    unsigned new_patchnum;
 
     memset(windingArray, 0, sizeof(windingArray));
     g_numwindings = 0;
@@ -685,26 +731,26 @@ static void SubdividePatch(patch_t *patch) {
         winding++;
         x++;
     }
-    patch->winding = *winding;
+    PatchBuild(patch)->winding = *winding;
+    patch->area = (*winding)->getArea();
+    (*winding)->getCenter(patch->origin);
+    PlacePatchInside(patch);
     winding++;
     x++;
-    patch->area = patch->winding->getArea();
-    patch->winding->getCenter(patch->origin);
-    PlacePatchInside(patch);
 
-    new_patch = g_patches + g_num_patches;
     for (; x < g_numwindings; x++, winding++) {
         if (*winding) {
-            memcpy(new_patch, patch, sizeof(patch_t));
+            patch_t *new_patch;
 
-            new_patch->winding = *winding;
-            new_patch->area = new_patch->winding->getArea();
-            new_patch->winding->getCenter(new_patch->origin);
-            PlacePatchInside(new_patch);
+            new_patchnum = AllocPatch();
+            new_patch = &g_patches[new_patchnum];
+            memcpy(new_patch, &g_patches[patchnum], sizeof(patch_t));
+            memcpy(&g_patch_build[new_patchnum], &g_patch_build[patchnum], sizeof(patchbuild_t));
 
-            new_patch++;
-            g_num_patches++;
-            hlassume(g_num_patches < MAX_PATCHES, assume_MAX_PATCHES);
+            g_patch_build[new_patchnum].winding = *winding;
+            new_patch->area = (*winding)->getArea();
+            (*winding)->getCenter(new_patch->origin);
+            PlacePatchInside(new_patch);
         }
     }
 
@@ -774,6 +820,8 @@ static void MakePatchForFace(const int fn, Winding *w)
     // No g_patches at all for the sky!
     if (!IsSpecial(f)) {
         patch_t *patch;
+        patchbuild_t *build;
+        unsigned patchnum;
         vec3_t light;
         vec3_t centroid = {0, 0, 0};
 
@@ -789,14 +837,14 @@ static void MakePatchForFace(const int fn, Winding *w)
             return;
         }
 
-        patch = &g_patches[g_num_patches];
-        hlassume(g_num_patches < MAX_PATCHES, assume_MAX_PATCHES);
-        memset(patch, 0, sizeof(patch_t));
+        patchnum = AllocPatch();
+        patch = &g_patches[patchnum];
+        build = &g_patch_build[patchnum];
 
-        patch->winding = w;
+        build->winding = w;
 
-        patch->area = patch->winding->getArea();
-        patch->winding->getCenter(patch->origin);
+        patch->area = build->winding->getArea();
+        build->winding->getCenter(patch->origin);
         patch->faceNumber = fn;
 
         totalarea += patch->area;
@@ -824,11 +872,8 @@ static void MakePatchForFace(const int fn, Winding *w)
         //LRC (ends)
 #endif
 
-        patch->scale = getScale(patch);
-        patch->chop = getChop(patch);
-
-        g_face_patches[fn] = patch;
-        g_num_patches++;
+        build->scale = getScale(patch);
+        build->chop = getChop(patch);
 
         // Per-face data
         {
@@ -857,7 +902,7 @@ static void MakePatchForFace(const int fn, Winding *w)
             vec3_t mins;
             vec3_t maxs;
 
-            patch->winding->getBounds(mins, maxs);
+            build->winding->getBounds(mins, maxs);
 
             if (g_subdivide) {
                 vec_t amt;
@@ -878,7 +923,7 @@ static void MakePatchForFace(const int fn, Winding *w)
                                   "Patch at (%4.3f %4.3f %4.3f) (face %d) tiny area (%4.3f) not subdividing \n",
                                   patch->origin[0], patch->origin[1], patch->origin[2], patch->faceNumber, patch->area);
                     } else {
-                        SubdividePatch(patch);
+                        SubdividePatch(patchnum);
                     }
                 }
             }
@@ -922,6 +967,7 @@ static void FreeOpaqueFaceList() {
     unsigned x;
     opaqueList_t *opaque = g_opaque_face_list;
 
+    FreeOpaqueFaceTree();
     for (x = 0; x < g_opaque_face_count; x++, opaque++) {
         delete opaque->winding;
         opaque->winding = NULL;
@@ -1096,6 +1142,8 @@ static void MakePatches() {
         }
     }
 
+    BuildOpaqueFaceTree();
+
     Log("%i base patches\n", g_num_patches);
     Log("%i opaque faces\n", g_opaque_face_count);
     Log("%i square feet [%.2f square inches]\n", (int) (totalarea / 144), totalarea);
@@ -1105,24 +1153,52 @@ static void MakePatches() {
 //  patch_sorter
 // =====================================================================================
 static int CDECL patch_sorter(const void *p1, const void *p2) {
-    patch_t *patch1 = (patch_t *) p1;
-    patch_t *patch2 = (patch_t *) p2;
+    const unsigned i1 = *(const unsigned *) p1;
+    const unsigned i2 = *(const unsigned *) p2;
+    const patch_t *patch1 = &g_patches[i1];
+    const patch_t *patch2 = &g_patches[i2];
 
     if (patch1->faceNumber < patch2->faceNumber) {
         return -1;
     } else if (patch1->faceNumber > patch2->faceNumber) {
         return 1;
     } else {
-        return 0;
+        // keep the order MakePatches made them in
+        return (i1 < i2) ? -1 : (i1 > i2);
     }
 }
 
 // =====================================================================================
 //  patch_sorter
-//      This sorts the patches by facenumber, which makes their runs compress even better
+//      This sorts the patches by facenumber, which makes their runs compress even better.
+//      The sorted copies are allocated to fit, dropping the slack AllocPatch left.
 // =====================================================================================
 static void SortPatches() {
-    qsort((void *) g_patches, (size_t) g_num_patches, sizeof(patch_t), patch_sorter);
+    unsigned *order;
+    patch_t *patches;
+    patchbuild_t *build;
+    unsigned i;
+
+    order = (unsigned *) malloc((g_num_patches + 1) * sizeof(unsigned));
+    patches = (patch_t *) malloc((g_num_patches + 1) * sizeof(patch_t));
+    build = (patchbuild_t *) malloc((g_num_patches + 1) * sizeof(patchbuild_t));
+    hlassume(order != NULL && patches != NULL && build != NULL, assume_NoMemory);
+
+    for (i = 0; i < g_num_patches; i++) {
+        order[i] = i;
+    }
+    qsort((void *) order, (size_t) g_num_patches, sizeof(unsigned), patch_sorter);
+    for (i = 0; i < g_num_patches; i++) {
+        patches[i] = g_patches[order[i]];
+        build[i] = g_patch_build[order[i]];
+    }
+
+    free(order);
+    free(g_patches);
+    free(g_patch_build);
+    g_patches = patches;
+    g_patch_build = build;
+    s_max_patches = g_num_patches;
 
     // Fixup g_face_patches & Fixup patch->next
     memset(g_face_patches, 0, sizeof(g_face_patches));
@@ -1150,15 +1226,19 @@ static void SortPatches() {
 // =====================================================================================
 static void FreePatches() {
     unsigned x;
-    patch_t *patch = g_patches;
 
     // AJM EX
     //Log("patches: %i of %i (%2.2lf percent)\n", g_num_patches, MAX_PATCHES, (double)((double)g_num_patches / (double)MAX_PATCHES));
 
-    for (x = 0; x < g_num_patches; x++, patch++) {
-        delete patch->winding;
+    for (x = 0; x < g_num_patches; x++) {
+        delete g_patch_build[x].winding;
     }
-    memset(g_patches, 0, sizeof(patch_t) * g_num_patches);
+    free(g_patches);
+    free(g_patch_build);
+    g_patches = NULL;
+    g_patch_build = NULL;
+    g_num_patches = 0;
+    s_max_patches = 0;
 }
 
 //=====================================================================
@@ -1179,7 +1259,7 @@ static void WriteWorld(const char *const name) {
         Error("Couldn't open %s", name);
 
     for (j = 0, patch = g_patches; j < g_num_patches; j++, patch++) {
-        w = patch->winding;
+        w = g_patch_build[j].winding;
         Log("%i\n", w->m_NumPoints);
         for (i = 0; i < w->m_NumPoints; i++) {
 #ifdef ZHLT_TEXLIGHT
@@ -1202,34 +1282,219 @@ static void WriteWorld(const char *const name) {
 
 // =====================================================================================
 //  CollectLight
+//      Adds the gathered light to the patches and makes it what they emit next,
+//      or with accumulate (-progressive) adds it to what they have yet to shoot.
+//      Returns the energy (light times area) gathered.
 // =====================================================================================
-static void CollectLight() {
+static vec_t CollectLight(const bool accumulate) {
 #ifdef ZHLT_TEXLIGHT
     unsigned j;//LRC
 #endif
     unsigned i;
     patch_t *patch;
+    vec_t energy = 0;
 
     for (i = 0, patch = g_patches; i < g_num_patches; i++, patch++) {
 #ifdef ZHLT_TEXLIGHT
         //LRC
         for (j = 0; j < MAXLIGHTMAPS && patch->totalstyle[j] != 255; j++) {
-            VectorAdd(patch->totallight[j], addlight[i][j], patch->totallight[j]);
-            VectorScale(addlight[i][j], TRANSFER_SCALE, emitlight[i][j]);
-            VectorClear(addlight[i][j]);
+            energy += VectorAvg(addlight[j][i]) * patch->area;
+            VectorAdd(patch->totallight[j], addlight[j][i], patch->totallight[j]);
+            if (accumulate) {
+                VectorMA(emitlight[j][i], TRANSFER_SCALE, addlight[j][i], emitlight[j][i]);
+            } else {
+                VectorScale(addlight[j][i], TRANSFER_SCALE, emitlight[j][i]);
+            }
+            VectorClear(addlight[j][i]);
         }
 #else
+        energy += VectorAvg(addlight[i]) * patch->area;
         VectorAdd(patch->totallight, addlight[i], patch->totallight);
-        VectorScale(addlight[i], TRANSFER_SCALE, emitlight[i]);
+        if (accumulate) {
+            VectorMA(emitlight[i], TRANSFER_SCALE, addlight[i], emitlight[i]);
+        } else {
+            VectorScale(addlight[i], TRANSFER_SCALE, emitlight[i]);
+        }
         VectorClear(addlight[i]);
 #endif
     }
+    return energy;
+}
+
+// =====================================================================================
+//  EmittedEnergy
+//      The energy (light times area) patch i emits in the next bounce, or has yet
+//      to shoot with -progressive
+// =====================================================================================
+static vec_t EmittedEnergy(const unsigned i) {
+#ifdef ZHLT_TEXLIGHT
+    unsigned j;
+    vec_t light = 0;
+
+    for (j = 0; j < MAXLIGHTMAPS && emitstyles[i][j] != 255; j++) {
+        light += VectorAvg(emitlight[j][i]);
+    }
+    return light * g_patches[i].area / TRANSFER_SCALE;
+#else
+    return VectorAvg(emitlight[i]) * g_patches[i].area / TRANSFER_SCALE;
+#endif
+}
+
+// =====================================================================================
+//  UpdateClusterLight
+//      With -hierarchical, the light emitted by each face cluster, gathered
+//      through the indices past the last patch, see hierarchy.cpp.
+//      With shooting, only the patches marked in it count.
+// =====================================================================================
+static void UpdateClusterLight(const byte *const shooting) {
+    unsigned c, k;
+    unsigned firstpatch, numpatches;
+    const vec_t *weights;
+
+    for (c = 0; c < g_num_clusters; c++) {
+        const unsigned x = g_num_patches + c;
+
+        weights = GetClusterWeights(c, &firstpatch, &numpatches);
+#ifdef ZHLT_TEXLIGHT
+        {
+            unsigned m, s;
+            unsigned numslots = 0;
+            byte styleslot[256];
+
+            memset(styleslot, 255, sizeof(styleslot));
+            for (m = 0; m < MAXLIGHTMAPS; m++) {
+                emitstyles[x][m] = 255;
+                VectorClear(emitlight[m][x]);
+            }
+
+            for (k = 0; k < numpatches; k++) {
+                const unsigned i = firstpatch + k;
+
+                if (shooting && !shooting[i]) {
+                    continue;
+                }
+                for (s = 0; s < MAXLIGHTMAPS && emitstyles[i][s] != 255; s++) {
+                    m = styleslot[emitstyles[i][s]];
+                    if (m == 255) {
+                        if (numslots == MAXLIGHTMAPS) {
+                            continue;// the patch itself warned about this when gathering
+                        }
+                        m = numslots++;
+                        styleslot[emitstyles[i][s]] = m;
+                        emitstyles[x][m] = emitstyles[i][s];
+                    }
+                    VectorMA(emitlight[m][x], weights[k], emitlight[s][i], emitlight[m][x]);
+                }
+            }
+        }
+#else
+        VectorClear(emitlight[x]);
+        for (k = 0; k < numpatches; k++) {
+            if (shooting && !shooting[firstpatch + k]) {
+                continue;
+            }
+            VectorMA(emitlight[x], weights[k], emitlight[firstpatch + k], emitlight[x]);
+        }
+#endif
+    }
+}
+
+#ifdef ZHLT_TEXLIGHT
+// =====================================================================================
+//  InitStyleSlots
+//      Clears the gather sums of patch j and fills its style -> slot remap table
+// =====================================================================================
+static unsigned InitStyleSlots(const int j, byte *styleslot) {
+    unsigned m;
+
+    memset(styleslot, 255, 256);
+    for (m = 0; m < MAXLIGHTMAPS && emitstyles[j][m] != 255; m++) {
+        styleslot[emitstyles[j][m]] = m;
+        VectorClear(addlight[m][j]);
+    }
+    return m;
+}
+
+// =====================================================================================
+//  GrantStyleSlot
+//      Returns the slot of style on patch j, granting a new one if needed,
+//      or MAXLIGHTMAPS if the patch has no room left.  Not thread safe.
+// =====================================================================================
+static unsigned GrantStyleSlot(const unsigned j, const byte style) {
+    unsigned m;
+
+    for (m = 0; m < MAXLIGHTMAPS && emitstyles[j][m] != 255; m++) {
+        if (emitstyles[j][m] == style) {
+            return m;
+        }
+    }
+    if (m == MAXLIGHTMAPS) {
+        Warning("Too many direct light styles on a face(?,?,?)");
+        return MAXLIGHTMAPS;
+    }
+    g_patches[j].totalstyle[m] = style;
+    emitstyles[j][m] = style;
+    //						Log("Granting new style %d to patch at idx %d\n", style, m);
+    return m;
+}
+
+// =====================================================================================
+//  GrantGatherStyles
+//      Gives each patch, in patch order, a slot for every style it is about to
+//      gather, so that GatherLight only reads emitstyles.
+//      Returns false once nothing new was granted; the styles then stay as they
+//      are for the rest of the bounces.
+// =====================================================================================
+static bool GrantGatherStyles() {
+    unsigned j, k, l, s;
+    byte before[MAXLIGHTMAPS];
+    bool granted = false;
+    const patch_t *patch;
+    const transfer_index_t *tIndex;
+
+    for (j = 0, patch = g_patches; j < g_num_patches; j++, patch++) {
+        memcpy(before, emitstyles[j], MAXLIGHTMAPS);
+
+        for (k = 0, tIndex = patch->tIndex; k < patch->iIndex; k++, tIndex++) {
+            for (l = 0; l <= tIndex->size; l++) {
+                const byte *emitstyle = emitstyles[tIndex->index + l];
+
+                for (s = 0; s < MAXLIGHTMAPS && emitstyle[s] != 255; s++) {
+                    GrantStyleSlot(j, emitstyle[s]);
+                }
+            }
+        }
+
+        if (memcmp(before, emitstyles[j], MAXLIGHTMAPS)) {
+            granted = true;
+        }
+    }
+    return granted;
+}
+
+// =====================================================================================
+//  GatheredFinite
+//      Whether all the sums of patch j are still finite after an unchecked gather
+// =====================================================================================
+static bool GatheredFinite(const int j, const unsigned numslots) {
+    unsigned m;
+
+    for (m = 0; m < numslots; m++) {
+        if (!isPointFinite(addlight[m][j])) {
+            return false;
+        }
+    }
+    return true;
 }
+#endif
 
 // =====================================================================================
 //  GatherLight
 //      Get light from other g_patches
-//      Run multi-threaded
+//      Run multi-threaded, after GrantGatherStyles
+//      The transfers are first added without checking each one for being finite;
+//      only when the resulting sums are not is the patch gathered again, skipping
+//      the broken transfers as before.
 // =====================================================================================
 #ifdef SYSTEM_WIN32
 #pragma warning(push)
@@ -1241,15 +1506,24 @@ static void GatherLight(int threadnum) {
 
 #ifdef ZHLT_TEXLIGHT
     unsigned k, m;//LRC
-//LRC    vec3_t          sum;
+    unsigned numslots;
+    byte styleslot[256];
+    bool checked;
 #else
     unsigned k;
     vec3_t sum;
 #endif
 
     unsigned iIndex;
+    transfer_data_t *transfers;
     transfer_data_t *tData;
     transfer_index_t *tIndex;
+    transfer_data_t *expanded = NULL;
+
+    if (g_transfer_bits != 32) {
+        expanded = (transfer_data_t *) AllocBlock((g_num_patches + 1) * sizeof(transfer_data_t));
+        hlassume(expanded != NULL, assume_NoMemory);
+    }
 
     while (1) {
         j = GetThreadWork();
@@ -1258,19 +1532,60 @@ static void GatherLight(int threadnum) {
         }
 
         patch = &g_patches[j];
-
-        tData = patch->tData;
-        tIndex = patch->tIndex;
-        iIndex = patch->iIndex;
+        transfers = ExpandTransfers(patch, expanded);
 
 #ifdef ZHLT_TEXLIGHT
         //LRC
-        for (m = 0; m < MAXLIGHTMAPS && patch->totalstyle[m] != 255; m++) {
-            VectorClear(addlight[j][m]);
+        numslots = InitStyleSlots(j, styleslot);
+        for (checked = false;; checked = true) {
+            tData = transfers;
+            tIndex = patch->tIndex;
+            iIndex = patch->iIndex;
+
+            for (k = 0; k < iIndex; k++, tIndex++) {
+                unsigned l;
+                unsigned size = (tIndex->size + 1);
+                unsigned patchnum = tIndex->index;
+
+                for (l = 0; l < size; l++, tData++, patchnum++) {
+                    const byte *emitstyle = emitstyles[patchnum];
+                    unsigned s;
+
+                    // for each style on the emitting patch
+                    for (s = 0; s < MAXLIGHTMAPS && emitstyle[s] != 255; s++) {
+                        vec3_t v;
+
+                        // find the matching style on this (destination) patch
+                        m = styleslot[emitstyle[s]];
+                        if (m == 255) {
+                            continue;// no room left, see GrantGatherStyles
+                        }
+
+                        VectorScale(emitlight[s][patchnum], (*tData), v);
+                        if (!checked || isPointFinite(v)) {
+                            VectorAdd(addlight[m][j], v, addlight[m][j]);
+                        } else {
+                            Verbose("GatherLight, v (%4.3f %4.3f %4.3f)@(%4.3f %4.3f %4.3f)\n",
+                                    v[0], v[1], v[2], patch->origin[0], patch->origin[1], patch->origin[2]);
+                        }
+                    }
+                }
+            }
+
+            if (checked || GatheredFinite(j, numslots)) {
+                break;
+            }
+            for (m = 0; m < numslots; m++) {
+                VectorClear(addlight[m][j]);
+            }
         }
+        //LRC (ends)
 #else
+        tData = transfers;
+        tIndex = patch->tIndex;
+        iIndex = patch->iIndex;
+
         VectorClear(sum);
-#endif
 
         for (k = 0; k < iIndex; k++, tIndex++) {
             unsigned l;
@@ -1279,38 +1594,7 @@ static void GatherLight(int threadnum) {
 
             for (l = 0; l < size; l++, tData++, patchnum++) {
                 vec3_t v;
-#ifdef ZHLT_TEXLIGHT
-                //LRC:
-                patch_t *emitpatch = &g_patches[patchnum];
-                unsigned emitstyle;
-
-                // for each style on the emitting patch
-                for (emitstyle = 0; emitstyle < MAXLIGHTMAPS && emitpatch->totalstyle[emitstyle] != 255; emitstyle++) {
-                    // find the matching style on this (destination) patch
-                    for (m = 0; m < MAXLIGHTMAPS && patch->totalstyle[m] != 255; m++) {
-                        if (patch->totalstyle[m] == emitpatch->totalstyle[emitstyle]) {
-                            break;
-                        }
-                    }
 
-                    if (m == MAXLIGHTMAPS) {
-                        Warning("Too many direct light styles on a face(?,?,?)");
-                    } else {
-                        if (patch->totalstyle[m] == 255) {
-                            patch->totalstyle[m] = emitpatch->totalstyle[emitstyle];
-                            //							Log("Granting new style %d to patch at idx %d\n", patch->totalstyle[m], m);
-                        }
-                        VectorScale(emitlight[patchnum][emitstyle], (*tData), v);
-                        if (isPointFinite(v)) {
-                            VectorAdd(addlight[j][m], v, addlight[j][m]);
-                        } else {
-                            Verbose("GatherLight, v (%4.3f %4.3f %4.3f)@(%4.3f %4.3f %4.3f)\n",
-                                    v[0], v[1], v[2], patch->origin[0], patch->origin[1], patch->origin[2]);
-                        }
-                    }
-                }
-                //LRC (ends)
-#else
                 VectorScale(emitlight[patchnum], (*tData), v);
                 if (isPointFinite(v)) {
                     VectorAdd(sum, v, sum);
@@ -1318,16 +1602,16 @@ static void GatherLight(int threadnum) {
                     Verbose("GatherLight, v (%4.3f %4.3f %4.3f)@(%4.3f %4.3f %4.3f)\n",
                             v[0], v[1], v[2], patch->origin[0], patch->origin[1], patch->origin[2]);
                 }
-#endif
             }
         }
 
-#ifdef ZHLT_TEXLIGHT
-        //LRC        VectorCopy(sum, addlight[j]);
-#else
         VectorCopy(sum, addlight[j]);
 #endif
     }
+
+    if (expanded) {
+        FreeBlock(expanded);
+    }
 }
 
 // RGB Transfer version
@@ -1338,7 +1622,9 @@ static void GatherRGBLight(int threadnum) {
 
 #ifdef ZHLT_TEXLIGHT
     unsigned k, m;//LRC
-//LRC    vec3_t          sum;
+    unsigned numslots;
+    byte styleslot[256];
+    bool checked;
 #else
     unsigned k;
     vec3_t sum;
@@ -1356,18 +1642,58 @@ static void GatherRGBLight(int threadnum) {
 
         patch = &g_patches[j];
 
-        tRGBData = patch->tRGBData;
-        tIndex = patch->tIndex;
-        iIndex = patch->iIndex;
-
 #ifdef ZHLT_TEXLIGHT
         //LRC
-        for (m = 0; m < MAXLIGHTMAPS && patch->totalstyle[m] != 255; m++) {
-            VectorClear(addlight[j][m]);
+        numslots = InitStyleSlots(j, styleslot);
+        for (checked = false;; checked = true) {
+            tRGBData = patch->tRGBData;
+            tIndex = patch->tIndex;
+            iIndex = patch->iIndex;
+
+            for (k = 0; k < iIndex; k++, tIndex++) {
+                unsigned l;
+                unsigned size = (tIndex->size + 1);
+                unsigned patchnum = tIndex->index;
+
+                for (l = 0; l < size; l++, tRGBData++, patchnum++) {
+                    const byte *emitstyle = emitstyles[patchnum];
+                    unsigned s;
+
+                    // for each style on the emitting patch
+                    for (s = 0; s < MAXLIGHTMAPS && emitstyle[s] != 255; s++) {
+                        vec3_t v;
+
+                        // find the matching style on this (destination) patch
+                        m = styleslot[emitstyle[s]];
+                        if (m == 255) {
+                            continue;// no room left, see GrantGatherStyles
+                        }
+
+                        VectorMultiply(emitlight[s][patchnum], (*tRGBData), v);
+                        if (!checked || isPointFinite(v)) {
+                            VectorAdd(addlight[m][j], v, addlight[m][j]);
+                        } else {
+                            Verbose("GatherLight, v (%4.3f %4.3f %4.3f)@(%4.3f %4.3f %4.3f)\n",
+                                    v[0], v[1], v[2], patch->origin[0], patch->origin[1], patch->origin[2]);
+                        }
+                    }
+                }
+            }
+
+            if (checked || GatheredFinite(j, numslots)) {
+                break;
+            }
+            for (m = 0; m < numslots; m++) {
+                VectorClear(addlight[m][j]);
+            }
         }
+        //LRC (ends)
 #else
+        tRGBData = patch->tRGBData;
+        tIndex = patch->tIndex;
+        iIndex = patch->iIndex;
+
         VectorClear(sum);
-#endif
 
         for (k = 0; k < iIndex; k++, tIndex++) {
             unsigned l;
@@ -1376,85 +1702,423 @@ static void GatherRGBLight(int threadnum) {
 
             for (l = 0; l < size; l++, tRGBData++, patchnum++) {
                 vec3_t v;
+
+                VectorMultiply(emitlight[patchnum], (*tRGBData), v);
+                if (isPointFinite(v)) {
+                    VectorAdd(sum, v, sum);
+                } else {
+                    Verbose("GatherLight, v (%4.3f %4.3f %4.3f)@(%4.3f %4.3f %4.3f)\n",
+                            v[0], v[1], v[2], patch->origin[0], patch->origin[1], patch->origin[2]);
+                }
+            }
+        }
+
+        VectorCopy(sum, addlight[j]);
+#endif
+    }
+}
+#endif
+
+// =====================================================================================
+//  Progressive refinement (-progressive)
+//      Rather than every patch gathering all the light of the last bounce, the
+//      patches holding the most light not yet shot send it out through the gather
+//      lists turned around, and the rest waits for a later pass.  emitlight holds
+//      the light each patch has yet to shoot.
+// =====================================================================================
+#define SHOOT_BLOCK 1024      // receiving patches per work item of ShootLight
+#define PROGRESSIVE_BATCH 0.5 // part of the unshot energy shot per pass
+
+static unsigned *s_shoot_first = NULL;    // per emitter, into s_shoot_receivers and s_shoot_offsets
+static unsigned *s_shoot_receivers = NULL;// in patch order for each emitter
+static unsigned *s_shoot_offsets = NULL;  // of the transfer in the list of the receiver
+static unsigned *s_shooters = NULL;
+static unsigned s_num_shooters = 0;
+static vec_t *s_unshot = NULL;
+
+// =====================================================================================
+//  CreateShootLists
+// =====================================================================================
+static void CreateShootLists() {
+    const unsigned numemitters = g_num_patches + g_num_clusters;
+    unsigned j, x, y, offset;
+    unsigned *next;
+    const patch_t *patch;
+    const transfer_index_t *tIndex;
+
+    s_shoot_first = (unsigned *) AllocBlock((numemitters + 1) * sizeof(unsigned));
+    next = (unsigned *) AllocBlock((numemitters + 1) * sizeof(unsigned));
+    hlassume(s_shoot_first != NULL && next != NULL, assume_NoMemory);
+
+    for (j = 0, patch = g_patches; j < g_num_patches; j++, patch++) {
+        for (x = 0, tIndex = patch->tIndex; x < patch->iIndex; x++, tIndex++) {
+            for (y = 0; y <= tIndex->size; y++) {
+                s_shoot_first[tIndex->index + y + 1]++;
+            }
+        }
+    }
+    for (x = 0; x < numemitters; x++) {
+        s_shoot_first[x + 1] += s_shoot_first[x];
+        next[x] = s_shoot_first[x];
+    }
+
+    s_shoot_receivers = (unsigned *) AllocBlock((s_shoot_first[numemitters] + 1) * sizeof(unsigned));
+    s_shoot_offsets = (unsigned *) AllocBlock((s_shoot_first[numemitters] + 1) * sizeof(unsigned));
+    hlassume(s_shoot_receivers != NULL && s_shoot_offsets != NULL, assume_NoMemory);
+
+    for (j = 0, patch = g_patches; j < g_num_patches; j++, patch++) {
+        offset = 0;
+        for (x = 0, tIndex = patch->tIndex; x < patch->iIndex; x++, tIndex++) {
+            for (y = 0; y <= tIndex->size; y++, offset++) {
+                const unsigned t = next[tIndex->index + y]++;
+
+                s_shoot_receivers[t] = j;
+                s_shoot_offsets[t] = offset;
+            }
+        }
+    }
+
+    FreeBlock(next);
+}
+
+// =====================================================================================
+//  FreeShootLists
+// =====================================================================================
+static void FreeShootLists() {
+    if (s_shoot_first) {
+        FreeBlock(s_shoot_first);
+        FreeBlock(s_shoot_receivers);
+        FreeBlock(s_shoot_offsets);
+    }
+    s_shoot_first = NULL;
+    s_shoot_receivers = NULL;
+    s_shoot_offsets = NULL;
+}
+
 #ifdef ZHLT_TEXLIGHT
-                //LRC:
-                patch_t *emitpatch = &g_patches[patchnum];
-                unsigned emitstyle;
-
-                // for each style on the emitting patch
-                for (emitstyle = 0; emitstyle < MAXLIGHTMAPS && emitpatch->totalstyle[emitstyle] != 255; emitstyle++) {
-                    // find the matching style on this (destination) patch
-                    for (m = 0; m < MAXLIGHTMAPS && patch->totalstyle[m] != 255; m++) {
-                        if (patch->totalstyle[m] == emitpatch->totalstyle[emitstyle]) {
-                            break;
-                        }
-                    }
+// =====================================================================================
+//  GrantShootStyles
+//      Gives each receiver of s_shooters a slot for every style shot at it, in
+//      shooter order, so that ShootLight only reads emitstyles
+// =====================================================================================
+static void GrantShootStyles() {
+    unsigned k, t, s;
 
-                    if (m == MAXLIGHTMAPS) {
-                        Warning("Too many direct light styles on a face(?,?,?)");
-                    } else {
-                        if (patch->totalstyle[m] == 255) {
-                            patch->totalstyle[m] = emitpatch->totalstyle[emitstyle];
-                            //							Log("Granting new style %d to patch at idx %d\n", patch->totalstyle[m], m);
+    for (k = 0; k < s_num_shooters; k++) {
+        const unsigned x = s_shooters[k];
+
+        for (t = s_shoot_first[x]; t < s_shoot_first[x + 1]; t++) {
+            for (s = 0; s < MAXLIGHTMAPS && emitstyles[x][s] != 255; s++) {
+                GrantStyleSlot(s_shoot_receivers[t], emitstyles[x][s]);
+            }
+        }
+    }
+}
+
+// =====================================================================================
+//  ShootStyleSlot
+//      The slot of style on patch j, or MAXLIGHTMAPS if it had no room for it
+// =====================================================================================
+static inline unsigned ShootStyleSlot(const unsigned j, const byte style) {
+    unsigned m;
+
+    for (m = 0; m < MAXLIGHTMAPS && emitstyles[j][m] != 255; m++) {
+        if (emitstyles[j][m] == style) {
+            return m;
+        }
+    }
+    return MAXLIGHTMAPS;
+}
+#endif
+
+// =====================================================================================
+//  ShootLight
+//      Sends the light of s_shooters to one block of receiving patches, so that
+//      no two threads ever add to the same patch.  Run after GrantShootStyles.
+// =====================================================================================
+static void ShootLight(int threadnum) {
+    int b;
+    unsigned k, t;
+    unsigned first, last;
+
+    while (1) {
+        b = GetThreadWork();
+        if (b == -1) {
+            break;
+        }
+
+        first = b * SHOOT_BLOCK;
+        last = (first + SHOOT_BLOCK < g_num_patches) ? first + SHOOT_BLOCK : g_num_patches;
+
+        for (k = 0; k < s_num_shooters; k++) {
+            const unsigned x = s_shooters[k];
+            const unsigned end = s_shoot_first[x + 1];
+            unsigned lo = s_shoot_first[x];
+            unsigned hi = end;
+
+            // the first receiver inside the block
+            while (lo < hi) {
+                const unsigned mid = (lo + hi) / 2;
+
+                if (s_shoot_receivers[mid] < first) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+
+            for (t = lo; t < end && s_shoot_receivers[t] < last; t++) {
+                const unsigned j = s_shoot_receivers[t];
+                const patch_t *patch = &g_patches[j];
+                vec3_t trans;
+                vec3_t v;
+
+#ifdef HLRAD_HULLU
+                if (g_rgb_transfers) {
+                    VectorCopy(patch->tRGBData[s_shoot_offsets[t]], trans);
+                } else
+#endif
+                {
+                    VectorFill(trans, GetTransfer(patch, s_shoot_offsets[t]));
+                }
+
+#ifdef ZHLT_TEXLIGHT
+                {
+                    unsigned s, m;
+
+                    for (s = 0; s < MAXLIGHTMAPS && emitstyles[x][s] != 255; s++) {
+                        m = ShootStyleSlot(j, emitstyles[x][s]);
+                        if (m == MAXLIGHTMAPS) {
+                            continue;
                         }
-                        VectorMultiply(emitlight[patchnum][emitstyle], (*tRGBData), v);
+
+                        VectorMultiply(emitlight[s][x], trans, v);
                         if (isPointFinite(v)) {
-                            VectorAdd(addlight[j][m], v, addlight[j][m]);
+                            VectorAdd(addlight[m][j], v, addlight[m][j]);
                         } else {
-                            Verbose("GatherLight, v (%4.3f %4.3f %4.3f)@(%4.3f %4.3f %4.3f)\n",
+                            Verbose("ShootLight, v (%4.3f %4.3f %4.3f)@(%4.3f %4.3f %4.3f)\n",
                                     v[0], v[1], v[2], patch->origin[0], patch->origin[1], patch->origin[2]);
                         }
                     }
                 }
-                //LRC (ends)
 #else
-                VectorMultiply(emitlight[patchnum], (*tRGBData), v);
+                VectorMultiply(emitlight[x], trans, v);
                 if (isPointFinite(v)) {
-                    VectorAdd(sum, v, sum);
+                    VectorAdd(addlight[j], v, addlight[j]);
                 } else {
-                    Verbose("GatherLight, v (%4.3f %4.3f %4.3f)@(%4.3f %4.3f %4.3f)\n",
+                    Verbose("ShootLight, v (%4.3f %4.3f %4.3f)@(%4.3f %4.3f %4.3f)\n",
                             v[0], v[1], v[2], patch->origin[0], patch->origin[1], patch->origin[2]);
                 }
 #endif
             }
         }
+    }
+}
+
+static int CDECL unshot_sorter(const void *p1, const void *p2) {
+    const unsigned i1 = *(const unsigned *) p1;
+    const unsigned i2 = *(const unsigned *) p2;
+
+    if (s_unshot[i1] != s_unshot[i2]) {
+        return s_unshot[i1] > s_unshot[i2] ? -1 : 1;
+    }
+    return i1 < i2 ? -1 : (i1 > i2);
+}
+
+// =====================================================================================
+//  ProgressiveLight
+//      Each pass shoots the patches holding PROGRESSIVE_BATCH of the light not
+//      yet shot, brightest first, until what is left is below -converge of the
+//      direct light (DEFAULT_PROGRESSIVE_CONVERGE without it), or -passes passes
+//      are done.  -bounce does not limit the passes.
+// =====================================================================================
+static void ProgressiveLight(const vec_t directenergy) {
+    unsigned pass, i, n, c;
+    unsigned firstpatch, numpatches;
+    unsigned *order;
+    byte *shooting;
+    vec_t unshot, shot;
+    const vec_t converge = g_bounce_converge > 0 ? g_bounce_converge : DEFAULT_PROGRESSIVE_CONVERGE;
+    char name[64];
+
+    CreateShootLists();
+
+    s_unshot = (vec_t *) AllocBlock((g_num_patches + 1) * sizeof(vec_t));
+    s_shooters = (unsigned *) AllocBlock((g_num_patches + g_num_clusters + 1) * sizeof(unsigned));
+    order = (unsigned *) AllocBlock((g_num_patches + 1) * sizeof(unsigned));
+    shooting = (byte *) AllocBlock(g_num_patches + 1);
+    hlassume(s_unshot != NULL && s_shooters != NULL && order != NULL && shooting != NULL, assume_NoMemory);
 
+    for (pass = 0;; pass++) {
+        unshot = 0;
+        for (i = 0; i < g_num_patches; i++) {
+            s_unshot[i] = EmittedEnergy(i);
+            unshot += s_unshot[i];
+            order[i] = i;
+        }
+        if (unshot <= 0 || unshot < converge * directenergy) {
+            Log("Converged after %u passes\n", pass);
+            break;
+        }
+        if (pass == g_progressive_passes) {
+            Log("Stopped after %u passes with %.4f of the direct light left to shoot\n",
+                pass, directenergy > 0 ? unshot / directenergy : 0.0);
+            break;
+        }
+
+        qsort(order, g_num_patches, sizeof(unsigned), unshot_sorter);
+
+        s_num_shooters = 0;
+        for (n = 0, shot = 0; n < g_num_patches && shot < unshot * PROGRESSIVE_BATCH; n++) {
+            shot += s_unshot[order[n]];
+            shooting[order[n]] = 1;
+            s_shooters[s_num_shooters++] = order[n];
+        }
+
+        // the clusters of the shooting patches send their light through the cluster transfers
+        UpdateClusterLight(shooting);
+        for (c = 0; c < g_num_clusters; c++) {
+            GetClusterWeights(c, &firstpatch, &numpatches);
+            for (i = firstpatch; i < firstpatch + numpatches; i++) {
+                if (shooting[i]) {
+                    s_shooters[s_num_shooters++] = g_num_patches + c;
+                    break;
+                }
+            }
+        }
+
+        Verbose("Pass %u: %.4f of the direct light left to shoot, shooting %u patches\n",
+                pass + 1, directenergy > 0 ? unshot / directenergy : 0.0, n);
+#ifdef ZHLT_TEXLIGHT
+        GrantShootStyles();
+#endif
+        printf("Pass %u ", pass + 1);
+        NamedRunThreadsOn((g_num_patches + SHOOT_BLOCK - 1) / SHOOT_BLOCK, g_estimate, ShootLight);
+
+        for (n = 0; n < s_num_shooters && s_shooters[n] < g_num_patches; n++) {
+            i = s_shooters[n];
+            shooting[i] = 0;
 #ifdef ZHLT_TEXLIGHT
-        //LRC        VectorCopy(sum, addlight[j]);
+            for (c = 0; c < MAXLIGHTMAPS; c++) {
+                VectorClear(emitlight[c][i]);
+            }
 #else
-        VectorCopy(sum, addlight[j]);
+            VectorClear(emitlight[i]);
 #endif
+        }
+        CollectLight(true);
+
+        if (g_dumppatches) {
+            sprintf(name, "pass%u.txt", pass);
+            WriteWorld(name);
+        }
     }
+
+    FreeBlock(s_unshot);
+    FreeBlock(s_shooters);
+    FreeBlock(order);
+    FreeBlock(shooting);
+    s_unshot = NULL;
+    s_shooters = NULL;
+    s_num_shooters = 0;
+
+    FreeShootLists();
 }
-#endif
 
 #ifdef SYSTEM_WIN32
 #pragma warning(pop)
 #endif
 
+// =====================================================================================
+//  AllocBounceLight
+//      The light arrays have a slot for every patch and every cluster, so this has
+//      to wait until MakeScalesStub has made the clusters
+// =====================================================================================
+static void AllocBounceLight() {
+    const unsigned count = g_num_patches + g_num_clusters + 1;
+#ifdef ZHLT_TEXLIGHT
+    unsigned j;
+
+    for (j = 0; j < MAXLIGHTMAPS; j++) {
+        emitlight[j] = (vec3_t *) AllocBlock(count * sizeof(vec3_t));
+        addlight[j] = (vec3_t *) AllocBlock(count * sizeof(vec3_t));
+        hlassume(emitlight[j] != NULL && addlight[j] != NULL, assume_NoMemory);
+    }
+    emitstyles = (byte(*)[MAXLIGHTMAPS]) AllocBlock(count * MAXLIGHTMAPS);
+    hlassume(emitstyles != NULL, assume_NoMemory);
+#else
+    emitlight = (vec3_t *) AllocBlock(count * sizeof(vec3_t));
+    addlight = (vec3_t *) AllocBlock(count * sizeof(vec3_t));
+    hlassume(emitlight != NULL && addlight != NULL, assume_NoMemory);
+#endif
+}
+
+// =====================================================================================
+//  FreeBounceLight
+// =====================================================================================
+static void FreeBounceLight() {
+#ifdef ZHLT_TEXLIGHT
+    unsigned j;
+
+    for (j = 0; j < MAXLIGHTMAPS; j++) {
+        FreeBlock(emitlight[j]);
+        FreeBlock(addlight[j]);
+        emitlight[j] = NULL;
+        addlight[j] = NULL;
+    }
+    FreeBlock(emitstyles);
+    emitstyles = NULL;
+#else
+    FreeBlock(emitlight);
+    FreeBlock(addlight);
+    emitlight = NULL;
+    addlight = NULL;
+#endif
+}
+
 // =====================================================================================
 //  BounceLight
+//      With -converge, stops once a bounce gathers less than that part of the
+//      direct light
 // =====================================================================================
 static void BounceLight() {
     unsigned i;
     char name[64];
+    vec_t directenergy = 0;
+    vec_t gathered;
 
 #ifdef ZHLT_TEXLIGHT
     unsigned j;//LRC
+    bool settled = false;
 #endif
 
     for (i = 0; i < g_num_patches; i++) {
 #ifdef ZHLT_TEXLIGHT
         //LRC
+        for (j = 0; j < MAXLIGHTMAPS; j++) {
+            emitstyles[i][j] = g_patches[i].totalstyle[j];
+        }
         for (j = 0; j < MAXLIGHTMAPS && g_patches[i].totalstyle[j] != 255; j++) {
-            VectorScale(g_patches[i].totallight[j], TRANSFER_SCALE, emitlight[i][j]);
+            VectorScale(g_patches[i].totallight[j], TRANSFER_SCALE, emitlight[j][i]);
         }
 #else
         VectorScale(g_patches[i].totallight, TRANSFER_SCALE, emitlight[i]);
 #endif
+        directenergy += EmittedEnergy(i);
+    }
+    UpdateClusterLight(NULL);
+
+    if (g_progressive) {
+        ProgressiveLight(directenergy);
+        return;
     }
 
     for (i = 0; i < g_numbounce; i++) {
+#ifdef ZHLT_TEXLIGHT
+        if (!settled) {
+            settled = !GrantGatherStyles();
+        }
+#endif
         printf("Bounce %u ", i + 1);
 #ifdef HLRAD_HULLU
         if (g_rgb_transfers) {
@@ -1465,12 +2129,19 @@ static void BounceLight() {
 #else
         NamedRunThreadsOn(g_num_patches, g_estimate, GatherLight);
 #endif
-        CollectLight();
+        gathered = CollectLight(false);
+        UpdateClusterLight(NULL);
 
         if (g_dumppatches) {
             sprintf(name, "bounce%u.txt", i);
             WriteWorld(name);
         }
+
+        Verbose("Bounce %u gathered %.4f of the direct light\n", i + 1, directenergy > 0 ? gathered / directenergy : 0.0);
+        if (gathered < g_bounce_converge * directenergy) {
+            Log("Converged after %u bounces\n", i + 1);
+            break;
+        }
     }
 }
 
@@ -1480,12 +2151,13 @@ static void BounceLight() {
 static void CheckMaxPatches() {
     switch (g_method) {
         case eMethodVismatrix:
-            hlassume(g_num_patches < MAX_VISMATRIX_PATCHES, assume_MAX_PATCHES);
+            hlassume(g_num_patches < (g_matrix_file ? MAX_FILE_VISMATRIX_PATCHES : MAX_VISMATRIX_PATCHES), assume_MAX_PATCHES);
             break;
         case eMethodSparseVismatrix:
             hlassume(g_num_patches < MAX_SPARSE_VISMATRIX_PATCHES, assume_MAX_PATCHES);
             break;
         case eMethodNoVismatrix:
+        case eMethodHierarchical:
             hlassume(g_num_patches < MAX_PATCHES, assume_MAX_PATCHES);
             break;
     }
@@ -1495,6 +2167,8 @@ static void CheckMaxPatches() {
 //  MakeScalesStub
 // =====================================================================================
 static void MakeScalesStub() {
+    CreateScalePatches();
+
     switch (g_method) {
         case eMethodVismatrix:
             MakeScalesVismatrix();
@@ -1505,7 +2179,15 @@ static void MakeScalesStub() {
         case eMethodNoVismatrix:
             MakeScalesNoVismatrix();
             break;
+        case eMethodHierarchical:
+            MakeScalesHierarchical();
+            break;
     }
+
+    CompactTransfers();
+    DumpTransfersMemoryUsage();
+
+    FreeScalePatches();
 }
 
 // =====================================================================================
@@ -1515,6 +2197,21 @@ static void FreeTransfers() {
     unsigned x;
     patch_t *patch = g_patches;
 
+    for (x = 0; x < g_num_patches; x++, patch++) {
+        if (patch->tCompact) {
+            FreeBlock(patch->tCompact);
+            patch->tCompact = NULL;
+        }
+    }
+    patch = g_patches;
+
+    FreeClusters();
+
+    // transfers read from the cache point into it
+    if (freetransfers()) {
+        return;
+    }
+
     for (x = 0; x < g_num_patches; x++, patch++) {
         if (patch->tData) {
             FreeBlock(patch->tData);
@@ -1538,10 +2235,12 @@ static void FreeTransfers() {
 // =====================================================================================
 static void RadWorld() {
     unsigned i;
+    char facelightfile[_MAX_PATH];
 #ifdef ZHLT_TEXLIGHT
     unsigned j;
 #endif
 
+    ProfileBegin("patches");
     MakeBackplanes();
     MakeParents(0, -1);
     MakeTnodes(&g_dmodels[0]);
@@ -1551,24 +2250,46 @@ static void RadWorld() {
     CheckMaxPatches();// Check here for exceeding max patches, to prevent a lot of work from occuring before an error occurs
     SortPatches();    // Makes the runs in the Transfer Compression really good
     PairEdges();
+    ProfileEnd();
 
     // create directlights out of g_patches and lights
+    ProfileBegin("directlights");
     CreateDirectLights();
+    ProfileEnd();
 
     Log("\n");
 
     // build initial facelights
+    ProfileBegin("facelights");
+    AllocFacelights();
+    if (g_incremental) {
+        safe_strncpy(facelightfile, g_source, _MAX_PATH);
+        StripExtension(facelightfile);
+        DefaultExtension(facelightfile, ".dlc");
+        readfacelights(facelightfile);
+    }
     NamedRunThreadsOnIndividual(g_numfaces, g_estimate, BuildFacelights);
+    FreeFaceArenas();
+    if (g_incremental) {
+        writefacelights(facelightfile);
+    }
+    ProfileEnd();
 
     // free up the direct lights now that we have facelights
     DeleteDirectLights();
 
     if (g_numbounce > 0) {
         // build transfer lists
+        ProfileBegin("transfers");
         MakeScalesStub();
+        ProfileEnd();
 
         // spread light around
+        ProfileBegin("bounce");
+        AllocBounceLight();
         BounceLight();
+        FreeBounceLight();
+        ProfileEnd();
 
         for (i = 0; i < g_num_patches; i++) {
 #ifdef ZHLT_TEXLIGHT// AJM
@@ -1584,9 +2305,13 @@ static void RadWorld() {
     FreeTransfers();
 
     // blend bounced light into direct light and save
+    ProfileBegin("finallight");
     PrecompLightmapOffsets();
 
     NamedRunThreadsOnIndividual(g_numfaces, g_estimate, FinalLightFace);
+    FreeFaceArenas();
+    FreeFacelights();
+    ProfileEnd();
 }
 
 // =====================================================================================
@@ -1597,9 +2322,17 @@ static void Usage() {
 
     Log("\n-= %s Options =-\n\n", g_Program);
     Log("    -sparse         : Enable low memory vismatrix algorithm\n");
-    Log("    -nomatrix       : Disable usage of vismatrix entirely\n\n");
+    Log("    -nomatrix       : Disable usage of vismatrix entirely\n");
+    Log("    -matrixfile     : Keep the vismatrix in a scratch file instead of memory\n");
+    Log("    -hierarchical   : Gather from distant faces as a whole instead of per patch\n");
+    Log("    -hierror #      : Set largest face size over distance gathered as a whole\n\n");
     Log("    -extra          : Improve lighting quality by doing 9 point oversampling\n");
+    Log("    -extraadaptive  : Turns on -extra, but only oversamples where the light changes sharply\n");
+    Log("    -extrathresh #  : Light difference that makes -extraadaptive oversample a luxel\n");
     Log("    -bounce #       : Set number of radiosity bounces\n");
+    Log("    -converge #     : Stop bouncing once a bounce adds less than this part of the direct light\n");
+    Log("    -progressive    : Shoot light from the brightest patches first instead of bouncing\n");
+    Log("    -passes #       : Set most -progressive passes, which otherwise run until -converge\n");
     Log("    -ambient r g b  : Set ambient world light (0.0 to 1.0, r g b)\n");
     Log("    -maxlight #     : Set maximum light intensity value\n");
     Log("    -circus         : Enable 'circus' mode for locating unlit lightmaps\n");
@@ -1618,13 +2351,19 @@ static void Usage() {
     Log("    -sky #          : Set ambient sunlight contribution in the shade outside\n");
     Log("    -lights file    : Manually specify a lights.rad file to use\n");
     Log("    -noskyfix       : Disable light_environment being global\n");
-    Log("    -incremental    : Use or create an incremental transfer list file\n\n");
-    Log("    -dump           : Dumps light patches to a file for hlrad debugging info\n\n");
+    Log("    -skycache       : Share sky visibility between neighbouring samples (faster, approximate)\n");
+    Log("    -noskycache     : Trace every sky direction for every sample\n");
+    Log("    -incremental    : Reuse the transfers and unchanged direct light of the last run\n");
+    Log("    -transferbits # : Store transfers as 32 bit floats, or quantized to 16 or 8 bits\n");
+    Log("                      for the bounces; building them still takes the full float size\n\n");
+    Log("    -dump           : Dumps light patches to a file for hlrad debugging info\n");
+    Log("    -profile        : Write the time and counters of each phase to mapname.prof.json\n\n");
     Log("    -texdata #      : Alter maximum texture memory limit (in kb)\n");
     Log("    -chart          : display bsp statitics\n");
     Log("    -low | -high    : run program an altered priority level\n");
     Log("    -nolog          : Do not generate the compile logfiles\n");
     Log("    -threads #      : manually specify the number of threads to run\n");
+    Log("    -affinity mode  : none, pin threads to CPUs, or keep them on one numa node\n");
 #ifdef SYSTEM_WIN32
     Log("    -estimate       : display estimated time during compile\n");
 #endif
@@ -1709,6 +2448,7 @@ static void Settings() {
             break;
     }
     Log("priority             [ %17s ] [ %17s ]\n", tmp, "Normal");
+    Log("affinity             [ %17s ] [ %17s ]\n", ThreadAffinityName(g_threadaffinity), ThreadAffinityName(DEFAULT_THREAD_AFFINITY));
     Log("\n");
 
     // HLRAD Specific Settings
@@ -1725,11 +2465,38 @@ static void Settings() {
         case eMethodNoVismatrix:
             tmp = "NoMatrix";
             break;
+        case eMethodHierarchical:
+            tmp = "Hierarchical";
+            break;
     }
 
     Log("vismatrix algorithm  [ %17s ] [ %17s ]\n", tmp, "Original");
-    Log("oversampling (-extra)[ %17s ] [ %17s ]\n", g_extra ? "on" : "off", DEFAULT_EXTRA ? "on" : "off");
+    if (g_method == eMethodVismatrix) {
+        Log("vismatrix file       [ %17s ] [ %17s ]\n", g_matrix_file ? "on" : "off", DEFAULT_MATRIX_FILE ? "on" : "off");
+    }
+    if (g_method == eMethodHierarchical) {
+        safe_snprintf(buf1, sizeof(buf1), "%3.3f", g_hierarchy_error);
+        safe_snprintf(buf2, sizeof(buf2), "%3.3f", DEFAULT_HIERARCHY_ERROR);
+        Log("hierarchy error      [ %17s ] [ %17s ]\n", buf1, buf2);
+    }
+    // -extraadaptive turns on -extra as well
+    Log("oversampling (-extra)[ %17s ] [ %17s ]\n", g_extra ? (g_extra_adaptive ? "on (adaptive)" : "on") : "off", DEFAULT_EXTRA ? "on" : "off");
+    if (g_extra) {
+        Log("adaptive oversampling[ %17s ] [ %17s ]\n", g_extra_adaptive ? "on" : "off", DEFAULT_EXTRA_ADAPTIVE ? "on" : "off");
+    }
+    if (g_extra_adaptive) {
+        safe_snprintf(buf1, sizeof(buf1), "%3.3f", g_extra_threshold);
+        safe_snprintf(buf2, sizeof(buf2), "%3.3f", DEFAULT_EXTRA_THRESHOLD);
+        Log("oversample threshold [ %17s ] [ %17s ]\n", buf1, buf2);
+    }
     Log("bounces              [ %17d ] [ %17d ]\n", g_numbounce, DEFAULT_BOUNCE);
+    safe_snprintf(buf1, sizeof(buf1), "%3.4f", g_bounce_converge);
+    safe_snprintf(buf2, sizeof(buf2), "%3.4f", DEFAULT_BOUNCE_CONVERGE);
+    Log("bounce converge      [ %17s ] [ %17s ]\n", buf1, buf2);
+    Log("progressive          [ %17s ] [ %17s ]\n", g_progressive ? "on" : "off", DEFAULT_PROGRESSIVE ? "on" : "off");
+    if (g_progressive) {
+        Log("progressive passes   [ %17u ] [ %17u ]\n", g_progressive_passes, DEFAULT_PROGRESSIVE_PASSES);
+    }
 
     safe_snprintf(buf1, sizeof(buf1), "%1.3f %1.3f %1.3f", g_ambient[0], g_ambient[1], g_ambient[2]);
     safe_snprintf(buf2, sizeof(buf2), "%1.3f %1.3f %1.3f", DEFAULT_AMBIENT_RED, DEFAULT_AMBIENT_GREEN, DEFAULT_AMBIENT_BLUE);
@@ -1803,8 +2570,11 @@ static void Settings() {
     Log("\n");
     Log("opaque entities      [ %17s ] [ %17s ]\n", g_allow_opaques ? "on" : "off", DEFAULT_ALLOW_OPAQUES ? "on" : "off");
     Log("sky lighting fix     [ %17s ] [ %17s ]\n", g_sky_lighting_fix ? "on" : "off", DEFAULT_SKY_LIGHTING_FIX ? "on" : "off");
+    Log("sky cache            [ %17s ] [ %17s ]\n", g_skycache ? "on" : "off", DEFAULT_SKY_CACHE ? "on" : "off");
     Log("incremental          [ %17s ] [ %17s ]\n", g_incremental ? "on" : "off", DEFAULT_INCREMENTAL ? "on" : "off");
+    Log("transfer bits        [ %17d ] [ %17d ]\n", g_transfer_bits, DEFAULT_TRANSFER_BITS);
     Log("dump                 [ %17s ] [ %17s ]\n", g_dumppatches ? "on" : "off", DEFAULT_DUMPPATCHES ? "on" : "off");
+    Log("profile              [ %17s ] [ %17s ]\n", g_profile ? "on" : "off", DEFAULT_PROFILE ? "on" : "off");
 
     // ------------------------------------------------------------------------
     // Changes by Adam Foster - afoster@compsoc.man.ac.uk
@@ -2027,6 +2797,20 @@ int main(const int argc, char **argv) {
             } else {
                 Usage();
             }
+        } else if (!strcasecmp(argv[i], "-converge")) {
+            if (i + 1 < argc) {
+                g_bounce_converge = (float) atof(argv[++i]);
+            } else {
+                Usage();
+            }
+        } else if (!strcasecmp(argv[i], "-progressive")) {
+            g_progressive = true;
+        } else if (!strcasecmp(argv[i], "-passes")) {
+            if (i + 1 < argc) {
+                g_progressive_passes = atoi(argv[++i]);
+            } else {
+                Usage();
+            }
         } else if (!strcasecmp(argv[i], "-dev")) {
             if (i < argc) {
                 g_developer = (developer_level_t) atoi(argv[++i]);
@@ -2168,14 +2952,39 @@ int main(const int argc, char **argv) {
             g_circus = true;
         } else if (!strcasecmp(argv[i], "-noskyfix")) {
             g_sky_lighting_fix = false;
+        } else if (!strcasecmp(argv[i], "-skycache")) {
+            g_skycache = true;
+        } else if (!strcasecmp(argv[i], "-noskycache")) {
+            g_skycache = false;
         } else if (!strcasecmp(argv[i], "-incremental")) {
             g_incremental = true;
+        } else if (!strcasecmp(argv[i], "-profile")) {
+            g_profile = true;
+        } else if (!strcasecmp(argv[i], "-transferbits")) {
+            if (i + 1 < argc) {
+                g_transfer_bits = atoi(argv[++i]);
+                if (g_transfer_bits != 32 && g_transfer_bits != 16 && g_transfer_bits != 8) {
+                    Log("-transferbits must be 32, 16 or 8\n");
+                    Usage();
+                }
+            } else {
+                Usage();
+            }
         } else if (!strcasecmp(argv[i], "-chart")) {
             g_chart = true;
         } else if (!strcasecmp(argv[i], "-low")) {
             g_threadpriority = eThreadPriorityLow;
         } else if (!strcasecmp(argv[i], "-high")) {
             g_threadpriority = eThreadPriorityHigh;
+        } else if (!strcasecmp(argv[i], "-affinity")) {
+            if (i + 1 < argc) {
+                if (!ThreadSetAffinity(argv[++i])) {
+                    Log("Expected none, pin or numa for '-affinity'\n");
+                    Usage();
+                }
+            } else {
+                Usage();
+            }
         } else if (!strcasecmp(argv[i], "-nolog")) {
             g_log = false;
         } else if (!strcasecmp(argv[i], "-gamma")) {
@@ -2203,6 +3012,15 @@ int main(const int argc, char **argv) {
             }
         } else if (!strcasecmp(argv[i], "-extra")) {
             g_extra = true;
+        } else if (!strcasecmp(argv[i], "-extraadaptive")) {
+            g_extra = true;
+            g_extra_adaptive = true;
+        } else if (!strcasecmp(argv[i], "-extrathresh")) {
+            if (i + 1 < argc) {
+                g_extra_threshold = (float) atof(argv[++i]);
+            } else {
+                Usage();
+            }
         } else if (!strcasecmp(argv[i], "-sky")) {
             if (i < argc) {
                 g_indirect_sun = (float) atof(argv[++i]);
@@ -2235,6 +3053,16 @@ int main(const int argc, char **argv) {
             g_method = eMethodSparseVismatrix;
         } else if (!strcasecmp(argv[i], "-nomatrix")) {
             g_method = eMethodNoVismatrix;
+        } else if (!strcasecmp(argv[i], "-matrixfile")) {
+            g_matrix_file = true;
+        } else if (!strcasecmp(argv[i], "-hierarchical")) {
+            g_method = eMethodHierarchical;
+        } else if (!strcasecmp(argv[i], "-hierror")) {
+            if (i + 1 < argc) {
+                g_hierarchy_error = (float) atof(argv[++i]);
+            } else {
+                Usage();
+            }
         } else if (!strcasecmp(argv[i], "-nopaque")) {
             g_allow_opaques = false;
         } else if (!strcasecmp(argv[i], "-dscale")) {
@@ -2359,10 +3187,12 @@ int main(const int argc, char **argv) {
     strcpy(g_source, mapname_from_arg);
     StripExtension(g_source);
     DefaultExtension(g_source, ".bsp");
+    ProfileBegin("load");
     LoadBSPFile(g_source);
     ParseEntities();
     Settings();
     LoadRadFiles(g_Mapname, user_lights, argv[0]);
+    ProfileEnd();
 
     if (!g_visdatasize) {
         Warning("No vis information, direct lighting only.");
@@ -2378,10 +3208,19 @@ int main(const int argc, char **argv) {
     if (g_chart)
         PrintBSPFileSizes();
 
+    ProfileBegin("write");
     WriteBSPFile(g_source);
+    ProfileEnd();
 
     end = I_FloatTime();
     LogTimeElapsed(end - start);
+
+    if (g_profile) {
+        char profilefile[_MAX_PATH];
+
+        safe_snprintf(profilefile, _MAX_PATH, "%s.prof.json", g_Mapname);
+        WriteProfile(profilefile, end - start);
+    }
     // END RAD
 
     return 0;
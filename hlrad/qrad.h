@@ -44,6 +44,10 @@
 #define DEFAULT_FADE 1.0
 #define DEFAULT_FALLOFF 2
 #define DEFAULT_BOUNCE 1
+#define DEFAULT_BOUNCE_CONVERGE 0.0
+#define DEFAULT_PROGRESSIVE false
+#define DEFAULT_PROGRESSIVE_PASSES 100
+#define DEFAULT_PROGRESSIVE_CONVERGE 0.001// when -converge is not given
 #define DEFAULT_DUMPPATCHES false
 #define DEFAULT_AMBIENT_RED 0.0
 #define DEFAULT_AMBIENT_GREEN 0.0
@@ -57,6 +61,10 @@
 #define DEFAULT_DLIGHT_SCALE 2.0
 #define DEFAULT_SMOOTHING_VALUE 50.0
 #define DEFAULT_INCREMENTAL false
+#define DEFAULT_TRANSFER_BITS 32
+#define DEFAULT_HIERARCHY_ERROR 0.25
+#define DEFAULT_MATRIX_FILE false
+#define DEFAULT_PROFILE false
 
 #ifdef ZHLT_PROGRESSFILE         // AJM
 #define DEFAULT_PROGRESSFILE NULL// progress file is only used if g_progressfile is non-null
@@ -78,7 +86,10 @@
 
 #define DEFAULT_INDIRECT_SUN 1.0
 #define DEFAULT_EXTRA false
+#define DEFAULT_EXTRA_ADAPTIVE false
+#define DEFAULT_EXTRA_THRESHOLD 1.0
 #define DEFAULT_SKY_LIGHTING_FIX true
+#define DEFAULT_SKY_CACHE false
 #define DEFAULT_CIRCUS false
 #define DEFAULT_CORING 1.0
 #define DEFAULT_SUBDIVIDE true
@@ -121,9 +132,8 @@
 // O_o ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 // Changes by Jussi Kivilinna <hullu@unitedadmins.com> [http://hullu.xtragaming.com/]
 #ifdef HLRAD_HULLU
-// Transparency light support for bounced light(transfers) is extreamly slow
-// for 'vismatrix' and 'sparse' atm.
-// Only recommended to be used with 'nomatrix' mode
+// Transparency light support for bounced light(transfers); 'vismatrix' and
+// 'sparse' keep the transparencies in a hash table (see vismatrixutil.cpp)
 #define DEFAULT_CUSTOMSHADOW_WITH_BOUNCELIGHT false
 
 // RGB Transfers support for HLRAD .. to be used with -customshadowwithbounce
@@ -153,6 +163,13 @@
 // If patches are allowed to be closer, the light gets amplified (which looks really damn weird)
 #define MINIMUM_PATCH_DISTANCE 1.01
 
+// hashes of what the -incremental caches were computed from
+#ifdef SYSTEM_WIN32
+typedef unsigned __int64 cache_uint64_t;
+#else
+typedef unsigned long long cache_uint64_t;
+#endif
+
 //
 // LIGHTMAP.C STUFF
 //
@@ -177,6 +194,8 @@ typedef struct directlight_s {
     // 'Arghrad'-like features
     vec_t fade;           // falloff scaling for linear and inverse square falloff 1.0 = normal, 0.5 = farther, 2.0 = shorter etc
     unsigned char falloff;// falloff style 0 = default (inverse square), 1 = inverse falloff, 2 = inverse square (arghrad compat)
+    vec_t range;          // distance past which the light stays below g_coring, 0 = unlimited
+    cache_uint64_t hash;  // of the parameters of the light, see DirectLightHash
 
     // -----------------------------------------------------------------------------------
     // Changes by Adam Foster - afoster@compsoc.man.ac.uk
@@ -220,10 +239,14 @@ typedef rgb_transfer_t rgb_transfer_data_t;
 
 #define MAX_COMPRESSED_TRANSFER_INDEX_SIZE ((1 << 12) - 1)
 
-#define MAX_PATCHES (65535 * 4)
+#define MAX_PATCHES ((1 << 20) - 1)// transfer_index_t.index is 20 bits
 #define MAX_VISMATRIX_PATCHES 65535
+#define MAX_FILE_VISMATRIX_PATCHES MAX_PATCHES// -matrixfile
 #define MAX_SPARSE_VISMATRIX_PATCHES MAX_PATCHES
 
+// Number of patches TestPatchToFace hands to TestLines in one go
+#define TESTPATCH_BATCH_SIZE 64
+
 typedef enum {
     ePatchFlagNull = 0,
     ePatchFlagOutside = 1
@@ -233,9 +256,6 @@ typedef struct patch_s {
     struct patch_s *next;// next in face
     vec3_t origin;       // Center centroid of winding (cached info calculated from winding)
     vec_t area;          // Surface area of this patch (cached info calculated from winding)
-    Winding *winding;    // Winding (patches are triangles, so its easy)
-    vec_t scale;         // Texture scale for this face (blend of S and T scale)
-    vec_t chop;          // Texture chop for this face factoring in S and T scale
 
     unsigned iIndex;
     unsigned iData;
@@ -245,6 +265,8 @@ typedef struct patch_s {
 #ifdef HLRAD_HULLU
     rgb_transfer_data_t *tRGBData;
 #endif
+    byte *tCompact;      // tData quantized to g_transfer_bits, see CompactTransfers
+    vec_t tCompactScale; // largest transfer of the patch
 
     int faceNumber;
     ePatchFlags flags;
@@ -255,17 +277,30 @@ typedef struct patch_s {
     vec3_t directlight[MAXLIGHTMAPS];// direct light only
     int emitstyle;                   //LRC - for switchable texlights
     vec3_t baselight;                // emissivity only, uses emitstyle
-    vec3_t samplelight[MAXLIGHTMAPS];
-    int samples[MAXLIGHTMAPS];// for averaging direct light
 #else
     vec3_t totallight; // accumulated by radiosity does NOT include light accounted for by direct lighting
     vec3_t baselight;  // emissivity only
     vec3_t directlight;// direct light value
+#endif
+} patch_t;
 
+// The parts of a patch only MakePatches and BuildFacelights need, kept apart from
+// patch_t so that the passes over g_patches don't pull them through the cache.
+// g_patch_build[i] belongs to g_patches[i].
+typedef struct {
+    Winding *winding;// Winding (patches are triangles, so its easy)
+    vec_t scale;     // Texture scale for this face (blend of S and T scale)
+    vec_t chop;      // Texture chop for this face factoring in S and T scale
+#ifdef ZHLT_TEXLIGHT
+    vec3_t samplelight[MAXLIGHTMAPS];
+    int samples[MAXLIGHTMAPS];// for averaging direct light
+#else
     vec3_t samplelight;
     int samples;// for averaging direct light
 #endif
-} patch_t;
+} patchbuild_t;
+
+#define PatchBuild(patch) (&g_patch_build[(patch) - g_patches])
 
 #ifdef ZHLT_TEXLIGHT
 //LRC
@@ -301,6 +336,7 @@ typedef struct lerpdist_s {
 // 3072 : roughly 35Mb
 // 4096 : roughly 70Mb
 #define DEFAULT_MAX_LERP_POINTS 512
+#define LERP_NEAREST_POINTS 3// SampleTriangulation only looks at the three points closest to the sample
 #define DEFAULT_MAX_LERP_WALLS 128
 
 typedef struct {
@@ -310,7 +346,9 @@ typedef struct {
     unsigned maxwalls;
     unsigned numwalls;
     patch_t **points; // maxpoints
-    lerpDist_t *dists;// numpoints after points is populated
+    lerpDist_t *dists;// LERP_NEAREST_POINTS, closest first
+    unsigned *kdorder;// numpoints, indices into points as an implicit k-d tree
+    unsigned char *kdaxis;// numpoints, split axis of each k-d tree node
     lerpWall_t *walls;// maxwalls
 
     unsigned facenum;
@@ -349,7 +387,8 @@ extern entity_t *g_face_entity[MAX_MAP_FACES];
 extern vec3_t g_face_offset[MAX_MAP_FACES];// for models with origins
 extern eModelLightmodes g_face_lightmode[MAX_MAP_FACES];
 extern vec3_t g_face_centroids[MAX_MAP_EDGES];
-extern patch_t g_patches[MAX_PATCHES];
+extern patch_t *g_patches;
+extern patchbuild_t *g_patch_build;
 extern unsigned g_num_patches;
 
 extern float g_lightscale;
@@ -362,6 +401,8 @@ extern void MakeShadowSplits();
 //==============================================
 
 extern bool g_extra;
+extern bool g_extra_adaptive;
+extern float g_extra_threshold;
 extern vec3_t g_ambient;
 extern vec_t g_direct_scale;
 extern float g_maxlight;
@@ -375,8 +416,16 @@ extern char g_source[_MAX_PATH];
 extern vec_t g_fade;
 extern int g_falloff;
 extern bool g_incremental;
+extern int g_transfer_bits;
+extern vec_t g_hierarchy_error;
+extern bool g_matrix_file;
+extern bool g_profile;
+extern vec_t g_bounce_converge;
+extern bool g_progressive;
+extern unsigned g_progressive_passes;
 extern bool g_circus;
 extern bool g_sky_lighting_fix;
+extern bool g_skycache;
 extern vec_t g_chop;   // Chop value for normal textures
 extern vec_t g_texchop;// Chop value for texture lights
 extern opaqueList_t *g_opaque_face_list;
@@ -412,11 +461,17 @@ extern bool g_rgb_transfers;
 
 extern void MakeTnodes(dmodel_t *bm);
 extern void PairEdges();
+extern void AllocFacelights();
+extern void FreeFacelights();
 extern void BuildFacelights(int facenum);
+extern bool readfacelights(const char *const facelightfile);
+extern void writefacelights(const char *const facelightfile);
 extern void PrecompLightmapOffsets();
 extern void FinalLightFace(int facenum);
 extern int TestLine(const vec3_t start, const vec3_t stop);
 extern int TestLine_r(int node, const vec3_t start, const vec3_t stop);
+extern void TestLines(const vec3_t *start, const vec3_t *stop, int *result, int count);
+extern void TestLines_r(int node, const vec3_t *start, const vec3_t *stop, int *result, int count);
 extern void CreateDirectLights();
 extern void DeleteDirectLights();
 extern void GetPhongNormal(int facenum, vec3_t spot, vec3_t phongnormal);
@@ -436,24 +491,99 @@ extern const dplane_t *getPlaneFromFace(const dface_t *const face);
 extern const dplane_t *getPlaneFromFaceNumber(unsigned int facenum);
 extern void getAdjustedPlaneFromFaceNumber(unsigned int facenum, dplane_t *plane);
 extern dleaf_t *HuntForWorld(vec_t *point, const vec_t *plane_offset, const dplane_t *plane, int hunt_size, vec_t hunt_scale, vec_t hunt_offset);
+extern void *FaceAlloc(size_t size);
+extern void *FaceRealloc(void *pointer, size_t oldsize, size_t newsize);
+extern void ResetFaceArena();
+extern void FreeFaceArenas();
+
+typedef enum {
+    eProfileTestLines,  // segments traced through the bsp
+    eProfileOpaqueTests,// segments checked against the opaque face list
+    eProfileCounters
+} profilecounter_t;
+
+extern void AddProfileCount(profilecounter_t counter, unsigned amount);
+extern void ProfileBegin(const char *const name);
+extern void ProfileEnd();
+extern void WriteProfile(const char *const filename, double elapsed);
+
+// the tracing code counts every line, so without -profile this has to cost next to nothing
+inline void ProfileCount(const profilecounter_t counter, const unsigned amount) {
+    if (g_profile) {
+        AddProfileCount(counter, amount);
+    }
+}
 
 // makescales.c
 extern void MakeScalesVismatrix();
 extern void MakeScalesSparseVismatrix();
 extern void MakeScalesNoVismatrix();
 
+// hierarchy.c
+extern unsigned g_num_clusters;
+extern void MakeScalesHierarchical();
+extern const vec_t *GetClusterWeights(unsigned cluster, unsigned *firstpatch, unsigned *numpatches);
+extern void FreeClusters();
+
 // transfers.c
 extern unsigned g_total_transfer;
+extern unsigned g_transfer_index_bytes;
+extern unsigned g_transfer_data_bytes;
+extern cache_uint64_t g_vismatrix_bytes;
 extern bool readtransfers(const char *const transferfile, long numpatches);
 extern void writetransfers(const char *const transferfile, long total_patches);
+extern bool freetransfers();
+extern bool transfersfromcache();
+extern cache_uint64_t HashBytes(cache_uint64_t hash, const void *const data, const size_t size);
+extern cache_uint64_t GeometryHash(const unsigned numpatches);
 
 // vismatrixutil.c (shared between vismatrix.c and sparse.c)
 extern void SwapTransfers(int patchnum);
+extern void CreateScalePatches();
+extern void FreeScalePatches();
 extern void MakeScales(int threadnum);
+extern transfer_index_t *CompressTransferIndicies(transfer_raw_index_t *tRaw, const unsigned rawSize, unsigned *iSize);
 extern void DumpTransfersMemoryUsage();
+extern void CompactTransfers();
+extern transfer_data_t *ExpandTransfers(const patch_t *const patch, transfer_data_t *buffer);
+extern transfer_data_t GetTransfer(const patch_t *const patch, const unsigned offset);
+
+// the faces a leaf can see, for one thread of BuildVisLeafs
+typedef struct {
+    unsigned *stamps;// per face, equal to generation once the face is in faces
+    unsigned generation;
+    int *faces;      // world faces in PVS order, then bmodel faces in face order
+    unsigned numfaces;
+} pvsfaces_t;
+
+extern void CreateVisLeafTables();
+extern void FreeVisLeafTables();
+extern int GetPatchLeaf(const unsigned patchnum);
+extern void GetPvsFaces(pvsfaces_t *pvsfaces, const byte *pvs);
+extern void FreePvsFaces(pvsfaces_t *pvsfaces);
 #ifdef HLRAD_HULLU
 extern void SwapRGBTransfers(int patchnum);
 extern void MakeRGBScales(int threadnum);
+
+typedef struct {
+    unsigned x;// x < y
+    unsigned y;
+    vec3_t transparency;
+} transparency_t;
+
+// transparencies found by one thread, not yet added to the table
+typedef struct {
+    transparency_t *list;
+    unsigned count;
+    unsigned max;
+} transparency_build_t;
+
+extern void AddTransparency(transparency_build_t *build, unsigned x, unsigned y, const vec3_t transparency);
+extern void FlushTransparencies(transparency_build_t *build);
+extern void FreeTransparencyBuild(transparency_build_t *build);
+extern void CreateTransparencyTable();
+extern void FreeTransparencyTable();
+extern void FindTransparency(unsigned x, unsigned y, vec3_t &out);
 #endif
 
 // lerp.c
@@ -464,7 +594,6 @@ extern void SampleTriangulation(const lerpTriangulation_t *const trian, vec3_t p
 #endif
 extern void DestroyTriangulation(lerpTriangulation_t *trian);
 extern lerpTriangulation_t *CreateTriangulation(unsigned int facenum);
-extern void FreeTriangulation(lerpTriangulation_t *trian);
 
 // mathutil.c
 #ifdef HLRAD_HULLU
@@ -472,6 +601,8 @@ extern bool TestSegmentAgainstOpaqueList(const vec_t *p1, const vec_t *p2, vec3_
 #else
 extern bool TestSegmentAgainstOpaqueList(const vec_t *p1, const vec_t *p2);
 #endif
+extern void BuildOpaqueFaceTree();
+extern void FreeOpaqueFaceTree();
 extern bool intersect_line_plane(const dplane_t *const plane, const vec_t *const p1, const vec_t *const p2, vec3_t point);
 extern bool intersect_linesegment_plane(const dplane_t *const plane, const vec_t *const p1, const vec_t *const p2, vec3_t point);
 extern void plane_from_points(const vec3_t p1, const vec3_t p2, const vec3_t p3, dplane_t *plane);
@@ -1,4 +1,5 @@
 #include "qrad.h"
+#include "TimeCounter.h"
 
 static dplane_t backplanes[MAX_MAP_PLANES];
 
@@ -179,3 +180,381 @@ dleaf_t *HuntForWorld(vec_t *point, const vec_t *plane_offset, const dplane_t *p
     VectorCopy(best_point, point);
     return best_leaf;
 }
+
+// =====================================================================================
+//
+//      FACE ARENAS
+//      Scratch memory for the face a thread is working on. FaceAlloc carves it out of
+//      one block per thread and ResetFaceArena drops all of it at once, so the per face
+//      passes don't go through malloc for every small array. A block that runs out is
+//      replaced by one twice its size, the old one is kept until the next reset.
+//      FreeFaceArenas hands the blocks back after a threaded pass.
+//
+// =====================================================================================
+
+#define FACEARENA_BLOCK (256 * 1024)
+#define FACEARENA_ALIGN 16
+
+typedef struct facearena_s {
+    struct facearena_s *next;// in s_facearenas
+    byte *block;
+    size_t size;
+    size_t used;
+    byte *retired;// outgrown blocks, linked through their first bytes
+} facearena_t;
+
+static facearena_t *s_facearenas = NULL;
+static unsigned s_facearena_generation = 0;
+static THREADLOCAL facearena_t *s_facearena = NULL;
+static THREADLOCAL unsigned s_facearena_thread_generation = 0;
+
+static size_t AlignFaceArena(const size_t size) {
+    return (size + FACEARENA_ALIGN - 1) & ~(size_t) (FACEARENA_ALIGN - 1);
+}
+
+// =====================================================================================
+//  GetFaceArena
+//      The arena of the calling thread, made on first use. An arena left over from
+//      before the last FreeFaceArenas is gone, the generation catches that.
+// =====================================================================================
+static facearena_t *GetFaceArena() {
+    if (!s_facearena || s_facearena_thread_generation != s_facearena_generation) {
+        s_facearena = (facearena_t *) calloc(1, sizeof(facearena_t));
+        hlassume(s_facearena != NULL, assume_NoMemory);
+
+        ThreadLock();
+        s_facearena->next = s_facearenas;
+        s_facearenas = s_facearena;
+        s_facearena_thread_generation = s_facearena_generation;
+        ThreadUnlock();
+    }
+    return s_facearena;
+}
+
+// =====================================================================================
+//  FaceAlloc
+//      Zeroed, valid until the thread calls ResetFaceArena
+// =====================================================================================
+void *FaceAlloc(const size_t size) {
+    facearena_t *arena = GetFaceArena();
+    const size_t aligned = AlignFaceArena(size);
+    byte *p;
+
+    if (arena->used + aligned > arena->size) {
+        size_t newsize = arena->size ? arena->size * 2 : FACEARENA_BLOCK;
+
+        while (newsize < aligned + FACEARENA_ALIGN) {
+            newsize *= 2;
+        }
+        if (arena->block) {
+            *(byte **) arena->block = arena->retired;
+            arena->retired = arena->block;
+        }
+        arena->block = (byte *) malloc(newsize);
+        hlassume(arena->block != NULL, assume_NoMemory);
+        arena->size = newsize;
+        arena->used = FACEARENA_ALIGN;// room for the retired link
+    }
+
+    p = arena->block + arena->used;
+    arena->used += aligned;
+    memset(p, 0, size);
+    return p;
+}
+
+// =====================================================================================
+//  FaceRealloc
+//      Grows a FaceAlloc'ed array, in place when it was the last thing allocated.
+//      The new part is zeroed.
+// =====================================================================================
+void *FaceRealloc(void *pointer, const size_t oldsize, const size_t newsize) {
+    facearena_t *arena = GetFaceArena();
+    byte *p = (byte *) pointer;
+    byte *grown;
+
+    if (p && p + AlignFaceArena(oldsize) == arena->block + arena->used
+        && (size_t) (p - arena->block) + AlignFaceArena(newsize) <= arena->size) {
+        arena->used = (p - arena->block) + AlignFaceArena(newsize);
+        memset(p + oldsize, 0, newsize - oldsize);
+        return p;
+    }
+
+    grown = (byte *) FaceAlloc(newsize);
+    if (p) {
+        memcpy(grown, p, oldsize);
+    }
+    return grown;
+}
+
+// =====================================================================================
+//  ResetFaceArena
+//      Releases everything the calling thread FaceAlloc'ed
+// =====================================================================================
+void ResetFaceArena() {
+    facearena_t *arena = GetFaceArena();
+
+    while (arena->retired) {
+        byte *next = *(byte **) arena->retired;
+
+        free(arena->retired);
+        arena->retired = next;
+    }
+    arena->used = FACEARENA_ALIGN;
+}
+
+// =====================================================================================
+//  FreeFaceArenas
+//      Only once the threads that used them are done
+// =====================================================================================
+void FreeFaceArenas() {
+    while (s_facearenas) {
+        facearena_t *arena = s_facearenas;
+
+        s_facearenas = arena->next;
+        while (arena->retired) {
+            byte *next = *(byte **) arena->retired;
+
+            free(arena->retired);
+            arena->retired = next;
+        }
+        free(arena->block);
+        free(arena);
+    }
+    s_facearena_generation++;
+}
+
+// =====================================================================================
+//
+//      PROFILING
+//      With -profile, the phases of RadWorld are timed, wall clock and CPU, along with
+//      how long each thread worked in their RunThreadsOn passes and what the counters
+//      added up to. WriteProfile puts it in a JSON file next to the bsp, so runs over
+//      the same maps can be compared. The counters are per thread, linked up like the
+//      face arenas, so counting doesn't take a lock.
+//
+// =====================================================================================
+
+#define MAX_PROFILE_PHASES 32
+
+typedef struct profilecounts_s {
+    struct profilecounts_s *next;// in s_profilecounts
+    cache_uint64_t counts[eProfileCounters];
+} profilecounts_t;
+
+typedef struct {
+    const char *name;
+    TimeCounter time;
+    double threadtime;// spent in RunThreadsOn
+    double *busy;     // per thread, the rest of threadtime it was idle
+    cache_uint64_t counts[eProfileCounters];
+    double peakmemory;// at the end of the phase
+} profilephase_t;
+
+static const char *const s_profilecounter_names[eProfileCounters] = {"testlines", "opaquetests"};
+
+static profilecounts_t *s_profilecounts = NULL;
+static THREADLOCAL profilecounts_t *s_profilecount = NULL;
+static profilephase_t s_profilephases[MAX_PROFILE_PHASES];
+static int s_numprofilephases = 0;
+static profilephase_t *s_profilephase = NULL;// being timed
+
+// =====================================================================================
+//  AddProfileCount
+// =====================================================================================
+void AddProfileCount(const profilecounter_t counter, const unsigned amount) {
+    if (!s_profilecount) {
+        s_profilecount = (profilecounts_t *) calloc(1, sizeof(profilecounts_t));
+        hlassume(s_profilecount != NULL, assume_NoMemory);
+
+        ThreadLock();
+        s_profilecount->next = s_profilecounts;
+        s_profilecounts = s_profilecount;
+        ThreadUnlock();
+    }
+    s_profilecount->counts[counter] += amount;
+}
+
+// =====================================================================================
+//  SumProfileCounts
+//      Only between threaded passes
+// =====================================================================================
+static void SumProfileCounts(cache_uint64_t *counts) {
+    const profilecounts_t *c;
+    int i;
+
+    memset(counts, 0, eProfileCounters * sizeof(cache_uint64_t));
+    for (c = s_profilecounts; c; c = c->next) {
+        for (i = 0; i < eProfileCounters; i++) {
+            counts[i] += c->counts[i];
+        }
+    }
+}
+
+// =====================================================================================
+//  ProfileBegin
+//      The phase keeps the totals it starts from, ProfileEnd turns them into its share
+// =====================================================================================
+void ProfileBegin(const char *const name) {
+    profilephase_t *phase;
+    int i;
+
+    if (!g_profile) {
+        return;
+    }
+    hlassert(!s_profilephase);
+    if (s_numprofilephases == MAX_PROFILE_PHASES) {
+        Warning("More than %d profiled phases, not timing %s", MAX_PROFILE_PHASES, name);
+        return;
+    }
+
+    phase = &s_profilephases[s_numprofilephases++];
+    phase->name = name;
+    phase->busy = (double *) calloc(g_numthreads, sizeof(double));
+    hlassume(phase->busy != NULL, assume_NoMemory);
+
+    phase->threadtime = ThreadRunTime();
+    for (i = 0; i < g_numthreads; i++) {
+        phase->busy[i] = ThreadBusyTime(i);
+    }
+    SumProfileCounts(phase->counts);
+
+    s_profilephase = phase;
+    phase->time.start();
+}
+
+// =====================================================================================
+//  ProfileEnd
+// =====================================================================================
+void ProfileEnd() {
+    profilephase_t *phase = s_profilephase;
+    cache_uint64_t counts[eProfileCounters];
+    int i;
+
+    if (!phase) {
+        return;
+    }
+    phase->time.stop();
+
+    phase->threadtime = ThreadRunTime() - phase->threadtime;
+    for (i = 0; i < g_numthreads; i++) {
+        phase->busy[i] = ThreadBusyTime(i) - phase->busy[i];
+    }
+    SumProfileCounts(counts);
+    for (i = 0; i < eProfileCounters; i++) {
+        phase->counts[i] = counts[i] - phase->counts[i];
+    }
+    phase->peakmemory = I_PeakMemory();
+
+    s_profilephase = NULL;
+}
+
+// =====================================================================================
+//  FreeProfile
+//      Once it's written, the threads are long done with their counters by then
+// =====================================================================================
+static void FreeProfile() {
+    int i;
+
+    for (i = 0; i < s_numprofilephases; i++) {
+        free(s_profilephases[i].busy);
+        s_profilephases[i].busy = NULL;
+    }
+    s_numprofilephases = 0;
+
+    while (s_profilecounts) {
+        profilecounts_t *c = s_profilecounts;
+
+        s_profilecounts = c->next;
+        free(c);
+    }
+    s_profilecount = NULL;
+}
+
+// =====================================================================================
+//  WriteProfile
+// =====================================================================================
+static void WriteJsonString(FILE *file, const char *string) {
+    fputc('"', file);
+    for (; *string; string++) {
+        if (*string == '"' || *string == '\\') {
+            fputc('\\', file);
+            fputc(*string, file);
+        } else if ((unsigned char) *string < ' ') {
+            fprintf(file, "\\u%04x", (unsigned char) *string);
+        } else {
+            fputc(*string, file);
+        }
+    }
+    fputc('"', file);
+}
+
+static void WriteJsonCounts(FILE *file, const cache_uint64_t *counts) {
+    int i;
+
+    fprintf(file, "{");
+    for (i = 0; i < eProfileCounters; i++) {
+        fprintf(file, "%s\"%s\": %.0f", i ? ", " : "", s_profilecounter_names[i], (double) counts[i]);
+    }
+    fprintf(file, "}");
+}
+
+void WriteProfile(const char *const filename, const double elapsed) {
+    cache_uint64_t counts[eProfileCounters];
+    FILE *file;
+    int i, j;
+
+    if (!g_profile) {
+        return;
+    }
+    file = fopen(filename, "w");
+    if (!file) {
+        Warning("Could not write the profile to %s", filename);
+        FreeProfile();
+        return;
+    }
+
+    SumProfileCounts(counts);
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"map\": ");
+    WriteJsonString(file, g_source);
+    fprintf(file, ",\n");
+    fprintf(file, "  \"threads\": %d,\n", g_numthreads);
+    fprintf(file, "  \"wall\": %.3f,\n", elapsed);
+    fprintf(file, "  \"cpu\": %.3f,\n", I_CpuTime());
+    fprintf(file, "  \"peak_memory\": %.0f,\n", I_PeakMemory());
+    fprintf(file, "  \"vismatrix_bytes\": %.0f,\n", (double) g_vismatrix_bytes);
+    fprintf(file, "  \"transfers\": %u,\n", g_total_transfer);
+    fprintf(file, "  \"transfer_bytes\": %.0f,\n", (double) g_transfer_index_bytes + g_transfer_data_bytes);
+    fprintf(file, "  \"counters\": ");
+    WriteJsonCounts(file, counts);
+    fprintf(file, ",\n");
+
+    fprintf(file, "  \"phases\": [\n");
+    for (i = 0; i < s_numprofilephases; i++) {
+        const profilephase_t *phase = &s_profilephases[i];
+
+        fprintf(file, "    {\"name\": ");
+        WriteJsonString(file, phase->name);
+        fprintf(file, ", \"wall\": %.3f, \"cpu\": %.3f, \"threaded\": %.3f, \"peak_memory\": %.0f,\n",
+                phase->time.getTotal(), phase->time.getCpuTotal(), phase->threadtime, phase->peakmemory);
+
+        fprintf(file, "     \"busy\": [");
+        for (j = 0; j < g_numthreads; j++) {
+            fprintf(file, "%s%.3f", j ? ", " : "", phase->busy[j]);
+        }
+        fprintf(file, "],\n     \"idle\": [");
+        for (j = 0; j < g_numthreads; j++) {
+            fprintf(file, "%s%.3f", j ? ", " : "", phase->threadtime - phase->busy[j]);
+        }
+        fprintf(file, "],\n     \"counters\": ");
+        WriteJsonCounts(file, phase->counts);
+        fprintf(file, "}%s\n", i + 1 < s_numprofilephases ? "," : "");
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+
+    fclose(file);
+    Log("Wrote the profile to %s\n", filename);
+    FreeProfile();
+}
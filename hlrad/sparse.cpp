@@ -1,163 +1,188 @@
 #include "qrad.h"
 
-// Transparency array
+// Each column holds the visible patches y > x of patch x, split into chunks of
+// SPARSE_CHUNK_PATCHES patches. Only the chunks that see anything get a container:
+// either a short sorted list of (byte in chunk, bits) entries, or, once that list
+// would be as large as it, the plain bitmap of the chunk. A column is a single
+// block: the chunk occupancy bits, then the start of each container, then the
+// containers, so a lookup is a popcount and at most one cache line of entries.
+#define SPARSE_CHUNK_SHIFT 9
+#define SPARSE_CHUNK_PATCHES (1 << SPARSE_CHUNK_SHIFT)
+#define SPARSE_CHUNK_WORDS (SPARSE_CHUNK_PATCHES / 16)// a dense container, in entries
+
+typedef unsigned short sparse_entry_t;// byte in chunk << 8 | bits, or 16 bits of a dense chunk
+typedef unsigned sparse_start_t;      // of a container, in entries, a column can hold more than 65535
 
-#ifdef HLRAD_HULLU
+typedef struct {
+    unsigned *occupied;      // one bit per chunk, followed by the container starts and entries
+    unsigned short numwords; // occupancy words, up to the last used chunk
+    unsigned short numchunks;// used chunks
+} sparse_column_t;
 
+// the row of one patch while it is being built, private to its thread
 typedef struct {
-    unsigned x;
-    unsigned y;
-    vec3_t transparency;
-} transparency_t;
-static transparency_t *s_transparency_list = NULL;
-static unsigned long s_transparency_count = 0;
-static unsigned long s_max_transparency_count = 0;
-
-static void FindOpacity(const unsigned p1, const unsigned p2, vec3_t &out) {
-    for (unsigned long i = 0; i < s_transparency_count; i++) {
-        if (s_transparency_list[i].x == p1 && s_transparency_list[i].y == p2) {
-            VectorCopy(s_transparency_list[i].transparency, out);
-            return;
-        }
-    }
-    VectorFill(out, 1.0);
-}
+    unsigned *visible;
+    unsigned count;
+    unsigned max;
+#ifdef HLRAD_HULLU
+    transparency_build_t shadows;
+#endif
+} sparse_build_t;
 
-#endif /*HLRAD_HULLU*/
+static sparse_column_t *s_vismatrix;
 
-typedef struct {
-    unsigned offset : 24;
-    unsigned values : 8;
-} sparse_row_t;
+static inline unsigned CountBits(unsigned v) {
+    v = v - ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
 
-typedef struct {
-    sparse_row_t *row;
-    int count;
-} sparse_column_t;
+static inline sparse_start_t *ColumnStarts(const sparse_column_t *column) {
+    return (sparse_start_t *) (column->occupied + column->numwords);
+}
 
-sparse_column_t *s_vismatrix;
+static inline sparse_entry_t *ColumnEntries(const sparse_column_t *column) {
+    return (sparse_entry_t *) (ColumnStarts(column) + column->numchunks + 1);
+}
 
-// Vismatrix protected
-static unsigned IsVisbitInArray(const unsigned x, const unsigned y) {
-    int first, last, current;
-    int y_byte = y / 8;
-    sparse_row_t *row;
-    sparse_column_t *column = s_vismatrix + x;
+static unsigned ColumnSize(const sparse_column_t *column) {
+    return column->numwords * sizeof(unsigned) + (column->numchunks + 1) * sizeof(sparse_start_t)
+         + ColumnStarts(column)[column->numchunks] * sizeof(sparse_entry_t);
+}
 
-    if (!column->count) {
-        return -1;
+// =====================================================================================
+//  AddVisBit
+//      Notes that patch y is visible from the patch whose row is being built
+// =====================================================================================
+static void AddVisBit(sparse_build_t *build, const unsigned y) {
+    if (build->count == build->max) {
+        build->max = build->max ? build->max * 2 : 1024;
+        build->visible = (unsigned *) realloc(build->visible, build->max * sizeof(unsigned));
+        hlassume(build->visible != NULL, assume_NoMemory);
     }
+    build->visible[build->count++] = y;
+}
 
-    first = 0;
-    last = column->count - 1;
+static int CDECL visible_sorter(const void *p1, const void *p2) {
+    const unsigned a = *(const unsigned *) p1;
+    const unsigned b = *(const unsigned *) p2;
 
-    //    Warning("Searching . . .");
-    // binary search to find visbit
-    while (1) {
-        current = (first + last) / 2;
-        row = column->row + current;
-        //        Warning("first %u, last %u, current %u, row %p, row->offset %u", first, last, current, row, row->offset);
-        if ((row->offset) < y_byte) {
-            first = current + 1;
-        } else if ((row->offset) > y_byte) {
-            last = current - 1;
-        } else {
-            return current;
-        }
-        if (first > last) {
-            return -1;
-        }
-    }
+    return (a > b) - (a < b);
 }
 
-// Vismatrix protected
-static void InsertVisbitIntoArray(const unsigned x, const unsigned y) {
-    unsigned count;
-    unsigned y_byte = y / 8;
+// =====================================================================================
+//  PublishVisRow
+//      Packs the row built for patch x into its column. Only the thread that
+//      built the row touches the column, so no locking is needed.
+// =====================================================================================
+static void PublishVisRow(const unsigned x, sparse_build_t *build) {
     sparse_column_t *column = s_vismatrix + x;
-    sparse_row_t *row = column->row;
-
-    if (!column->count) {
-        column->count++;
-        row = column->row = (sparse_row_t *) malloc(sizeof(sparse_row_t));
-        row->offset = y_byte;
-        row->values = 1 << (y & 7);
+    unsigned *visible = build->visible;
+    const unsigned count = build->count;
+    unsigned numchunks, numentries, lastchunk;
+    unsigned i, j, chunk;
+    sparse_start_t *starts;
+    sparse_entry_t *entries;
+    sparse_entry_t *entry;
+
+    build->count = 0;
+    if (!count) {
         return;
     }
+    qsort(visible, count, sizeof(unsigned), visible_sorter);
 
-    // Insertion
-    count = 0;
-    while (count < column->count) {
-        if (row->offset > y_byte) {
-            unsigned newsize = (column->count + 1) * sizeof(sparse_row_t);
-            sparse_row_t *newrow = (sparse_row_t *) malloc(newsize);
+    // size the containers
+    numchunks = numentries = 0;
+    for (i = 0; i < count; i = j) {
+        unsigned bytes = 0;
 
-            memcpy(newrow, column->row, count * sizeof(sparse_row_t));
-            memcpy(newrow + count + 1, column->row + count, (column->count - count) * sizeof(sparse_row_t));
-
-            row = newrow + count;
-            row->offset = y_byte;
-            row->values = 1 << (y & 7);
-
-            free(column->row);
-            column->row = newrow;
-            column->count++;
-            return;
+        chunk = visible[i] >> SPARSE_CHUNK_SHIFT;
+        for (j = i; j < count && (visible[j] >> SPARSE_CHUNK_SHIFT) == chunk; j++) {
+            if (j == i || (visible[j] >> 3) != (visible[j - 1] >> 3)) {
+                bytes++;
+            }
         }
-
-        row++;
-        count++;
+        numchunks++;
+        numentries += bytes < SPARSE_CHUNK_WORDS ? bytes : SPARSE_CHUNK_WORDS;
     }
+    lastchunk = visible[count - 1] >> SPARSE_CHUNK_SHIFT;
+
+    column->numwords = lastchunk / 32 + 1;
+    column->numchunks = numchunks;
+    column->occupied = (unsigned *) calloc(1, column->numwords * sizeof(unsigned) + (numchunks + 1) * sizeof(sparse_start_t) + numentries * sizeof(sparse_entry_t));
+    hlassume(column->occupied != NULL, assume_NoMemory);
+
+    // fill them
+    starts = ColumnStarts(column);
+    entries = entry = ColumnEntries(column);
+    numchunks = 0;
+    for (i = 0; i < count; i = j) {
+        unsigned bytes = 0;
+        sparse_entry_t *first = entry;
+
+        chunk = visible[i] >> SPARSE_CHUNK_SHIFT;
+        for (j = i; j < count && (visible[j] >> SPARSE_CHUNK_SHIFT) == chunk; j++) {
+            if (j == i || (visible[j] >> 3) != (visible[j - 1] >> 3)) {
+                bytes++;
+            }
+        }
 
-    // Append
-    {
-        unsigned newsize = (count + 1) * sizeof(sparse_row_t);
-        sparse_row_t *newrow = (sparse_row_t *) malloc(newsize);
-
-        memcpy(newrow, column->row, column->count * sizeof(sparse_row_t));
-
-        row = newrow + column->count;
-        row->offset = y_byte;
-        row->values = 1 << (y & 7);
-
-        free(column->row);
-        column->row = newrow;
-        column->count++;
-        return;
+        column->occupied[chunk / 32] |= 1u << (chunk & 31);
+        starts[numchunks++] = first - entries;
+        if (bytes >= SPARSE_CHUNK_WORDS) {
+            for (; i < j; i++) {
+                const unsigned b = visible[i] & (SPARSE_CHUNK_PATCHES - 1);
+                first[b >> 4] |= 1 << (b & 15);
+            }
+            entry += SPARSE_CHUNK_WORDS;
+        } else {
+            for (; i < j; i++) {
+                const unsigned b = visible[i] & (SPARSE_CHUNK_PATCHES - 1);
+                if (entry != first && (entry[-1] >> 8) == (b >> 3)) {
+                    entry[-1] |= 1 << (b & 7);
+                } else {
+                    *entry++ = ((b >> 3) << 8) | (1 << (b & 7));
+                }
+            }
+        }
     }
+    starts[numchunks] = entry - entries;
 }
 
-// Vismatrix public
-static void SetVisBit(unsigned x, unsigned y) {
-    unsigned offset;
-
-    if (x == y) {
-        return;
+// =====================================================================================
+//  IsVisbitInColumn
+// =====================================================================================
+static bool IsVisbitInColumn(const sparse_column_t *column, const unsigned y) {
+    const unsigned chunk = y >> SPARSE_CHUNK_SHIFT;
+    const unsigned word = chunk / 32;
+    const unsigned bit = 1u << (chunk & 31);
+    const unsigned b = y & (SPARSE_CHUNK_PATCHES - 1);
+    const sparse_start_t *starts;
+    const sparse_entry_t *entry;
+    const sparse_entry_t *end;
+    unsigned rank, w;
+
+    if (word >= column->numwords || !(column->occupied[word] & bit)) {
+        return false;
     }
 
-    if (x > y) {
-        const unsigned a = x;
-        const unsigned b = y;
-        x = b;
-        y = a;
+    rank = CountBits(column->occupied[word] & (bit - 1));
+    for (w = 0; w < word; w++) {
+        rank += CountBits(column->occupied[w]);
     }
 
-    if (x > g_num_patches) {
-        Warning("in SetVisBit(), x > num_patches");
-    }
-    if (y > g_num_patches) {
-        Warning("in SetVisBit(), y > num_patches");
+    starts = ColumnStarts(column);
+    entry = ColumnEntries(column) + starts[rank];
+    end = ColumnEntries(column) + starts[rank + 1];
+    if (end - entry == SPARSE_CHUNK_WORDS) {
+        return (entry[b >> 4] & (1 << (b & 15))) != 0;
     }
-
-    ThreadLock();
-
-    if ((offset = IsVisbitInArray(x, y)) != -1) {
-        s_vismatrix[x].row[offset].values |= 1 << (y & 7);
-    } else {
-        InsertVisbitIntoArray(x, y);
+    for (; entry < end && (*entry >> 8) <= (b >> 3); entry++) {
+        if ((*entry >> 8) == (b >> 3)) {
+            return (*entry & (1 << (b & 7))) != 0;
+        }
     }
-
-    ThreadUnlock();
+    return false;
 }
 
 // Vismatrix public
@@ -167,8 +192,6 @@ static bool CheckVisBitSparse(unsigned x, unsigned y, vec3_t &transparency_out)
 static bool CheckVisBitSparse(unsigned x, unsigned y)
 #endif
 {
-    unsigned offset;
-
     if (x == y) {
 #ifdef HLRAD_HULLU
         VectorFill(transparency_out, 1.0);
@@ -190,22 +213,22 @@ static bool CheckVisBitSparse(unsigned x, unsigned y)
         Warning("in CheckVisBit(), y > num_patches");
     }
 
-    if ((offset = IsVisbitInArray(x, y)) != -1) {
+    if (IsVisbitInColumn(s_vismatrix + x, y)) {
 #ifdef HLRAD_HULLU
         if (g_customshadow_with_bouncelight) {
             vec3_t tmp = {1.0, 1.0, 1.0};
-            FindOpacity(x, y, tmp);
+            FindTransparency(x, y, tmp);
             VectorCopy(tmp, transparency_out);
         } else {
             VectorFill(transparency_out, 1.0);
         }
 #endif
-        return s_vismatrix[x].row[offset].values & (1 << (y & 7));
+        return true;
     }
 #ifdef HLRAD_HULLU
     VectorFill(transparency_out, 1.0);
 #endif
-    return 0;
+    return false;
 }
 
 /*
@@ -215,7 +238,7 @@ static bool CheckVisBitSparse(unsigned x, unsigned y)
  * Sets vis bits for all patches in the face
  * ==============
  */
-static void TestPatchToFace(const unsigned patchnum, const int facenum, const int head) {
+static void TestPatchToFace(const unsigned patchnum, const int facenum, const int head, sparse_build_t *build) {
     patch_t *patch = &g_patches[patchnum];
     patch_t *patch2 = g_face_patches[facenum];
 
@@ -228,49 +251,52 @@ static void TestPatchToFace(const unsigned patchnum, const int facenum, const in
             // we need to do a real test
             const dplane_t *plane = getPlaneFromFaceNumber(patch->faceNumber);
 
-            for (; patch2; patch2 = patch2->next) {
-                unsigned m = patch2 - g_patches;
+            patch_t *batch[TESTPATCH_BATCH_SIZE];
+            vec3_t starts[TESTPATCH_BATCH_SIZE];
+            vec3_t stops[TESTPATCH_BATCH_SIZE];
+            int contents[TESTPATCH_BATCH_SIZE];
+            int count, i;
+
+            while (patch2) {
+                // collect the patches that pass the plane tests, then trace them as one packet
+                //  if bit has not already been set
+                //  && v2 is not behind light plane
+                for (count = 0; patch2 && count < TESTPATCH_BATCH_SIZE; patch2 = patch2->next) {
+                    if ((unsigned) (patch2 - g_patches) > patchnum && (DotProduct(patch2->origin, plane->normal) > (PatchPlaneDist(patch) + MINIMUM_PATCH_DISTANCE))) {
+                        batch[count] = patch2;
+                        VectorCopy(patch->origin, starts[count]);
+                        VectorCopy(patch2->origin, stops[count]);
+                        count++;
+                    }
+                }
+                TestLines_r(head, starts, stops, contents, count);
+
+                for (i = 0; i < count; i++) {
+                    patch_t *visible = batch[i];
+                    unsigned m = visible - g_patches;
 
 #ifdef HLRAD_HULLU
-                vec3_t transparency = {1.0, 1.0, 1.0};
+                    vec3_t transparency = {1.0, 1.0, 1.0};
 #endif
 
-                // check vis between patch and patch2
-                // if bit has not already been set
-                //  && v2 is not behind light plane
-                //  && v2 is visible from v1
-                if (m > patchnum && (DotProduct(patch2->origin, plane->normal) > (PatchPlaneDist(patch) + MINIMUM_PATCH_DISTANCE)) && (TestLine_r(head, patch->origin, patch2->origin) == CONTENTS_EMPTY)
+                    //  && v2 is visible from v1
+                    if (contents[i] != CONTENTS_EMPTY
 #ifdef HLRAD_HULLU
-                    && (!TestSegmentAgainstOpaqueList(patch->origin, patch2->origin, transparency)))
+                        || TestSegmentAgainstOpaqueList(patch->origin, visible->origin, transparency))
 #else
-                    && (!TestSegmentAgainstOpaqueList(patch->origin, patch2->origin)))
+                        || TestSegmentAgainstOpaqueList(patch->origin, visible->origin))
 #endif
-                {
+                    {
+                        continue;
+                    }
 
 #ifdef HLRAD_HULLU
                     // transparency face fix table
                     if (g_customshadow_with_bouncelight && fabs(VectorAvg(transparency) - 1.0) < 0.001) {
-                        while (s_transparency_count >= s_max_transparency_count) {
-                            //new size
-                            unsigned long oldsize = s_max_transparency_count;
-                            s_max_transparency_count += 128;
-
-                            //realloc
-                            s_transparency_list = (transparency_t *) realloc(s_transparency_list, s_max_transparency_count * sizeof(transparency_t));
-
-                            // clean new memory
-                            memset(&s_transparency_list[oldsize], 0, sizeof(transparency_t) * 128);
-                        }
-
-                        //add to array
-                        VectorCopy(transparency, s_transparency_list[s_transparency_count].transparency);
-                        s_transparency_list[s_transparency_count].y = m;
-                        s_transparency_list[s_transparency_count].x = patchnum;
-
-                        s_transparency_count++;
+                        AddTransparency(&build->shadows, patchnum, m, transparency);
                     }
 #endif
-                    SetVisBit(m, patchnum);
+                    AddVisBit(build, m);
                 }
             }
         }
@@ -281,32 +307,14 @@ static void TestPatchToFace(const unsigned patchnum, const int facenum, const in
  * ==============
  * BuildVisRow
  * 
- * Calc vis bits from a single patch
+ * Calc vis bits from a single patch to the world and bmodel faces in its PVS
  * ==============
  */
-static void BuildVisRow(const int patchnum, byte *pvs, const int head) {
-    int j, k, l;
-    byte face_tested[MAX_MAP_FACES];
-    dleaf_t *leaf;
-
-    memset(face_tested, 0, g_numfaces);
-
-    // leaf 0 is the solid leaf (skipped)
-    for (j = 1, leaf = g_dleafs + 1; j < g_numleafs; j++, leaf++) {
-        if (!(pvs[(j - 1) >> 3] & (1 << ((j - 1) & 7)))) {
-            continue;// not in pvs
-        }
-        for (k = 0; k < leaf->nummarksurfaces; k++) {
-            l = g_dmarksurfaces[leaf->firstmarksurface + k];
+static void BuildVisRow(const int patchnum, const pvsfaces_t *pvsfaces, const int head, sparse_build_t *build) {
+    unsigned j;
 
-            // faces can be marksurfed by multiple leaves, but
-            // don't bother testing again
-            if (face_tested[l])
-                continue;
-            face_tested[l] = 1;
-
-            TestPatchToFace(patchnum, l, head);
-        }
+    for (j = 0; j < pvsfaces->numfaces; j++) {
+        TestPatchToFace(patchnum, pvsfaces->faces[j], head, build);
     }
 }
 
@@ -323,13 +331,17 @@ static void BuildVisRow(const int patchnum, byte *pvs, const int head) {
 #endif
 static void BuildVisLeafs(int threadnum) {
     int i;
-    int lface, facenum, facenum2;
+    int lface, facenum;
     byte pvs[(MAX_MAP_LEAFS + 7) / 8];
     dleaf_t *srcleaf;
-    dleaf_t *leaf;
     patch_t *patch;
     int head;
     unsigned patchnum;
+    sparse_build_t build;
+    pvsfaces_t pvsfaces;
+
+    memset(&build, 0, sizeof(build));
+    memset(&pvsfaces, 0, sizeof(pvsfaces));
 
     while (1) {
         //
@@ -343,6 +355,7 @@ static void BuildVisLeafs(int threadnum) {
         i++;// skip leaf 0
         srcleaf = &g_dleafs[i];
         DecompressVis(&g_dvisdata[srcleaf->visofs], pvs, sizeof(pvs));
+        GetPvsFaces(&pvsfaces, pvs);
         head = 0;
 
         //
@@ -353,25 +366,27 @@ static void BuildVisLeafs(int threadnum) {
         for (lface = 0; lface < srcleaf->nummarksurfaces; lface++) {
             facenum = g_dmarksurfaces[srcleaf->firstmarksurface + lface];
             for (patch = g_face_patches[facenum]; patch; patch = patch->next) {
-                leaf = PointInLeaf(patch->origin);
-                if (leaf != srcleaf) {
+                patchnum = patch - g_patches;
+                if (GetPatchLeaf(patchnum) != i) {
                     continue;
                 }
 
-                patchnum = patch - g_patches;
-                // build to all other world leafs
-                BuildVisRow(patchnum, pvs, head);
+                // build to all other world leafs and the bmodel faces
+                BuildVisRow(patchnum, &pvsfaces, head, &build);
 
-                // build to bmodel faces
-                if (g_nummodels < 2) {
-                    continue;
-                }
-                for (facenum2 = g_dmodels[1].firstface; facenum2 < g_numfaces; facenum2++) {
-                    TestPatchToFace(patchnum, facenum2, head);
-                }
+                PublishVisRow(patchnum, &build);
+#ifdef HLRAD_HULLU
+                FlushTransparencies(&build.shadows);
+#endif
             }
         }
     }
+
+    free(build.visible);
+    FreePvsFaces(&pvsfaces);
+#ifdef HLRAD_HULLU
+    FreeTransparencyBuild(&build.shadows);
+#endif
 }
 
 #ifdef SYSTEM_WIN32
@@ -391,7 +406,9 @@ static void BuildVisMatrix() {
         hlassume(s_vismatrix != NULL, assume_NoMemory);
     }
 
+    CreateVisLeafTables();
     NamedRunThreadsOn(g_numleafs - 1, g_estimate, BuildVisLeafs);
+    FreeVisLeafTables();
 }
 
 static void FreeVisMatrix() {
@@ -400,8 +417,8 @@ static void FreeVisMatrix() {
         sparse_column_t *item;
 
         for (x = 0, item = s_vismatrix; x < g_num_patches; x++, item++) {
-            if (item->row) {
-                free(item->row);
+            if (item->occupied) {
+                free(item->occupied);
             }
         }
         if (FreeBlock(s_vismatrix)) {
@@ -412,11 +429,7 @@ static void FreeVisMatrix() {
     }
 
 #ifdef HLRAD_HULLU
-    if (s_transparency_list) {
-        free(s_transparency_list);
-        s_transparency_list = NULL;
-    }
-    s_transparency_count = s_max_transparency_count = 0;
+    FreeTransparencyTable();
 #endif
 }
 
@@ -430,11 +443,14 @@ static void DumpVismatrixInfo() {
     memset(totals, 0, sizeof(totals));
 
     while (column < column_end) {
-        total_vismatrix_memory += column->count * sizeof(sparse_row_t);
+        if (column->occupied) {
+            total_vismatrix_memory += ColumnSize(column);
+        }
         column++;
     }
 
     Log("%-20s: %5.1f megs\n", "visibility matrix", total_vismatrix_memory / (1024 * 1024.0));
+    g_vismatrix_bytes = total_vismatrix_memory;
 }
 
 //
@@ -457,10 +473,7 @@ void MakeScalesSparseVismatrix() {
         g_CheckVisBit = CheckVisBitSparse;
 
 #ifdef HLRAD_HULLU
-        if ((s_max_transparency_count * sizeof(transparency_t)) >= (1024 * 1024))
-            Log("%-20s: %5.1f megs\n", "custom shadow array", (s_max_transparency_count * sizeof(transparency_t)) / (1024 * 1024.0));
-        else if (s_transparency_count)
-            Log("%-20s: %5.1f kilos\n", "custom shadow array", (s_max_transparency_count * sizeof(transparency_t)) / 1024.0);
+        CreateTransparencyTable();
 #endif
 
 #ifndef HLRAD_HULLU
@@ -489,7 +502,5 @@ void MakeScalesSparseVismatrix() {
         } else {
             unlink(transferfile);
         }
-        // release visibility matrix
-        DumpTransfersMemoryUsage();
     }
 }
@@ -1,6 +1,4 @@
-#include "bspfile.h"
-#include "cmdlib.h"
-#include "mathlib.h"
+#include "qrad.h"
 
 // #define      ON_EPSILON      0.001
 
@@ -52,6 +50,7 @@ static void MakeTnode(const int nodenum) {
  * MakeTnodes
  * 
  * Loads the node structure out of a .bsp file to be used for light occlusion
+ * Nodes are stored depth first, so a node's front child directly follows it
  * =============
  */
 void MakeTnodes(dmodel_t * /*bm*/) {
@@ -70,62 +69,317 @@ void MakeTnodes(dmodel_t * /*bm*/) {
 
 //==========================================================
 
+// Lines are traced iteratively: when a segment straddles a node the far half is pushed
+// and the near half followed, so the first non-empty leaf found is the first along the
+// line, exactly as the old recursive walk did.  Trees deeper than the stack (none seen
+// in practice) fall back to recursing on the near half.
+#define TESTLINE_STACK_SIZE 64
+
+typedef struct {
+    int node;
+    vec3_t start;
+    vec3_t stop;
+} tracestack_t;
+
+#define TNODE_DIST(tnode, p) \
+    ((tnode)->type < plane_anyx ? (p)[(tnode)->type] - (tnode)->dist : ((p)[0] * (tnode)->normal[0] + (p)[1] * (tnode)->normal[1] + (p)[2] * (tnode)->normal[2]) - (tnode)->dist)
+
 int TestLine_r(const int node, const vec3_t start, const vec3_t stop) {
-    tnode_t *tnode;
+    tracestack_t stack[TESTLINE_STACK_SIZE];
+    int depth;
+    const tnode_t *tnode;
     float front, back;
-    vec3_t mid;
+    vec_t p1[3], p2[3], mid[3];
     float frac;
-    int side;
+    int n, side;
     int r;
 
-    if ((node == CONTENTS_SOLID) || (node == CONTENTS_SKY)
-        /*|| (node == CONTENTS_NULL ) */
-    )
-        return node;
-
-    if (node < 0)
-        return CONTENTS_EMPTY;
-
-    tnode = &tnodes[node];
-    switch (tnode->type) {
-        case plane_x:
-            front = start[0] - tnode->dist;
-            back = stop[0] - tnode->dist;
-            break;
-        case plane_y:
-            front = start[1] - tnode->dist;
-            back = stop[1] - tnode->dist;
-            break;
-        case plane_z:
-            front = start[2] - tnode->dist;
-            back = stop[2] - tnode->dist;
-            break;
-        default:
-            front = (start[0] * tnode->normal[0] + start[1] * tnode->normal[1] + start[2] * tnode->normal[2]) - tnode->dist;
-            back = (stop[0] * tnode->normal[0] + stop[1] * tnode->normal[1] + stop[2] * tnode->normal[2]) - tnode->dist;
-            break;
-    }
+    depth = 0;
+    n = node;
+    VectorCopy(start, p1);
+    VectorCopy(stop, p2);
 
-    if (front >= -ON_EPSILON && back >= -ON_EPSILON)
-        return TestLine_r(tnode->children[0], start, stop);
+    for (;;) {
+        if (n < 0) {
+            if ((n == CONTENTS_SOLID) || (n == CONTENTS_SKY)
+                /*|| (n == CONTENTS_NULL ) */
+            )
+                return n;
 
-    if (front < ON_EPSILON && back < ON_EPSILON)
-        return TestLine_r(tnode->children[1], start, stop);
+            // empty leaf, carry on with the far side of the last split
+            if (!depth)
+                return CONTENTS_EMPTY;
+            depth--;
+            n = stack[depth].node;
+            VectorCopy(stack[depth].start, p1);
+            VectorCopy(stack[depth].stop, p2);
+            continue;
+        }
+
+        tnode = &tnodes[n];
+        front = TNODE_DIST(tnode, p1);
+        back = TNODE_DIST(tnode, p2);
+
+        if (front >= -ON_EPSILON && back >= -ON_EPSILON) {
+            n = tnode->children[0];
+            continue;
+        }
+        if (front < ON_EPSILON && back < ON_EPSILON) {
+            n = tnode->children[1];
+            continue;
+        }
 
-    side = front < 0;
+        side = front < 0;
 
-    frac = front / (front - back);
+        frac = front / (front - back);
 
-    mid[0] = start[0] + (stop[0] - start[0]) * frac;
-    mid[1] = start[1] + (stop[1] - start[1]) * frac;
-    mid[2] = start[2] + (stop[2] - start[2]) * frac;
+        mid[0] = p1[0] + (p2[0] - p1[0]) * frac;
+        mid[1] = p1[1] + (p2[1] - p1[1]) * frac;
+        mid[2] = p1[2] + (p2[2] - p1[2]) * frac;
 
-    r = TestLine_r(tnode->children[side], start, mid);
-    if (r != CONTENTS_EMPTY)
-        return r;
-    return TestLine_r(tnode->children[!side], mid, stop);
+        if (depth < TESTLINE_STACK_SIZE) {
+            stack[depth].node = tnode->children[!side];
+            VectorCopy(mid, stack[depth].start);
+            VectorCopy(p2, stack[depth].stop);
+            depth++;
+        } else {
+            r = TestLine_r(tnode->children[side], p1, mid);
+            if (r != CONTENTS_EMPTY)
+                return r;
+            n = tnode->children[!side];
+            VectorCopy(mid, p1);
+            continue;
+        }
+
+        n = tnode->children[side];
+        VectorCopy(mid, p2);
+    }
 }
 
 int TestLine(const vec3_t start, const vec3_t stop) {
+    ProfileCount(eProfileTestLines, 1);
     return TestLine_r(0, start, stop);
 }
+
+//==========================================================
+
+// Packets of lines walk the tree together, each line keeping its own segment. Lines that
+// cross a node plane are split there like in TestLine_r, and the near halves of the whole
+// packet are walked before the far halves, so every line still meets the leafs along it
+// in order and the first non-empty one is the same as TestLine_r finds. The plane
+// distances are computed four lines at a time where SSE does the same float math as the
+// scalar code.
+#define TESTLINE_PACKET_SIZE 16
+
+#if !defined(DOUBLEVEC_T) && (defined(__SSE_MATH__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define TESTLINE_SSE
+#include <xmmintrin.h>
+#endif
+
+typedef struct {
+    vec_t p1[3][TESTLINE_PACKET_SIZE];// structure of arrays
+    vec_t p2[3][TESTLINE_PACKET_SIZE];
+} linesegs_t;
+
+typedef struct {
+    int *result;
+    unsigned done;// lines that hit something
+} linepacket_t;
+
+static void TestLinePacket_r(linepacket_t *packet, int node, unsigned active, const linesegs_t *segs) {
+    const tnode_t *tnode;
+    float front[TESTLINE_PACKET_SIZE], back[TESTLINE_PACKET_SIZE];
+    unsigned front_side, back_side, crossing, near_back;
+    linesegs_t split;
+    int i, k;
+#ifdef TESTLINE_SSE
+    __m128 f, b, dist, normal[3];
+    const __m128 neg_epsilon = _mm_set1_ps(-ON_EPSILON);
+    const __m128 epsilon = _mm_set1_ps(ON_EPSILON);
+#endif
+
+    active &= ~packet->done;
+    while (node >= 0 && active) {
+        tnode = &tnodes[node];
+
+        front_side = 0;
+        back_side = 0;
+#ifdef TESTLINE_SSE
+        dist = _mm_set1_ps(tnode->dist);
+        normal[0] = _mm_set1_ps(tnode->normal[0]);
+        normal[1] = _mm_set1_ps(tnode->normal[1]);
+        normal[2] = _mm_set1_ps(tnode->normal[2]);
+        for (i = 0; i < TESTLINE_PACKET_SIZE; i += 4) {
+            if (!((active >> i) & 15)) {
+                continue;
+            }
+            if (tnode->type < plane_anyx) {
+                f = _mm_sub_ps(_mm_loadu_ps(&segs->p1[tnode->type][i]), dist);
+                b = _mm_sub_ps(_mm_loadu_ps(&segs->p2[tnode->type][i]), dist);
+            } else {
+                f = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&segs->p1[0][i]), normal[0]), _mm_mul_ps(_mm_loadu_ps(&segs->p1[1][i]), normal[1])), _mm_mul_ps(_mm_loadu_ps(&segs->p1[2][i]), normal[2])), dist);
+                b = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&segs->p2[0][i]), normal[0]), _mm_mul_ps(_mm_loadu_ps(&segs->p2[1][i]), normal[1])), _mm_mul_ps(_mm_loadu_ps(&segs->p2[2][i]), normal[2])), dist);
+            }
+            _mm_storeu_ps(&front[i], f);
+            _mm_storeu_ps(&back[i], b);
+            front_side |= _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(f, neg_epsilon), _mm_cmpge_ps(b, neg_epsilon))) << i;
+            // (float) ON_EPSILON is just below ON_EPSILON, so "< ON_EPSILON" becomes "<=" here
+            back_side |= _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(f, epsilon), _mm_cmple_ps(b, epsilon))) << i;
+        }
+#else
+        for (i = 0; i < TESTLINE_PACKET_SIZE; i++) {
+            if (active & (1U << i)) {
+                const vec3_t p1 = {segs->p1[0][i], segs->p1[1][i], segs->p1[2][i]};
+                const vec3_t p2 = {segs->p2[0][i], segs->p2[1][i], segs->p2[2][i]};
+
+                front[i] = TNODE_DIST(tnode, p1);
+                back[i] = TNODE_DIST(tnode, p2);
+                if (front[i] >= -ON_EPSILON && back[i] >= -ON_EPSILON)
+                    front_side |= 1U << i;
+                if (front[i] < ON_EPSILON && back[i] < ON_EPSILON)
+                    back_side |= 1U << i;
+            }
+        }
+#endif
+
+        // A line within epsilon of the plane counts as front, like in TestLine_r
+        front_side &= active;
+        back_side &= active & ~front_side;
+        crossing = active & ~(front_side | back_side);
+
+        if (!crossing) {
+            if (front_side && back_side) {
+                TestLinePacket_r(packet, tnode->children[1], back_side, segs);
+                active = front_side & ~packet->done;
+                node = tnode->children[0];
+            } else if (back_side) {
+                active = back_side;
+                node = tnode->children[1];
+            } else {
+                active = front_side;
+                node = tnode->children[0];
+            }
+            continue;
+        }
+
+        // near halves of the crossing lines
+        near_back = 0;
+#ifdef TESTLINE_SSE
+        for (i = 0; i < TESTLINE_PACKET_SIZE; i += 4) {
+            const unsigned lanes = (crossing >> i) & 15;
+
+            if (!lanes) {
+                for (k = 0; k < 3; k++) {
+                    _mm_storeu_ps(&split.p1[k][i], _mm_loadu_ps(&segs->p1[k][i]));
+                    _mm_storeu_ps(&split.p2[k][i], _mm_loadu_ps(&segs->p2[k][i]));
+                }
+                continue;
+            }
+            f = _mm_loadu_ps(&front[i]);
+            b = _mm_loadu_ps(&back[i]);
+            near_back |= (_mm_movemask_ps(_mm_cmplt_ps(f, _mm_setzero_ps())) & lanes) << i;
+            dist = _mm_div_ps(f, _mm_sub_ps(f, b));// frac
+            for (k = 0; k < 3; k++) {
+                const __m128 p1 = _mm_loadu_ps(&segs->p1[k][i]);
+                const __m128 p2 = _mm_loadu_ps(&segs->p2[k][i]);
+
+                // lanes that aren't crossing keep their segment, whatever the math gave
+                _mm_storeu_ps(&split.p1[k][i], p1);
+                _mm_storeu_ps(&split.p2[k][i], _mm_add_ps(p1, _mm_mul_ps(_mm_sub_ps(p2, p1), dist)));
+                for (int lane = 0; lane < 4; lane++) {
+                    if (!(lanes & (1U << lane))) {
+                        split.p2[k][i + lane] = segs->p2[k][i + lane];
+                    }
+                }
+            }
+        }
+#else
+        split = *segs;
+        for (i = 0; i < TESTLINE_PACKET_SIZE; i++) {
+            if (crossing & (1U << i)) {
+                const float frac = front[i] / (front[i] - back[i]);
+
+                if (front[i] < 0) {
+                    near_back |= 1U << i;
+                }
+                for (k = 0; k < 3; k++) {
+                    split.p2[k][i] = segs->p1[k][i] + (segs->p2[k][i] - segs->p1[k][i]) * frac;
+                }
+            }
+        }
+#endif
+        TestLinePacket_r(packet, tnode->children[0], front_side | (crossing & ~near_back), &split);
+        TestLinePacket_r(packet, tnode->children[1], back_side | near_back, &split);
+
+        // then the far halves of the ones that are still empty
+        for (i = 0; i < TESTLINE_PACKET_SIZE; i++) {
+            if (crossing & (1U << i)) {
+                for (k = 0; k < 3; k++) {
+                    split.p1[k][i] = split.p2[k][i];
+                    split.p2[k][i] = segs->p2[k][i];
+                }
+            }
+        }
+        TestLinePacket_r(packet, tnode->children[1], crossing & ~near_back, &split);
+        TestLinePacket_r(packet, tnode->children[0], near_back, &split);
+        return;
+    }
+
+    if (active && ((node == CONTENTS_SOLID) || (node == CONTENTS_SKY))) {
+        for (i = 0; i < TESTLINE_PACKET_SIZE; i++) {
+            if (active & (1U << i)) {
+                packet->result[i] = node;
+            }
+        }
+        packet->done |= active;
+    }
+}
+
+static void TestLinePacket(const int node, const vec3_t *start, const vec3_t *stop, int *result, const int count) {
+    linepacket_t packet;
+    linesegs_t segs;
+    int i, k;
+
+    if (count == 1) {
+        result[0] = TestLine_r(node, start[0], stop[0]);
+        return;
+    }
+
+    // unused lanes repeat the first line
+    for (i = 0; i < TESTLINE_PACKET_SIZE; i++) {
+        const int j = i < count ? i : 0;
+
+        for (k = 0; k < 3; k++) {
+            segs.p1[k][i] = start[j][k];
+            segs.p2[k][i] = stop[j][k];
+        }
+    }
+    for (i = 0; i < count; i++) {
+        result[i] = CONTENTS_EMPTY;
+    }
+    packet.result = result;
+    packet.done = 0;
+
+    TestLinePacket_r(&packet, node, count < TESTLINE_PACKET_SIZE ? (1U << count) - 1 : ~0U >> (32 - TESTLINE_PACKET_SIZE), &segs);
+}
+
+/*
+ * =============
+ * TestLines
+ *
+ * TestLine for count lines at once, result[i] is the contents hit by start[i] -> stop[i].
+ * Lines that are close together should be next to each other.
+ * =============
+ */
+void TestLines_r(const int node, const vec3_t *start, const vec3_t *stop, int *result, const int count) {
+    int i;
+
+    ProfileCount(eProfileTestLines, count);
+    for (i = 0; i < count; i += TESTLINE_PACKET_SIZE) {
+        TestLinePacket(node, start + i, stop + i, result + i, count - i < TESTLINE_PACKET_SIZE ? count - i : TESTLINE_PACKET_SIZE);
+    }
+}
+
+void TestLines(const vec3_t *start, const vec3_t *stop, int *result, const int count) {
+    TestLines_r(0, start, stop, result, count);
+}
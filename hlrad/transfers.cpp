@@ -10,6 +10,176 @@
 #include <sys/stat.h>
 #endif
 
+#ifdef SYSTEM_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+// =====================================================================================
+//
+//      TRANSFER CACHE
+//      The .inc file written by -incremental:
+//          header
+//          one transfercache_patch_t per patch
+//          payload, starting on a page boundary: for each patch its tIndex, then its
+//          tData (or tRGBData), each 8 byte aligned
+//      All sizes and offsets are fixed width. The header carries a hash of everything
+//      the transfers were computed from, so a cache left over from a different
+//      geometry, patch layout or option set is noticed and rebuilt. When the cache
+//      is valid the file is mapped read only and the patches point straight into it.
+//
+// =====================================================================================
+
+#define TRANSFER_CACHE_MAGIC "HLRT"
+#define TRANSFER_CACHE_VERSION 1
+#define TRANSFER_CACHE_BYTEORDER 0x01020304
+#define TRANSFER_CACHE_PAGE 4096
+#define TRANSFER_CACHE_ALIGN 8
+
+typedef struct {
+    char magic[4];
+    unsigned version;
+    unsigned byteorder;
+    unsigned indexsize;// sizeof(transfer_index_t)
+    unsigned datasize; // sizeof(transfer_data_t) or sizeof(rgb_transfer_data_t)
+    unsigned numpatches;
+    cache_uint64_t hash;
+    cache_uint64_t payload;// offset of the payload
+    cache_uint64_t filesize;
+} transfercache_header_t;
+
+typedef struct {
+    unsigned iIndex;
+    unsigned iData;
+    cache_uint64_t index;// offset of tIndex in the file
+    cache_uint64_t data; // offset of tData in the file
+} transfercache_patch_t;
+
+// the mapped (or, failing that, loaded) cache the patches currently point into
+static byte *s_transfer_cache = NULL;
+static cache_uint64_t s_transfer_cache_size = 0;
+static bool s_transfer_cache_mapped = false;
+#ifdef SYSTEM_WIN32
+static HANDLE s_transfer_cache_mapping = NULL;
+#endif
+
+static cache_uint64_t AlignCacheOffset(const cache_uint64_t offset, const unsigned align) {
+    return (offset + align - 1) & ~(cache_uint64_t) (align - 1);
+}
+
+static unsigned TransferDataSize() {
+#ifdef HLRAD_HULLU
+    if (g_rgb_transfers) {
+        return sizeof(rgb_transfer_data_t);
+    }
+#endif
+    return sizeof(transfer_data_t);
+}
+
+static const void *TransferData(const patch_t *const patch) {
+#ifdef HLRAD_HULLU
+    if (g_rgb_transfers) {
+        return patch->tRGBData;
+    }
+#endif
+    return patch->tData;
+}
+
+// =====================================================================================
+//  HashBytes
+//      64 bit FNV-1a
+// =====================================================================================
+cache_uint64_t HashBytes(cache_uint64_t hash, const void *const data, const size_t size) {
+    const byte *p = (const byte *) data;
+    const byte *end = p + size;
+
+    for (; p < end; p++) {
+        hash ^= *p;
+        hash *= (cache_uint64_t) 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// =====================================================================================
+//  GeometryHash
+//      The BSP geometry and visibility, the patch layout (which covers chop, texchop,
+//      dlight and bmodel offsets) and the opaque faces. Light values are left out on
+//      purpose, those are what -incremental is for.
+// =====================================================================================
+cache_uint64_t GeometryHash(const unsigned numpatches) {
+    cache_uint64_t hash = (cache_uint64_t) 0xCBF29CE484222325ULL;
+    unsigned i;
+
+    hash = HashBytes(hash, g_dplanes, g_numplanes * sizeof(dplane_t));
+    hash = HashBytes(hash, g_dnodes, g_numnodes * sizeof(dnode_t));
+    hash = HashBytes(hash, g_dleafs, g_numleafs * sizeof(dleaf_t));
+    hash = HashBytes(hash, g_dmarksurfaces, g_nummarksurfaces * sizeof(g_dmarksurfaces[0]));
+    hash = HashBytes(hash, g_dvisdata, g_visdatasize);
+    hash = HashBytes(hash, g_dvertexes, g_numvertexes * sizeof(dvertex_t));
+    hash = HashBytes(hash, g_dedges, g_numedges * sizeof(dedge_t));
+    hash = HashBytes(hash, g_dsurfedges, g_numsurfedges * sizeof(g_dsurfedges[0]));
+    hash = HashBytes(hash, g_dmodels, g_nummodels * sizeof(dmodel_t));
+    for (i = 0; i < (unsigned) g_numfaces; i++) {
+        // not the styles and lightofs, hlrad rewrites those
+        hash = HashBytes(hash, &g_dfaces[i], myoffsetof(dface_t, styles));
+    }
+
+    for (i = 0; i < numpatches; i++) {
+        const patch_t *patch = &g_patches[i];
+
+        hash = HashBytes(hash, patch->origin, sizeof(vec3_t));
+        hash = HashBytes(hash, &patch->area, sizeof(patch->area));
+        hash = HashBytes(hash, &patch->faceNumber, sizeof(patch->faceNumber));
+    }
+
+    for (i = 0; i < g_opaque_face_count; i++) {
+        const opaqueList_t *opaque = &g_opaque_face_list[i];
+
+        hash = HashBytes(hash, &opaque->facenum, sizeof(opaque->facenum));
+        hash = HashBytes(hash, &opaque->plane, sizeof(opaque->plane));
+#ifdef HLRAD_HULLU
+        hash = HashBytes(hash, opaque->transparency_scale, sizeof(vec3_t));
+        hash = HashBytes(hash, &opaque->transparency, sizeof(opaque->transparency));
+#endif
+    }
+
+    return hash;
+}
+
+// =====================================================================================
+//  TransferCacheHash
+//      Everything MakeScales depends on: the geometry and the options that change
+//      the transfers
+// =====================================================================================
+static cache_uint64_t TransferCacheHash(const unsigned numpatches) {
+    cache_uint64_t hash = GeometryHash(numpatches);
+    int options[3];
+
+    memset(options, 0, sizeof(options));
+#ifdef HLRAD_HULLU
+    options[0] = g_rgb_transfers;
+    options[1] = g_customshadow_with_bouncelight;
+#endif
+    options[2] = TRANSFER_SCALE_VAL;
+    hash = HashBytes(hash, options, sizeof(options));
+
+    return hash;
+}
+
+static bool WritePadding(FILE *file, cache_uint64_t from, const cache_uint64_t to) {
+    static const byte zeros[TRANSFER_CACHE_PAGE] = {0};
+
+    while (from < to) {
+        size_t size = (to - from < sizeof(zeros)) ? (size_t) (to - from) : sizeof(zeros);
+
+        if (fwrite(zeros, 1, size, file) != size) {
+            return false;
+        }
+        from += size;
+    }
+    return true;
+}
+
 /*
  * =============
  * writetransfers
@@ -18,63 +188,160 @@
 
 void writetransfers(const char *const transferfile, const long total_patches) {
     FILE *file;
+    transfercache_header_t header;
+    transfercache_patch_t *table = NULL;
+    const unsigned datasize = TransferDataSize();
+    cache_uint64_t offset;
+    unsigned i;
+    patch_t *patch;
 
     file = fopen(transferfile, "w+b");
-    if (file != NULL) {
-        unsigned amtwritten;
-        patch_t *patch;
+    if (file == NULL) {
+        Error("Failed to open incremenetal file [%s] for writing\n", transferfile);
+    }
+
+    Log("Writing transfers file [%s]\n", transferfile);
 
-        Log("Writing transfers file [%s]\n", transferfile);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRANSFER_CACHE_MAGIC, sizeof(header.magic));
+    header.version = TRANSFER_CACHE_VERSION;
+    header.byteorder = TRANSFER_CACHE_BYTEORDER;
+    header.indexsize = sizeof(transfer_index_t);
+    header.datasize = datasize;
+    header.numpatches = total_patches;
+    header.hash = TransferCacheHash(total_patches);
+    header.payload = AlignCacheOffset(sizeof(header) + total_patches * sizeof(transfercache_patch_t), TRANSFER_CACHE_PAGE);
 
-        amtwritten = fwrite(&total_patches, sizeof(total_patches), 1, file);
-        if (amtwritten != 1) {
+    table = (transfercache_patch_t *) calloc(total_patches ? total_patches : 1, sizeof(transfercache_patch_t));
+    hlassume(table != NULL, assume_NoMemory);
+
+    // lay out the payload
+    offset = header.payload;
+    for (i = 0, patch = g_patches; i < (unsigned) total_patches; i++, patch++) {
+        table[i].iIndex = patch->iIndex;
+        table[i].iData = patch->iData;
+        offset = AlignCacheOffset(offset, TRANSFER_CACHE_ALIGN);
+        table[i].index = offset;
+        offset += patch->iIndex * sizeof(transfer_index_t);
+        offset = AlignCacheOffset(offset, TRANSFER_CACHE_ALIGN);
+        table[i].data = offset;
+        offset += (cache_uint64_t) patch->iData * datasize;
+    }
+    header.filesize = offset;
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        goto FailedWrite;
+    }
+    if (total_patches && fwrite(table, sizeof(transfercache_patch_t), total_patches, file) != (size_t) total_patches) {
+        goto FailedWrite;
+    }
+
+    offset = sizeof(header) + total_patches * sizeof(transfercache_patch_t);
+    for (i = 0, patch = g_patches; i < (unsigned) total_patches; i++, patch++) {
+        if (!WritePadding(file, offset, table[i].index)) {
+            goto FailedWrite;
+        }
+        if (patch->iIndex && fwrite(patch->tIndex, sizeof(transfer_index_t), patch->iIndex, file) != patch->iIndex) {
             goto FailedWrite;
         }
+        offset = table[i].index + patch->iIndex * sizeof(transfer_index_t);
 
-        long patchcount = total_patches;
-        for (patch = g_patches; patchcount-- > 0; patch++) {
-            amtwritten = fwrite(&patch->iIndex, sizeof(patch->iIndex), 1, file);
-            if (amtwritten != 1) {
-                goto FailedWrite;
-            }
+        if (!WritePadding(file, offset, table[i].data)) {
+            goto FailedWrite;
+        }
+        if (patch->iData && fwrite(TransferData(patch), datasize, patch->iData, file) != patch->iData) {
+            goto FailedWrite;
+        }
+        offset = table[i].data + (cache_uint64_t) patch->iData * datasize;
+    }
 
-            if (patch->iIndex) {
-                amtwritten = fwrite(patch->tIndex, sizeof(transfer_index_t), patch->iIndex, file);
-                if (amtwritten != patch->iIndex) {
-                    goto FailedWrite;
-                }
-            }
+    free(table);
+    fclose(file);
+    return;
 
-            amtwritten = fwrite(&patch->iData, sizeof(patch->iData), 1, file);
-            if (amtwritten != 1) {
-                goto FailedWrite;
-            }
-            if (patch->iData) {
-#ifdef HLRAD_HULLU
-                if (g_rgb_transfers) {
-                    amtwritten = fwrite(patch->tRGBData, sizeof(rgb_transfer_data_t), patch->iData, file);
-                } else {
-                    amtwritten = fwrite(patch->tData, sizeof(transfer_data_t), patch->iData, file);
-                }
-#else
-                amtwritten = fwrite(patch->tData, sizeof(transfer_data_t), patch->iData, file);
+FailedWrite:
+    free(table);
+    fclose(file);
+    unlink(transferfile);
+    Warning("Failed to generate incremental file [%s] (probably ran out of disk space)\n", transferfile);
+}
+
+// =====================================================================================
+//  MapTransferCache
+//      Maps the whole file read only, or reads it into memory where that fails
+// =====================================================================================
+static byte *MapTransferCache(const char *const transferfile, const cache_uint64_t size) {
+    byte *base = NULL;
+
+#ifdef SYSTEM_POSIX
+    int fd = open(transferfile, O_RDONLY);
+
+    if (fd != -1) {
+        void *p = mmap(NULL, (size_t) size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        close(fd);
+        if (p != MAP_FAILED) {
+            s_transfer_cache_mapped = true;
+            return (byte *) p;
+        }
+    }
 #endif
-                if (amtwritten != patch->iData) {
-                    goto FailedWrite;
-                }
+#ifdef SYSTEM_WIN32
+    HANDLE file = CreateFile(transferfile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (file != INVALID_HANDLE_VALUE) {
+        s_transfer_cache_mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(file);
+        if (s_transfer_cache_mapping) {
+            base = (byte *) MapViewOfFile(s_transfer_cache_mapping, FILE_MAP_READ, 0, 0, (SIZE_T) size);
+            if (base) {
+                s_transfer_cache_mapped = true;
+                return base;
             }
+            CloseHandle(s_transfer_cache_mapping);
+            s_transfer_cache_mapping = NULL;
         }
+    }
+#endif
 
+    // fall back to reading it in one go
+    {
+        FILE *file = fopen(transferfile, "rb");
+
+        if (file == NULL) {
+            return NULL;
+        }
+        base = (byte *) AllocBlock((unsigned long) size);
+        hlassume(base != NULL, assume_NoMemory);
+        if (fread(base, 1, (size_t) size, file) != size) {
+            FreeBlock(base);
+            base = NULL;
+        }
         fclose(file);
-    } else {
-        Error("Failed to open incremenetal file [%s] for writing\n", transferfile);
     }
-    return;
+    s_transfer_cache_mapped = false;
+    return base;
+}
 
-FailedWrite:
-    fclose(file);
-    unlink(transferfile);
-    Warning("Failed to generate incremental file [%s] (probably ran out of disk space)\n");
+static void UnmapTransferCache() {
+    if (!s_transfer_cache) {
+        return;
+    }
+    if (s_transfer_cache_mapped) {
+#ifdef SYSTEM_POSIX
+        munmap(s_transfer_cache, (size_t) s_transfer_cache_size);
+#endif
+#ifdef SYSTEM_WIN32
+        UnmapViewOfFile(s_transfer_cache);
+        CloseHandle(s_transfer_cache_mapping);
+        s_transfer_cache_mapping = NULL;
+#endif
+    } else {
+        FreeBlock(s_transfer_cache);
+    }
+    s_transfer_cache = NULL;
+    s_transfer_cache_size = 0;
+    s_transfer_cache_mapped = false;
 }
 
 /*
@@ -85,85 +352,110 @@ FailedWrite:
 
 bool readtransfers(const char *const transferfile, const long numpatches) {
     FILE *file;
-    long total_patches;
+    transfercache_header_t header;
+    const transfercache_patch_t *table;
+    const unsigned datasize = TransferDataSize();
+    unsigned i;
+    patch_t *patch;
+    const char *reason;
+    struct stat filestat;
 
     file = fopen(transferfile, "rb");
-    if (file != NULL) {
-        unsigned amtread;
-        patch_t *patch;
+    if (file == NULL) {
+        Warning("Failed to open transfers file [%s]\n", transferfile);
+        return false;
+    }
 
-        Log("Reading transfers file [%s]\n", transferfile);
+    Log("Reading transfers file [%s]\n", transferfile);
 
-        amtread = fread(&total_patches, sizeof(total_patches), 1, file);
-        if (amtread != 1) {
-            goto FailedRead;
-        }
-        if (total_patches != numpatches) {
-            goto FailedRead;
-        }
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRANSFER_CACHE_MAGIC, sizeof(header.magic))) {
+        reason = "not a transfer cache";
+    } else if (header.version != TRANSFER_CACHE_VERSION || header.byteorder != TRANSFER_CACHE_BYTEORDER || header.indexsize != sizeof(transfer_index_t)) {
+        reason = "written by an incompatible hlrad";
+    } else if (stat(transferfile, &filestat) || (cache_uint64_t) filestat.st_size < header.filesize
+               || header.payload < sizeof(header) + header.numpatches * sizeof(transfercache_patch_t)) {
+        reason = "truncated";
+    } else if (header.datasize != datasize || header.numpatches != (unsigned) numpatches || header.hash != TransferCacheHash(numpatches)) {
+        reason = "the map, its patches or the options changed";
+    } else {
+        reason = NULL;
+    }
+    fclose(file);
 
-        long patchcount = total_patches;
-        for (patch = g_patches; patchcount-- > 0; patch++) {
-            amtread = fread(&patch->iIndex, sizeof(patch->iIndex), 1, file);
-            if (amtread != 1) {
-                goto FailedRead;
-            }
-            if (patch->iIndex) {
-                patch->tIndex = (transfer_index_t *) AllocBlock(patch->iIndex * sizeof(transfer_index_t *));
-                hlassume(patch->tIndex != NULL, assume_NoMemory);
-                amtread = fread(patch->tIndex, sizeof(transfer_index_t), patch->iIndex, file);
-                if (amtread != patch->iIndex) {
-                    goto FailedRead;
-                }
-            }
+    if (reason) {
+        Log("Transfers file [%s] is out of date (%s), rebuilding it\n", transferfile, reason);
+        unlink(transferfile);
+        return false;
+    }
 
-            amtread = fread(&patch->iData, sizeof(patch->iData), 1, file);
-            if (amtread != 1) {
-                goto FailedRead;
-            }
-            if (patch->iData) {
-#ifdef HLRAD_HULLU
-                if (g_rgb_transfers) {
-                    patch->tRGBData = (rgb_transfer_data_t *) AllocBlock(patch->iData * sizeof(rgb_transfer_data_t *));
-                    hlassume(patch->tRGBData != NULL, assume_NoMemory);
-                    amtread = fread(patch->tRGBData, sizeof(rgb_transfer_data_t), patch->iData, file);
-                } else {
-                    patch->tData = (transfer_data_t *) AllocBlock(patch->iData * sizeof(transfer_data_t *));
-                    hlassume(patch->tData != NULL, assume_NoMemory);
-                    amtread = fread(patch->tData, sizeof(transfer_data_t), patch->iData, file);
-                }
-#else
-                patch->tData = (transfer_data_t *) AllocBlock(patch->iData * sizeof(transfer_data_t *));
-                hlassume(patch->tData != NULL, assume_NoMemory);
-                amtread = fread(patch->tData, sizeof(transfer_data_t), patch->iData, file);
-#endif
-                if (amtread != patch->iData) {
-                    goto FailedRead;
-                }
-            }
+    UnmapTransferCache();
+    s_transfer_cache = MapTransferCache(transferfile, header.filesize);
+    if (!s_transfer_cache) {
+        Warning("Failed to read transfers file [%s]\n", transferfile);
+        unlink(transferfile);
+        return false;
+    }
+    s_transfer_cache_size = header.filesize;
+
+    table = (const transfercache_patch_t *) (s_transfer_cache + sizeof(header));
+    for (i = 0, patch = g_patches; i < (unsigned) numpatches; i++, patch++) {
+        if (table[i].index + table[i].iIndex * sizeof(transfer_index_t) > header.filesize
+            || table[i].data + (cache_uint64_t) table[i].iData * datasize > header.filesize) {
+            Warning("Transfers file [%s] is truncated\n", transferfile);
+            freetransfers();
+            unlink(transferfile);
+            return false;
         }
 
-        fclose(file);
-        Warning("Finished reading transfers file [%s] %d\n", transferfile);
-        return true;
+        patch->iIndex = table[i].iIndex;
+        patch->iData = table[i].iData;
+        g_total_transfer += patch->iData;
+        g_transfer_index_bytes += patch->iIndex * sizeof(transfer_index_t);
+        g_transfer_data_bytes += patch->iData * datasize;
+        patch->tIndex = patch->iIndex ? (transfer_index_t *) (s_transfer_cache + table[i].index) : NULL;
+#ifdef HLRAD_HULLU
+        if (g_rgb_transfers) {
+            patch->tRGBData = patch->iData ? (rgb_transfer_data_t *) (s_transfer_cache + table[i].data) : NULL;
+            continue;
+        }
+#endif
+        patch->tData = patch->iData ? (transfer_data_t *) (s_transfer_cache + table[i].data) : NULL;
     }
-    Warning("Failed to open transfers file [%s]\n", transferfile);
-    return false;
 
-FailedRead: {
+    Log("%-20s: %5.1f megs %s\n", "transfers file", header.filesize / (1024 * 1024.0), s_transfer_cache_mapped ? "mapped" : "loaded");
+    return true;
+}
+
+bool transfersfromcache() {
+    return s_transfer_cache != NULL;
+}
+
+/*
+ * =============
+ * freetransfers
+ *
+ * If the patches point into the transfer cache, clears them and releases it.
+ * Returns false if they own their transfers instead.
+ * =============
+ */
+
+bool freetransfers() {
     unsigned x;
-    patch_t *patch = g_patches;
+    patch_t *patch;
 
-    for (x = 0; x < g_num_patches; x++, patch++) {
-        FreeBlock(patch->tData);
-        FreeBlock(patch->tIndex);
-        patch->iData = 0;
+    if (!s_transfer_cache) {
+        return false;
+    }
+
+    for (x = 0, patch = g_patches; x < g_num_patches; x++, patch++) {
         patch->iIndex = 0;
-        patch->tData = NULL;
+        patch->iData = 0;
         patch->tIndex = NULL;
+        patch->tData = NULL;
+#ifdef HLRAD_HULLU
+        patch->tRGBData = NULL;
+#endif
     }
-}
-    fclose(file);
-    unlink(transferfile);
-    return false;
+    UnmapTransferCache();
+    return true;
 }
@@ -1,9 +1,17 @@
 #include "qrad.h"
 
+#ifdef SYSTEM_WIN32
+#include "win32fix.h"
+#endif
+
+#ifdef SYSTEM_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
 ////////////////////////////
 // begin old vismat.c
 //
-#define HALFBIT
 
 // =====================================================================================
 //
@@ -13,39 +21,43 @@
 //
 // =====================================================================================
 
+// The half matrix is stored as the upper triangle of VISMATRIX_TILE x VISMATRIX_TILE
+// blocks of bits, one block after the other.  A patch only ever sets bits in its own
+// tile row, and MakeScales, walking the patches in order, only reads one tile row and
+// one tile column at a time, which keeps -matrixfile from thrashing the scratch file.
+#define VISMATRIX_TILE 256
+#define VISMATRIX_TILE_BITS (VISMATRIX_TILE * VISMATRIX_TILE)
+
 static byte *s_vismatrix;
+static cache_uint64_t s_vismatrix_size;
+static unsigned s_vismatrix_tiles;// per side
+static bool s_vismatrix_mapped;
+#ifdef SYSTEM_WIN32
+static HANDLE s_vismatrix_mapping = NULL;
+#endif
 
-#ifdef HLRAD_HULLU
 // =====================================================================================
-//      OPACITY ARRAY
+//  VisBitPos
+//      p1 < p2
 // =====================================================================================
+static inline cache_uint64_t VisBitPos(const unsigned p1, const unsigned p2) {
+    const cache_uint64_t row = p1 / VISMATRIX_TILE;
+    const cache_uint64_t col = p2 / VISMATRIX_TILE;
+    const cache_uint64_t tile = row * s_vismatrix_tiles - (row * (row - 1)) / 2 + (col - row);
 
-typedef struct {
-    unsigned bitpos;
-    vec3_t transparency;
-} transparency_t;
-
-static transparency_t *s_transparency_list = NULL;
-static unsigned long s_transparency_count = 0;
-static unsigned long s_max_transparency_count = 0;
-
-static void FindOpacity(const unsigned bitpos, vec3_t &out) {
-    for (unsigned long i = 0; i < s_transparency_count; i++) {
-        if (s_transparency_list[i].bitpos == bitpos) {
-            VectorCopy(s_transparency_list[i].transparency, out);
-            return;
-        }
-    }
-    VectorFill(out, 1.0);
+    return tile * VISMATRIX_TILE_BITS + (p1 % VISMATRIX_TILE) * VISMATRIX_TILE + (p2 % VISMATRIX_TILE);
 }
 
-#endif /*HLRAD_HULLU*/
-
 // =====================================================================================
 //  TestPatchToFace
 //      Sets vis bits for all patches in the face
 // =====================================================================================
-static void TestPatchToFace(const unsigned patchnum, const int facenum, const int head, const unsigned int bitpos) {
+#ifdef HLRAD_HULLU
+static void TestPatchToFace(const unsigned patchnum, const int facenum, const int head, transparency_build_t *shadows)
+#else
+static void TestPatchToFace(const unsigned patchnum, const int facenum, const int head)
+#endif
+{
     patch_t *patch = &g_patches[patchnum];
     patch_t *patch2 = g_face_patches[facenum];
 
@@ -58,51 +70,52 @@ static void TestPatchToFace(const unsigned patchnum, const int facenum, const in
             // we need to do a real test
             const dplane_t *plane = getPlaneFromFaceNumber(patch->faceNumber);
 
-            for (; patch2; patch2 = patch2->next) {
-                unsigned m = patch2 - g_patches;
+            patch_t *batch[TESTPATCH_BATCH_SIZE];
+            vec3_t starts[TESTPATCH_BATCH_SIZE];
+            vec3_t stops[TESTPATCH_BATCH_SIZE];
+            int contents[TESTPATCH_BATCH_SIZE];
+            int count, i;
+
+            while (patch2) {
+                // collect the patches that pass the plane tests, then trace them as one packet
+                //  if bit has not already been set
+                //  && v2 is not behind light plane
+                for (count = 0; patch2 && count < TESTPATCH_BATCH_SIZE; patch2 = patch2->next) {
+                    if ((unsigned) (patch2 - g_patches) > patchnum && (DotProduct(patch2->origin, plane->normal) > (PatchPlaneDist(patch) + MINIMUM_PATCH_DISTANCE))) {
+                        batch[count] = patch2;
+                        VectorCopy(patch->origin, starts[count]);
+                        VectorCopy(patch2->origin, stops[count]);
+                        count++;
+                    }
+                }
+                TestLines_r(head, starts, stops, contents, count);
+
+                for (i = 0; i < count; i++) {
+                    patch_t *visible = batch[i];
+                    unsigned m = visible - g_patches;
 
 #ifdef HLRAD_HULLU
-                vec3_t transparency = {1.0, 1.0, 1.0};
+                    vec3_t transparency = {1.0, 1.0, 1.0};
 #endif
 
-                // check vis between patch and patch2
-                // if bit has not already been set
-                //  && v2 is not behind light plane
-                //  && v2 is visible from v1
-                if (m > patchnum && (DotProduct(patch2->origin, plane->normal) > (PatchPlaneDist(patch) + MINIMUM_PATCH_DISTANCE)) && (TestLine_r(head, patch->origin, patch2->origin) == CONTENTS_EMPTY)
+                    //  && v2 is visible from v1
+                    if (contents[i] != CONTENTS_EMPTY
 #ifdef HLRAD_HULLU
-                    && (!TestSegmentAgainstOpaqueList(patch->origin, patch2->origin, transparency)))
+                        || TestSegmentAgainstOpaqueList(patch->origin, visible->origin, transparency))
 #else
-                    && (!TestSegmentAgainstOpaqueList(patch->origin, patch2->origin)))
+                        || TestSegmentAgainstOpaqueList(patch->origin, visible->origin))
 #endif
-                {
-                    //Log("SDF::3\n");
+                    {
+                        continue;
+                    }
 
                     // patchnum can see patch m
-                    unsigned bitset = bitpos + m;
+                    const cache_uint64_t bitset = VisBitPos(patchnum, m);
 
 #ifdef HLRAD_HULLU
                     // transparency face fix table
-                    // TODO: this method makes MakeScale extreamly slow.. find new one
-
                     if (g_customshadow_with_bouncelight && fabs(VectorAvg(transparency) - 1.0) < 0.001) {
-                        while (s_transparency_count >= s_max_transparency_count) {
-                            //new size
-                            unsigned long old_max = s_max_transparency_count;
-                            s_max_transparency_count += 128;
-
-                            //realloc
-                            s_transparency_list = (transparency_t *) realloc(s_transparency_list, s_max_transparency_count * sizeof(transparency_t));
-
-                            // clean new memory
-                            memset(&s_transparency_list[old_max], 0, sizeof(transparency_t) * 128);
-                        }
-
-                        //add to array
-                        VectorCopy(transparency, s_transparency_list[s_transparency_count].transparency);
-                        s_transparency_list[s_transparency_count].bitpos = bitset;
-
-                        s_transparency_count++;
+                        AddTransparency(shadows, patchnum, m, transparency);
                     }
 #endif /*HLRAD_HULLU*/
 
@@ -115,30 +128,22 @@ static void TestPatchToFace(const unsigned patchnum, const int facenum, const in
 
 // =====================================================================================
 //  BuildVisRow
-//      Calc vis bits from a single patch
+//      Calc vis bits from a single patch to the world and bmodel faces in its PVS
 // =====================================================================================
-static void BuildVisRow(const int patchnum, byte *pvs, const int head, const unsigned int bitpos) {
-    int j, k, l;
-    byte face_tested[MAX_MAP_FACES];
-    dleaf_t *leaf;
-
-    memset(face_tested, 0, g_numfaces);
-
-    // leaf 0 is the solid leaf (skipped)
-    for (j = 1, leaf = g_dleafs + 1; j < g_numleafs; j++, leaf++) {
-        if (!(pvs[(j - 1) >> 3] & (1 << ((j - 1) & 7))))
-            continue;// not in pvs
-        for (k = 0; k < leaf->nummarksurfaces; k++) {
-            l = g_dmarksurfaces[leaf->firstmarksurface + k];
-
-            // faces can be marksurfed by multiple leaves, but
-            // don't bother testing again
-            if (face_tested[l])
-                continue;
-            face_tested[l] = 1;
-
-            TestPatchToFace(patchnum, l, head, bitpos);
-        }
+#ifdef HLRAD_HULLU
+static void BuildVisRow(const int patchnum, const pvsfaces_t *pvsfaces, const int head, transparency_build_t *shadows)
+#else
+static void BuildVisRow(const int patchnum, const pvsfaces_t *pvsfaces, const int head)
+#endif
+{
+    unsigned j;
+
+    for (j = 0; j < pvsfaces->numfaces; j++) {
+#ifdef HLRAD_HULLU
+        TestPatchToFace(patchnum, pvsfaces->faces[j], head, shadows);
+#else
+        TestPatchToFace(patchnum, pvsfaces->faces[j], head);
+#endif
     }
 }
 
@@ -152,14 +157,19 @@ static void BuildVisRow(const int patchnum, byte *pvs, const int head, const uns
 #endif
 static void BuildVisLeafs(int threadnum) {
     int i;
-    int lface, facenum, facenum2;
+    int lface, facenum;
     byte pvs[(MAX_MAP_LEAFS + 7) / 8];
     dleaf_t *srcleaf;
-    dleaf_t *leaf;
     patch_t *patch;
     int head;
-    unsigned bitpos;
     unsigned patchnum;
+    pvsfaces_t pvsfaces;
+#ifdef HLRAD_HULLU
+    transparency_build_t shadows;
+
+    memset(&shadows, 0, sizeof(shadows));
+#endif
+    memset(&pvsfaces, 0, sizeof(pvsfaces));
 
     while (1) {
         //
@@ -172,6 +182,7 @@ static void BuildVisLeafs(int threadnum) {
         i++;// skip leaf 0
         srcleaf = &g_dleafs[i];
         DecompressVis(&g_dvisdata[srcleaf->visofs], pvs, sizeof(pvs));
+        GetPvsFaces(&pvsfaces, pvs);
         head = 0;
 
         //
@@ -182,73 +193,140 @@ static void BuildVisLeafs(int threadnum) {
         for (lface = 0; lface < srcleaf->nummarksurfaces; lface++) {
             facenum = g_dmarksurfaces[srcleaf->firstmarksurface + lface];
             for (patch = g_face_patches[facenum]; patch; patch = patch->next) {
-                leaf = PointInLeaf(patch->origin);
-                if (leaf != srcleaf)
-                    continue;
-
                 patchnum = patch - g_patches;
+                if (GetPatchLeaf(patchnum) != i)
+                    continue;
 
-#ifdef HALFBIT
-                bitpos = patchnum * g_num_patches - (patchnum * (patchnum + 1)) / 2;
+                // build to all other world leafs and the bmodel faces
+#ifdef HLRAD_HULLU
+                BuildVisRow(patchnum, &pvsfaces, head, &shadows);
 #else
-                bitpos = patchnum * g_num_patches;
+                BuildVisRow(patchnum, &pvsfaces, head);
 #endif
-                // build to all other world leafs
-                BuildVisRow(patchnum, pvs, head, bitpos);
 
-                // build to bmodel faces
-                if (g_nummodels < 2)
-                    continue;
-                for (facenum2 = g_dmodels[1].firstface; facenum2 < g_numfaces; facenum2++)
-                    TestPatchToFace(patchnum, facenum2, head, bitpos);
+#ifdef HLRAD_HULLU
+                FlushTransparencies(&shadows);
+#endif
             }
         }
     }
+
+    FreePvsFaces(&pvsfaces);
+#ifdef HLRAD_HULLU
+    FreeTransparencyBuild(&shadows);
+#endif
 }
 
 #ifdef SYSTEM_WIN32
 #pragma warning(pop)
 #endif
 
+// =====================================================================================
+//  MapVisMatrixFile
+//      Backs the matrix with a scratch file next to the bsp, so the OS can page
+//      finished tiles out to disk instead of needing the whole matrix in memory
+// =====================================================================================
+static byte *MapVisMatrixFile(const cache_uint64_t size) {
+    char matrixfile[_MAX_PATH];
+
+    safe_strncpy(matrixfile, g_source, _MAX_PATH);
+    StripExtension(matrixfile);
+    DefaultExtension(matrixfile, ".vmx");
+
+#ifdef SYSTEM_POSIX
+    int fd = open(matrixfile, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+    if (fd != -1) {
+        void *p = MAP_FAILED;
+
+        // the new file reads back as zeros, and the mapping keeps it alive once unlinked
+        if (ftruncate(fd, (off_t) size) == 0) {
+            p = mmap(NULL, (size_t) size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        unlink(matrixfile);
+        if (p != MAP_FAILED) {
+            return (byte *) p;
+        }
+    }
+#endif
+#ifdef SYSTEM_WIN32
+    HANDLE file = CreateFile(matrixfile, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                             FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+
+    if (file != INVALID_HANDLE_VALUE) {
+        s_vismatrix_mapping = CreateFileMapping(file, NULL, PAGE_READWRITE, (DWORD) (size >> 32), (DWORD) size, NULL);
+        CloseHandle(file);
+        if (s_vismatrix_mapping) {
+            byte *base = (byte *) MapViewOfFile(s_vismatrix_mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T) size);
+
+            if (base) {
+                return base;
+            }
+            CloseHandle(s_vismatrix_mapping);
+            s_vismatrix_mapping = NULL;
+        }
+    }
+#endif
+
+    Warning("Unable to map vismatrix file [%s], keeping the vismatrix in memory", matrixfile);
+    return NULL;
+}
+
 // =====================================================================================
 // BuildVisMatrix
 // =====================================================================================
 static void BuildVisMatrix() {
-    int c;
+    s_vismatrix_tiles = (g_num_patches + VISMATRIX_TILE - 1) / VISMATRIX_TILE;
+    s_vismatrix_size = ((cache_uint64_t) s_vismatrix_tiles * (s_vismatrix_tiles + 1) / 2) * (VISMATRIX_TILE_BITS / 8);
 
-#ifdef HALFBIT
-    c = ((g_num_patches + 1) * (g_num_patches + 1)) / 16;
-#else
-    c = g_num_patches * ((g_num_patches + 7) / 8);
-#endif
+    Log("%-20s: %5.1f megs%s\n", "visibility matrix", s_vismatrix_size / (1024 * 1024.0), g_matrix_file ? " (file)" : "");
+    g_vismatrix_bytes = s_vismatrix_size;
 
-    Log("%-20s: %5.1f megs\n", "visibility matrix", c / (1024 * 1024.0));
+    s_vismatrix = NULL;
+    s_vismatrix_mapped = false;
+    if (g_matrix_file) {
+        s_vismatrix = MapVisMatrixFile(s_vismatrix_size);
+        s_vismatrix_mapped = s_vismatrix != NULL;
+    }
 
-    s_vismatrix = (byte *) AllocBlock(c);
+    if (!s_vismatrix) {
+        hlassume(s_vismatrix_size == (unsigned long) s_vismatrix_size, assume_NoMemory);
+        s_vismatrix = (byte *) AllocBlock((unsigned long) s_vismatrix_size);
+    }
 
     if (!s_vismatrix) {
         Log("Failed to allocate s_vismatrix");
         hlassume(s_vismatrix != NULL, assume_NoMemory);
     }
 
+    CreateVisLeafTables();
     NamedRunThreadsOn(g_numleafs - 1, g_estimate, BuildVisLeafs);
+    FreeVisLeafTables();
 }
 
 static void FreeVisMatrix() {
     if (s_vismatrix) {
-        if (FreeBlock(s_vismatrix)) {
+        if (s_vismatrix_mapped) {
+#ifdef SYSTEM_POSIX
+            munmap(s_vismatrix, (size_t) s_vismatrix_size);
+#endif
+#ifdef SYSTEM_WIN32
+            UnmapViewOfFile(s_vismatrix);
+            CloseHandle(s_vismatrix_mapping);
+            s_vismatrix_mapping = NULL;
+#endif
+            s_vismatrix = NULL;
+        } else if (FreeBlock(s_vismatrix)) {
             s_vismatrix = NULL;
         } else {
             Warning("Unable to free s_vismatrix");
         }
     }
+    s_vismatrix_mapped = false;
 
 #ifdef HLRAD_HULLU
-    if (s_transparency_list) {
-        free(s_transparency_list);
-        s_transparency_list = NULL;
-    }
-    s_transparency_count = s_max_transparency_count = 0;
+    FreeTransparencyTable();
 #endif
 }
 
@@ -261,7 +339,7 @@ static bool CheckVisBitVismatrix(unsigned p1, unsigned p2, vec3_t &transparency_
 static bool CheckVisBitVismatrix(unsigned p1, unsigned p2)
 #endif
 {
-    unsigned bitpos;
+    cache_uint64_t bitpos;
 
     if (p1 > p2) {
         const unsigned a = p1;
@@ -277,17 +355,13 @@ static bool CheckVisBitVismatrix(unsigned p1, unsigned p2)
         Warning("in CheckVisBit(), p2 > num_patches");
     }
 
-#ifdef HALFBIT
-    bitpos = p1 * g_num_patches - (p1 * (p1 + 1)) / 2 + p2;
-#else
-    bitpos = p1 * g_num_patches + p2;
-#endif
+    bitpos = VisBitPos(p1, p2);
 
     if (s_vismatrix[bitpos >> 3] & (1 << (bitpos & 7))) {
 #ifdef HLRAD_HULLU
         if (g_customshadow_with_bouncelight) {
             vec3_t getvalue = {1.0, 1.0, 1.0};
-            FindOpacity(bitpos, getvalue);
+            FindTransparency(p1, p2, getvalue);
             VectorCopy(getvalue, transparency_out);
         } else {
             VectorFill(transparency_out, 1.0);
@@ -313,7 +387,7 @@ static bool CheckVisBitVismatrix(unsigned p1, unsigned p2)
 void MakeScalesVismatrix() {
     char transferfile[_MAX_PATH];
 
-    hlassume(g_num_patches < MAX_VISMATRIX_PATCHES, assume_MAX_PATCHES);
+    hlassume(g_num_patches < (g_matrix_file ? MAX_FILE_VISMATRIX_PATCHES : MAX_VISMATRIX_PATCHES), assume_MAX_PATCHES);
 
     safe_strncpy(transferfile, g_source, _MAX_PATH);
     StripExtension(transferfile);
@@ -325,10 +399,7 @@ void MakeScalesVismatrix() {
         g_CheckVisBit = CheckVisBitVismatrix;
 
 #ifdef HLRAD_HULLU
-        if ((s_max_transparency_count * sizeof(transparency_t)) >= (1024 * 1024))
-            Log("%-20s: %5.1f megs\n", "custom shadow array", (s_max_transparency_count * sizeof(transparency_t)) / (1024 * 1024.0));
-        else if (s_transparency_count)
-            Log("%-20s: %5.1f kilos\n", "custom shadow array", (s_max_transparency_count * sizeof(transparency_t)) / 1024.0);
+        CreateTransparencyTable();
 #endif
 
 #ifndef HLRAD_HULLU
@@ -356,6 +427,5 @@ void MakeScalesVismatrix() {
             writetransfers(transferfile, g_num_patches);
         else
             unlink(transferfile);
-        DumpTransfersMemoryUsage();
     }
 }
@@ -5,10 +5,164 @@ funcCheckVisBit g_CheckVisBit = NULL;
 unsigned g_total_transfer = 0;
 unsigned g_transfer_index_bytes = 0;
 unsigned g_transfer_data_bytes = 0;
+cache_uint64_t g_vismatrix_bytes = 0;
 
 #define COMPRESSED_TRANSFERS
 //#undef  COMPRESSED_TRANSFERS
 
+// =====================================================================================
+//
+//      VIS LEAF TABLES
+//      What BuildVisLeafs needs to know about leafs, worked out once instead of per
+//      patch: the leaf the origin of each patch is in, and the bmodel faces bucketed by
+//      the leafs their patches are in. The bmodels aren't in the marksurfaces, but a
+//      bmodel patch in a leaf outside the PVS can't be reached any more than a world
+//      patch there, so the PVS filters them as well.
+//
+// =====================================================================================
+
+static int *s_patch_leaf = NULL;
+static unsigned *s_bmodel_leaf_first = NULL;// bmodel faces of leaf l are [first[l], first[l + 1])
+static int *s_bmodel_leaf_faces = NULL;
+
+// =====================================================================================
+//  CreateVisLeafTables
+// =====================================================================================
+void CreateVisLeafTables() {
+    int *leafstamps;
+    unsigned total;
+    unsigned i;
+    int leafnum;
+    int facenum;
+    int pass;
+    const patch_t *patch;
+
+    s_patch_leaf = (int *) AllocBlock((g_num_patches + 1) * sizeof(int));
+    s_bmodel_leaf_first = (unsigned *) AllocBlock((g_numleafs + 1) * sizeof(unsigned));
+    leafstamps = (int *) AllocBlock((g_numleafs + 1) * sizeof(int));
+    hlassume(s_patch_leaf != NULL && s_bmodel_leaf_first != NULL && leafstamps != NULL, assume_NoMemory);
+
+    for (i = 0; i < g_num_patches; i++) {
+        s_patch_leaf[i] = PointInLeaf(g_patches[i].origin) - g_dleafs;
+    }
+
+    // first pass counts, second pass fills in
+    for (leafnum = 0; leafnum < g_numleafs; leafnum++) {
+        leafstamps[leafnum] = -1;
+    }
+    for (pass = 0; pass < 2; pass++) {
+        for (facenum = (g_nummodels >= 2) ? g_dmodels[1].firstface : g_numfaces; facenum < g_numfaces; facenum++) {
+            for (patch = g_face_patches[facenum]; patch; patch = patch->next) {
+                leafnum = s_patch_leaf[patch - g_patches];
+
+                // leaf 0 is solid, nothing traces into it
+                if (!leafnum || leafstamps[leafnum] == facenum + pass * g_numfaces) {
+                    continue;
+                }
+                leafstamps[leafnum] = facenum + pass * g_numfaces;
+                if (pass) {
+                    s_bmodel_leaf_faces[s_bmodel_leaf_first[leafnum + 1]++] = facenum;
+                } else {
+                    s_bmodel_leaf_first[leafnum + 1]++;
+                }
+            }
+        }
+
+        if (!pass) {
+            for (leafnum = 0, total = 0; leafnum < g_numleafs; leafnum++) {
+                const unsigned count = s_bmodel_leaf_first[leafnum + 1];
+
+                s_bmodel_leaf_first[leafnum + 1] = total;// advanced to the end of the bucket while filling in
+                total += count;
+            }
+            s_bmodel_leaf_faces = (int *) AllocBlock((total + 1) * sizeof(int));
+            hlassume(s_bmodel_leaf_faces != NULL, assume_NoMemory);
+        }
+    }
+
+    FreeBlock(leafstamps);
+}
+
+// =====================================================================================
+//  FreeVisLeafTables
+// =====================================================================================
+void FreeVisLeafTables() {
+    FreeBlock(s_patch_leaf);
+    FreeBlock(s_bmodel_leaf_first);
+    FreeBlock(s_bmodel_leaf_faces);
+    s_patch_leaf = NULL;
+    s_bmodel_leaf_first = NULL;
+    s_bmodel_leaf_faces = NULL;
+}
+
+int GetPatchLeaf(const unsigned patchnum) {
+    return s_patch_leaf[patchnum];
+}
+
+static int CDECL face_sorter(const void *p1, const void *p2) {
+    return *(const int *) p1 - *(const int *) p2;
+}
+
+// =====================================================================================
+//  GetPvsFaces
+//      Lists the faces of the leafs in pvs, each once, in the order the old per patch
+//      loops tested them in
+// =====================================================================================
+void GetPvsFaces(pvsfaces_t *pvsfaces, const byte *pvs) {
+    int j, k, l;
+    const dleaf_t *leaf;
+    unsigned bmodelfaces;
+
+    if (!pvsfaces->stamps) {
+        pvsfaces->stamps = (unsigned *) calloc(g_numfaces + 1, sizeof(unsigned));
+        pvsfaces->faces = (int *) calloc(g_numfaces + 1, sizeof(int));
+        hlassume(pvsfaces->stamps != NULL && pvsfaces->faces != NULL, assume_NoMemory);
+    }
+    pvsfaces->generation++;
+    pvsfaces->numfaces = 0;
+
+    // leaf 0 is the solid leaf (skipped)
+    for (j = 1, leaf = g_dleafs + 1; j < g_numleafs; j++, leaf++) {
+        if (!(pvs[(j - 1) >> 3] & (1 << ((j - 1) & 7)))) {
+            continue;// not in pvs
+        }
+        for (k = 0; k < leaf->nummarksurfaces; k++) {
+            l = g_dmarksurfaces[leaf->firstmarksurface + k];
+
+            // faces can be marksurfed by multiple leaves, but
+            // don't bother testing again
+            if (pvsfaces->stamps[l] == pvsfaces->generation) {
+                continue;
+            }
+            pvsfaces->stamps[l] = pvsfaces->generation;
+            pvsfaces->faces[pvsfaces->numfaces++] = l;
+        }
+    }
+
+    bmodelfaces = pvsfaces->numfaces;
+    for (j = 1; j < g_numleafs; j++) {
+        if (!(pvs[(j - 1) >> 3] & (1 << ((j - 1) & 7)))) {
+            continue;// not in pvs
+        }
+        for (k = s_bmodel_leaf_first[j]; k < (int) s_bmodel_leaf_first[j + 1]; k++) {
+            l = s_bmodel_leaf_faces[k];
+
+            if (pvsfaces->stamps[l] == pvsfaces->generation) {
+                continue;
+            }
+            pvsfaces->stamps[l] = pvsfaces->generation;
+            pvsfaces->faces[pvsfaces->numfaces++] = l;
+        }
+    }
+    qsort(pvsfaces->faces + bmodelfaces, pvsfaces->numfaces - bmodelfaces, sizeof(int), face_sorter);
+}
+
+void FreePvsFaces(pvsfaces_t *pvsfaces) {
+    free(pvsfaces->stamps);
+    free(pvsfaces->faces);
+    memset(pvsfaces, 0, sizeof(*pvsfaces));
+}
+
 int FindTransferOffsetPatchnum(transfer_index_t *tIndex, const patch_t *const patch, const unsigned patchnum) {
     //
     // binary search for match
@@ -61,78 +215,144 @@ static unsigned GetLengthOfRun(const transfer_raw_index_t *raw, const transfer_r
     return run_size;
 }
 
-static transfer_index_t *CompressTransferIndicies(transfer_raw_index_t *tRaw, const unsigned rawSize, unsigned *iSize) {
+transfer_index_t *CompressTransferIndicies(transfer_raw_index_t *tRaw, const unsigned rawSize, unsigned *iSize) {
     unsigned x;
     unsigned size = rawSize;
     unsigned compressed_count = 0;
 
-    transfer_raw_index_t *raw = tRaw;
+    transfer_raw_index_t *raw;
     transfer_raw_index_t *end = tRaw + rawSize - 1;// -1 since we are comparing current with next and get errors when bumping into the 'end'
 
-    transfer_index_t CompressedArray[MAX_PATCHES];// somewhat big stack object (1 Mb with 256k patches)
-    transfer_index_t *compressed = CompressedArray;
+    transfer_index_t *compressed;
+    transfer_index_t *rval;
+    unsigned compressed_array_size;
 
-    for (x = 0; x < size; x++, raw++, compressed++) {
-        compressed->index = (*raw);
-        compressed->size = GetLengthOfRun(raw, end);// Zero based (count 0 still implies 1 item in the list, so 256 max entries result)
-        raw += compressed->size;
-        x += compressed->size;
+    // count the runs first, so the result can be allocated to fit
+    for (x = 0, raw = tRaw; x < size; x++, raw++) {
+        unsigned run = GetLengthOfRun(raw, end);
+
+        raw += run;
+        x += run;
         compressed_count++;// number of entries in compressed table
     }
 
     *iSize = compressed_count;
+    if (!compressed_count) {
+        return NULL;
+    }
 
-    if (compressed_count) {
-        unsigned compressed_array_size = sizeof(transfer_index_t) * compressed_count;
-        transfer_index_t *rval = (transfer_index_t *) AllocBlock(compressed_array_size);
-
-        ThreadLock();
-        g_transfer_index_bytes += compressed_array_size;
-        ThreadUnlock();
+    compressed_array_size = sizeof(transfer_index_t) * compressed_count;
+    rval = (transfer_index_t *) AllocBlock(compressed_array_size);
+    hlassume(rval != NULL, assume_NoMemory);
 
-        memcpy(rval, CompressedArray, compressed_array_size);
-        return rval;
-    } else {
-        return NULL;
+    for (x = 0, raw = tRaw, compressed = rval; x < size; x++, raw++, compressed++) {
+        compressed->index = (*raw);
+        compressed->size = GetLengthOfRun(raw, end);// Zero based (count 0 still implies 1 item in the list, so 256 max entries result)
+        raw += compressed->size;
+        x += compressed->size;
     }
+
+    ThreadLock();
+    g_transfer_index_bytes += compressed_array_size;
+    ThreadUnlock();
+
+    return rval;
 }
 
 #else
 
-static transfer_index_t *CompressTransferIndicies(const transfer_raw_index_t *tRaw, const unsigned rawSize, unsigned *iSize) {
+transfer_index_t *CompressTransferIndicies(transfer_raw_index_t *tRaw, const unsigned rawSize, unsigned *iSize) {
     unsigned x;
-    unsigned size = rawSize;
-    unsigned compressed_count = 0;
+    transfer_index_t *rval;
+    unsigned compressed_array_size;
 
-    transfer_raw_index_t *raw = tRaw;
-    transfer_raw_index_t *end = tRaw + rawSize;
+    *iSize = rawSize;
+    if (!rawSize) {
+        return NULL;
+    }
 
-    transfer_index_t CompressedArray[MAX_PATCHES];// somewhat big stack object (1 Mb with 256k patches)
-    transfer_index_t *compressed = CompressedArray;
+    compressed_array_size = sizeof(transfer_index_t) * rawSize;
+    rval = (transfer_index_t *) AllocBlock(compressed_array_size);
+    hlassume(rval != NULL, assume_NoMemory);
 
-    for (x = 0; x < size; x++, raw++, compressed++) {
-        compressed->index = (*raw);
-        compressed->size = 0;
-        compressed_count++;// number of entries in compressed table
+    for (x = 0; x < rawSize; x++) {
+        rval[x].index = tRaw[x];
+        rval[x].size = 0;
     }
 
-    *iSize = compressed_count;
+    ThreadLock();
+    g_transfer_index_bytes += compressed_array_size;
+    ThreadUnlock();
+
+    return rval;
+}
+#endif
 
-    if (compressed_count) {
-        unsigned compressed_array_size = sizeof(transfer_index_t) * compressed_count;
-        transfer_index_t *rval = AllocBlock(compressed_array_size);
+/*
+ * =============
+ * CreateScalePatches
+ * 
+ * Packs what MakeScales reads of every patch into small arrays, and groups the
+ * patches into runs of the same face (SortPatches put them in face order), so
+ * the inner loop doesn't walk g_patches and can skip whole faces at once.
+ * =============
+ */
+typedef struct {
+    unsigned firstpatch;
+    unsigned numpatches;
+    vec3_t normal;
+    vec_t planedist;// PatchPlaneDist of the patches on the face
+} scaleface_t;
+
+static vec3_t *s_scale_origins = NULL;
+static vec_t *s_scale_areas = NULL;
+static unsigned *s_scale_patchface = NULL;
+static scaleface_t *s_scale_faces = NULL;
+static unsigned s_num_scale_faces = 0;
+
+void CreateScalePatches() {
+    unsigned i;
+    patch_t *patch;
 
-        ThreadLock();
-        g_transfer_index_bytes += compressed_array_size;
-        ThreadUnlock();
+    FreeScalePatches();
 
-        memcpy(rval, CompressedArray, compressed_array_size);
-        return rval;
-    } else {
-        return NULL;
+    s_scale_origins = (vec3_t *) AllocBlock(sizeof(vec3_t) * (g_num_patches + 1));
+    s_scale_areas = (vec_t *) AllocBlock(sizeof(vec_t) * (g_num_patches + 1));
+    s_scale_patchface = (unsigned *) AllocBlock(sizeof(unsigned) * (g_num_patches + 1));
+    s_scale_faces = (scaleface_t *) AllocBlock(sizeof(scaleface_t) * (g_num_patches + 1));
+    hlassume(s_scale_origins != NULL && s_scale_areas != NULL && s_scale_patchface != NULL && s_scale_faces != NULL, assume_NoMemory);
+
+    for (i = 0, patch = g_patches; i < g_num_patches; i++, patch++) {
+        scaleface_t *face = s_num_scale_faces ? &s_scale_faces[s_num_scale_faces - 1] : NULL;
+
+        if (!face || g_patches[face->firstpatch].faceNumber != patch->faceNumber) {
+            face = &s_scale_faces[s_num_scale_faces++];
+            face->firstpatch = i;
+            face->numpatches = 0;
+            VectorCopy(getPlaneFromFaceNumber(patch->faceNumber)->normal, face->normal);
+            face->planedist = PatchPlaneDist(patch);
+        }
+        face->numpatches++;
+
+        VectorCopy(patch->origin, s_scale_origins[i]);
+        s_scale_areas[i] = patch->area;
+        s_scale_patchface[i] = s_num_scale_faces - 1;
     }
 }
-#endif
+
+void FreeScalePatches() {
+    if (s_scale_origins) {
+        FreeBlock(s_scale_origins);
+        FreeBlock(s_scale_areas);
+        FreeBlock(s_scale_patchface);
+        FreeBlock(s_scale_faces);
+    }
+    s_scale_origins = NULL;
+    s_scale_areas = NULL;
+    s_scale_patchface = NULL;
+    s_scale_faces = NULL;
+    s_num_scale_faces = 0;
+}
 
 /*
  * =============
@@ -140,6 +360,10 @@ static transfer_index_t *CompressTransferIndicies(const transfer_raw_index_t *tR
  * 
  * This is the primary time sink.
  * It can be run multi threaded.
+ *
+ * Every vismatrix method only marks a pair visible when each patch is in front
+ * of the other one's plane, so faces the patch is behind, and patches behind
+ * the patch, are skipped before g_CheckVisBit is asked.
  * =============
  */
 #ifdef SYSTEM_WIN32
@@ -154,20 +378,22 @@ void MakeScales(const int threadnum) {
     int count;
     float trans;
     patch_t *patch;
-    patch_t *patch2;
     float send;
     vec3_t origin;
     vec_t area;
     const vec_t *normal1;
     const vec_t *normal2;
+    vec_t planedist1;
+    const scaleface_t *face;
+    const scaleface_t *endface = s_scale_faces + s_num_scale_faces;
 
     vec_t total;
 
     transfer_raw_index_t *tIndex;
     transfer_data_t *tData;
 
-    transfer_raw_index_t *tIndex_All = (transfer_raw_index_t *) AllocBlock(sizeof(transfer_index_t) * MAX_PATCHES);
-    transfer_data_t *tData_All = (transfer_data_t *) AllocBlock(sizeof(transfer_data_t) * MAX_PATCHES);
+    transfer_raw_index_t *tIndex_All = (transfer_raw_index_t *) AllocBlock(sizeof(transfer_raw_index_t) * (g_num_patches + 1));
+    transfer_data_t *tData_All = (transfer_data_t *) AllocBlock(sizeof(transfer_data_t) * (g_num_patches + 1));
 
     count = 0;
 
@@ -185,81 +411,90 @@ void MakeScales(const int threadnum) {
         tIndex = tIndex_All;
         tData = tData_All;
 
-        VectorCopy(patch->origin, origin);
-        normal1 = getPlaneFromFaceNumber(patch->faceNumber)->normal;
+        VectorCopy(s_scale_origins[i], origin);
+        normal1 = s_scale_faces[s_scale_patchface[i]].normal;
+        planedist1 = s_scale_faces[s_scale_patchface[i]].planedist;
 
-        area = patch->area;
+        area = s_scale_areas[i];
 
         // find out which patch2's will collect light
         // from patch
 
-        for (j = 0, patch2 = g_patches; j < g_num_patches; j++, patch2++) {
-            vec_t dot1;
-            vec_t dot2;
+        for (face = s_scale_faces; face < endface; face++) {
+            if (DotProduct(origin, face->normal) <= face->planedist) {
+                continue;// patch is behind this face
+            }
+            normal2 = face->normal;
+
+            for (j = face->firstpatch; j < face->firstpatch + face->numpatches; j++) {
+                vec_t dot1;
+                vec_t dot2;
 
 #ifdef HLRAD_HULLU
-            vec3_t transparency = {1.0, 1.0, 1.0};
+                vec3_t transparency = {1.0, 1.0, 1.0};
 #endif
 
+                if ((i == j) || (DotProduct(s_scale_origins[j], normal1) <= planedist1)) {
+                    continue;
+                }
 #ifdef HLRAD_HULLU
-            if (!g_CheckVisBit(i, j, transparency) || (i == j))
+                if (!g_CheckVisBit(i, j, transparency))
 #else
-            if (!g_CheckVisBit(i, j) || (i == j))
+                if (!g_CheckVisBit(i, j))
 #endif
-            {
-                continue;
-            }
-
-            normal2 = getPlaneFromFaceNumber(patch2->faceNumber)->normal;
+                {
+                    continue;
+                }
 
-            // calculate transferemnce
-            VectorSubtract(patch2->origin, origin, delta);
+                // calculate transferemnce
+                VectorSubtract(s_scale_origins[j], origin, delta);
 
-            dist = VectorNormalize(delta);
-            dot1 = DotProduct(delta, normal1);
-            dot2 = -DotProduct(delta, normal2);
+                dist = VectorNormalize(delta);
+                dot1 = DotProduct(delta, normal1);
+                dot2 = -DotProduct(delta, normal2);
 
-            trans = (dot1 * dot2) / (dist * dist);// Inverse square falloff factoring angle between patch normals
+                trans = (dot1 * dot2) / (dist * dist);// Inverse square falloff factoring angle between patch normals
 
 #ifdef HLRAD_HULLU
-            trans = trans * VectorAvg(transparency);//hullu: add transparency effect
+                trans = trans * VectorAvg(transparency);//hullu: add transparency effect
 #endif
 
-            if (trans >= 0) {
-                send = trans * patch2->area;
+                if (trans >= 0) {
+                    send = trans * s_scale_areas[j];
 
-                // Caps light from getting weird
-                if (send > 0.4f) {
-                    trans = 0.4f / patch2->area;
-                    send = 0.4f;
-                }
+                    // Caps light from getting weird
+                    if (send > 0.4f) {
+                        trans = 0.4f / s_scale_areas[j];
+                        send = 0.4f;
+                    }
 
-                total += send;
+                    total += send;
 
-                // scale to 16 bit (black magic)
-                trans = trans * area * INVERSE_TRANSFER_SCALE;
-                if (trans >= TRANSFER_SCALE_MAX) {
-                    trans = TRANSFER_SCALE_MAX;
-                }
-            } else {
+                    // scale to 16 bit (black magic)
+                    trans = trans * area * INVERSE_TRANSFER_SCALE;
+                    if (trans >= TRANSFER_SCALE_MAX) {
+                        trans = TRANSFER_SCALE_MAX;
+                    }
+                } else {
 #if 0
-        Warning("transfer < 0 (%f): dist=(%f)\n"
-                "   dot1=(%f) patch@(%4.3f %4.3f %4.3f) normal(%4.3f %4.3f %4.3f)\n"
-                "   dot2=(%f) patch@(%4.3f %4.3f %4.3f) normal(%4.3f %4.3f %4.3f)\n",
-                trans, dist,
-                dot1, patch->origin[0], patch->origin[1], patch->origin[2], patch->normal[0], patch->normal[1],
-                patch->normal[2], dot2, patch2->origin[0], patch2->origin[1], patch2->origin[2],
-                patch2->normal[0], patch2->normal[1], patch2->normal[2]);
+            Warning("transfer < 0 (%f): dist=(%f)\n"
+                    "   dot1=(%f) patch@(%4.3f %4.3f %4.3f) normal(%4.3f %4.3f %4.3f)\n"
+                    "   dot2=(%f) patch@(%4.3f %4.3f %4.3f) normal(%4.3f %4.3f %4.3f)\n",
+                    trans, dist,
+                    dot1, patch->origin[0], patch->origin[1], patch->origin[2], patch->normal[0], patch->normal[1],
+                    patch->normal[2], dot2, patch2->origin[0], patch2->origin[1], patch2->origin[2],
+                    patch2->normal[0], patch2->normal[1], patch2->normal[2]);
 #endif
-                trans = 0.0;
-            }
+                    trans = 0.0;
+                }
 
-            *tData = trans;
-            *tIndex = j;
-            tData++;
-            tIndex++;
-            patch->iData++;
-            count++;
+                *tData = trans;
+                *tIndex = j;
+                tData++;
+                tIndex++;
+                patch->iData++;
+                count++;
+            }
         }
 
         // copy the transfers out
@@ -379,20 +614,22 @@ void MakeRGBScales(const int threadnum) {
     float trans[3];
     float trans_one;
     patch_t *patch;
-    patch_t *patch2;
     float send;
     vec3_t origin;
     vec_t area;
     const vec_t *normal1;
     const vec_t *normal2;
+    vec_t planedist1;
+    const scaleface_t *face;
+    const scaleface_t *endface = s_scale_faces + s_num_scale_faces;
 
     vec_t total;
 
     transfer_raw_index_t *tIndex;
     rgb_transfer_data_t *tRGBData;
 
-    transfer_raw_index_t *tIndex_All = (transfer_raw_index_t *) AllocBlock(sizeof(transfer_index_t) * MAX_PATCHES);
-    rgb_transfer_data_t *tRGBData_All = (rgb_transfer_data_t *) AllocBlock(sizeof(rgb_transfer_data_t) * MAX_PATCHES);
+    transfer_raw_index_t *tIndex_All = (transfer_raw_index_t *) AllocBlock(sizeof(transfer_raw_index_t) * (g_num_patches + 1));
+    rgb_transfer_data_t *tRGBData_All = (rgb_transfer_data_t *) AllocBlock(sizeof(rgb_transfer_data_t) * (g_num_patches + 1));
 
     count = 0;
 
@@ -410,96 +647,105 @@ void MakeRGBScales(const int threadnum) {
         tIndex = tIndex_All;
         tRGBData = tRGBData_All;
 
-        VectorCopy(patch->origin, origin);
-        normal1 = getPlaneFromFaceNumber(patch->faceNumber)->normal;
+        VectorCopy(s_scale_origins[i], origin);
+        normal1 = s_scale_faces[s_scale_patchface[i]].normal;
+        planedist1 = s_scale_faces[s_scale_patchface[i]].planedist;
 
-        area = patch->area;
+        area = s_scale_areas[i];
 
         // find out which patch2's will collect light
         // from patch
 
-        for (j = 0, patch2 = g_patches; j < g_num_patches; j++, patch2++) {
-            vec_t dot1;
-            vec_t dot2;
-            vec3_t transparency = {1.0, 1.0, 1.0};
-
-            if (!g_CheckVisBit(i, j, transparency) || (i == j)) {
-                continue;
+        for (face = s_scale_faces; face < endface; face++) {
+            if (DotProduct(origin, face->normal) <= face->planedist) {
+                continue;// patch is behind this face
             }
+            normal2 = face->normal;
 
-            normal2 = getPlaneFromFaceNumber(patch2->faceNumber)->normal;
-
-            // calculate transferemnce
-            VectorSubtract(patch2->origin, origin, delta);
-
-            dist = VectorNormalize(delta);
-            dot1 = DotProduct(delta, normal1);
-            dot2 = -DotProduct(delta, normal2);
-
-            trans_one = (dot1 * dot2) / (dist * dist);// Inverse square falloff factoring angle between patch normals
+            for (j = face->firstpatch; j < face->firstpatch + face->numpatches; j++) {
+                vec_t dot1;
+                vec_t dot2;
+                vec3_t transparency = {1.0, 1.0, 1.0};
 
-            VectorFill(trans, trans_one);
-            VectorMultiply(trans, transparency, trans);//hullu: add transparency effect
-
-            if (VectorAvg(trans) >= 0) {
-                /////////////////////////////////////////RED
-                send = trans[0] * patch2->area;
-                // Caps light from getting weird
-                if (send > 0.4f) {
-                    trans[0] = 0.4f / patch2->area;
-                    send = 0.4f;
-                }
-                total += send / 3.0f;
-
-                /////////////////////////////////////////GREEN
-                send = trans[1] * patch2->area;
-                // Caps light from getting weird
-                if (send > 0.4f) {
-                    trans[1] = 0.4f / patch2->area;
-                    send = 0.4f;
+                if ((i == j) || (DotProduct(s_scale_origins[j], normal1) <= planedist1)) {
+                    continue;
                 }
-                total += send / 3.0f;
-
-                /////////////////////////////////////////BLUE
-                send = trans[2] * patch2->area;
-                // Caps light from getting weird
-                if (send > 0.4f) {
-                    trans[2] = 0.4f / patch2->area;
-                    send = 0.4f;
+                if (!g_CheckVisBit(i, j, transparency)) {
+                    continue;
                 }
-                total += send / 3.0f;
 
-                // scale to 16 bit (black magic)
-                VectorScale(trans, area * INVERSE_TRANSFER_SCALE, trans);
-
-                if (trans[0] >= TRANSFER_SCALE_MAX) {
-                    trans[0] = TRANSFER_SCALE_MAX;
-                }
-                if (trans[1] >= TRANSFER_SCALE_MAX) {
-                    trans[1] = TRANSFER_SCALE_MAX;
-                }
-                if (trans[2] >= TRANSFER_SCALE_MAX) {
-                    trans[2] = TRANSFER_SCALE_MAX;
-                }
-            } else {
+                // calculate transferemnce
+                VectorSubtract(s_scale_origins[j], origin, delta);
+
+                dist = VectorNormalize(delta);
+                dot1 = DotProduct(delta, normal1);
+                dot2 = -DotProduct(delta, normal2);
+
+                trans_one = (dot1 * dot2) / (dist * dist);// Inverse square falloff factoring angle between patch normals
+
+                VectorFill(trans, trans_one);
+                VectorMultiply(trans, transparency, trans);//hullu: add transparency effect
+
+                if (VectorAvg(trans) >= 0) {
+                    /////////////////////////////////////////RED
+                    send = trans[0] * s_scale_areas[j];
+                    // Caps light from getting weird
+                    if (send > 0.4f) {
+                        trans[0] = 0.4f / s_scale_areas[j];
+                        send = 0.4f;
+                    }
+                    total += send / 3.0f;
+
+                    /////////////////////////////////////////GREEN
+                    send = trans[1] * s_scale_areas[j];
+                    // Caps light from getting weird
+                    if (send > 0.4f) {
+                        trans[1] = 0.4f / s_scale_areas[j];
+                        send = 0.4f;
+                    }
+                    total += send / 3.0f;
+
+                    /////////////////////////////////////////BLUE
+                    send = trans[2] * s_scale_areas[j];
+                    // Caps light from getting weird
+                    if (send > 0.4f) {
+                        trans[2] = 0.4f / s_scale_areas[j];
+                        send = 0.4f;
+                    }
+                    total += send / 3.0f;
+
+                    // scale to 16 bit (black magic)
+                    VectorScale(trans, area * INVERSE_TRANSFER_SCALE, trans);
+
+                    if (trans[0] >= TRANSFER_SCALE_MAX) {
+                        trans[0] = TRANSFER_SCALE_MAX;
+                    }
+                    if (trans[1] >= TRANSFER_SCALE_MAX) {
+                        trans[1] = TRANSFER_SCALE_MAX;
+                    }
+                    if (trans[2] >= TRANSFER_SCALE_MAX) {
+                        trans[2] = TRANSFER_SCALE_MAX;
+                    }
+                } else {
 #if 0
-        Warning("transfer < 0 (%4.3f %4.3f %4.3f): dist=(%f)\n"
-                "   dot1=(%f) patch@(%4.3f %4.3f %4.3f) normal(%4.3f %4.3f %4.3f)\n"
-                "   dot2=(%f) patch@(%4.3f %4.3f %4.3f) normal(%4.3f %4.3f %4.3f)\n",
-                trans[0], trans[1], trans[2], dist,
-                dot1, patch->origin[0], patch->origin[1], patch->origin[2], patch->normal[0], patch->normal[1],
-                patch->normal[2], dot2, patch2->origin[0], patch2->origin[1], patch2->origin[2],
-                patch2->normal[0], patch2->normal[1], patch2->normal[2]);
+            Warning("transfer < 0 (%4.3f %4.3f %4.3f): dist=(%f)\n"
+                    "   dot1=(%f) patch@(%4.3f %4.3f %4.3f) normal(%4.3f %4.3f %4.3f)\n"
+                    "   dot2=(%f) patch@(%4.3f %4.3f %4.3f) normal(%4.3f %4.3f %4.3f)\n",
+                    trans[0], trans[1], trans[2], dist,
+                    dot1, patch->origin[0], patch->origin[1], patch->origin[2], patch->normal[0], patch->normal[1],
+                    patch->normal[2], dot2, patch2->origin[0], patch2->origin[1], patch2->origin[2],
+                    patch2->normal[0], patch2->normal[1], patch2->normal[2]);
 #endif
-                VectorFill(trans, 0.0);
-            }
+                    VectorFill(trans, 0.0);
+                }
 
-            VectorCopy(trans, *tRGBData);
-            *tIndex = j;
-            tRGBData++;
-            tIndex++;
-            patch->iData++;
-            count++;
+                VectorCopy(trans, *tRGBData);
+                *tIndex = j;
+                tRGBData++;
+                tIndex++;
+                patch->iData++;
+                count++;
+            }
         }
 
         // copy the transfers out
@@ -600,11 +846,302 @@ void SwapRGBTransfers(const int patchnum) {
 
 #endif /*HLRAD_HULLU*/
 
+#ifdef HLRAD_HULLU
+
+// =====================================================================================
+//      TRANSPARENCY TABLE
+//      The transparency of the visible patch pairs whose line crosses custom shadow
+//      faces, for -customshadowwithbounce. The vismatrix builders stage the pairs of
+//      each source patch in a buffer of their own thread and hand them over once per
+//      patch; the table is then hashed on the pair for g_CheckVisBit.
+// =====================================================================================
+
+#define TRANSPARENCY_EMPTY 0xFFFFFFFF
+
+static transparency_t *s_transparency_list = NULL;
+static unsigned s_transparency_count = 0;
+static unsigned s_max_transparency_count = 0;
+
+static transparency_t *s_transparency_table = NULL;
+static unsigned s_transparency_mask = 0;
+
+static inline unsigned HashTransparency(const unsigned x, const unsigned y) {
+    return (x * 0x9E3779B1u) ^ (y * 0x85EBCA6Bu);
+}
+
+void AddTransparency(transparency_build_t *build, const unsigned x, const unsigned y, const vec3_t transparency) {
+    transparency_t *t;
+
+    // FindTransparency answers this for every pair it doesn't know
+    if (transparency[0] == 1.0 && transparency[1] == 1.0 && transparency[2] == 1.0) {
+        return;
+    }
+
+    if (build->count == build->max) {
+        build->max = build->max ? build->max * 2 : 256;
+        build->list = (transparency_t *) realloc(build->list, build->max * sizeof(transparency_t));
+        hlassume(build->list != NULL, assume_NoMemory);
+    }
+
+    t = &build->list[build->count++];
+    t->x = x;
+    t->y = y;
+    VectorCopy(transparency, t->transparency);
+}
+
+void FlushTransparencies(transparency_build_t *build) {
+    if (!build->count) {
+        return;
+    }
+
+    ThreadLock();
+    if (s_transparency_count + build->count > s_max_transparency_count) {
+        s_max_transparency_count = s_max_transparency_count * 2;
+        if (s_max_transparency_count < s_transparency_count + build->count) {
+            s_max_transparency_count = s_transparency_count + build->count;
+        }
+        s_transparency_list = (transparency_t *) realloc(s_transparency_list, s_max_transparency_count * sizeof(transparency_t));
+        hlassume(s_transparency_list != NULL, assume_NoMemory);
+    }
+    memcpy(s_transparency_list + s_transparency_count, build->list, build->count * sizeof(transparency_t));
+    s_transparency_count += build->count;
+    ThreadUnlock();
+
+    build->count = 0;
+}
+
+void FreeTransparencyBuild(transparency_build_t *build) {
+    free(build->list);
+    memset(build, 0, sizeof(*build));
+}
+
+// =====================================================================================
+//  CreateTransparencyTable
+//      Open addressing with linear probing, at most half full. Like the old list
+//      search, the first entry of a pair wins.
+// =====================================================================================
+void CreateTransparencyTable() {
+    unsigned size;
+    unsigned i;
+
+    if (!s_transparency_count) {
+        return;
+    }
+
+    for (size = 64; size < s_transparency_count * 2; size <<= 1)
+        ;
+    s_transparency_table = (transparency_t *) malloc(size * sizeof(transparency_t));
+    hlassume(s_transparency_table != NULL, assume_NoMemory);
+    s_transparency_mask = size - 1;
+    for (i = 0; i < size; i++) {
+        s_transparency_table[i].x = TRANSPARENCY_EMPTY;
+    }
+
+    for (i = 0; i < s_transparency_count; i++) {
+        const transparency_t *t = &s_transparency_list[i];
+        unsigned slot = HashTransparency(t->x, t->y) & s_transparency_mask;
+
+        while (s_transparency_table[slot].x != TRANSPARENCY_EMPTY) {
+            if (s_transparency_table[slot].x == t->x && s_transparency_table[slot].y == t->y) {
+                break;
+            }
+            slot = (slot + 1) & s_transparency_mask;
+        }
+        if (s_transparency_table[slot].x == TRANSPARENCY_EMPTY) {
+            s_transparency_table[slot] = *t;
+        }
+    }
+
+    if ((size * sizeof(transparency_t)) >= (1024 * 1024))
+        Log("%-20s: %5.1f megs\n", "custom shadow array", (size * sizeof(transparency_t)) / (1024 * 1024.0));
+    else
+        Log("%-20s: %5.1f kilos\n", "custom shadow array", (size * sizeof(transparency_t)) / 1024.0);
+
+    free(s_transparency_list);
+    s_transparency_list = NULL;
+    s_transparency_count = s_max_transparency_count = 0;
+}
+
+void FreeTransparencyTable() {
+    free(s_transparency_list);
+    s_transparency_list = NULL;
+    s_transparency_count = s_max_transparency_count = 0;
+
+    free(s_transparency_table);
+    s_transparency_table = NULL;
+    s_transparency_mask = 0;
+}
+
+// =====================================================================================
+//  FindTransparency
+//      x < y; pairs that aren't in the table are fully transparent
+// =====================================================================================
+void FindTransparency(const unsigned x, const unsigned y, vec3_t &out) {
+    if (s_transparency_table) {
+        unsigned slot = HashTransparency(x, y) & s_transparency_mask;
+
+        for (; s_transparency_table[slot].x != TRANSPARENCY_EMPTY; slot = (slot + 1) & s_transparency_mask) {
+            if (s_transparency_table[slot].x == x && s_transparency_table[slot].y == y) {
+                VectorCopy(s_transparency_table[slot].transparency, out);
+                return;
+            }
+        }
+    }
+    VectorFill(out, 1.0);
+}
+
+#endif /*HLRAD_HULLU*/
+
+// =====================================================================================
+//
+//      COMPACT TRANSFERS
+//      With -transferbits 16 or 8 the float transfers of every patch are quantized
+//      once they are final, relative to the largest transfer of the patch: 16 bit
+//      linearly, 8 bit on a log scale with TRANSFER_LOG_STEPS steps per power of two
+//      (0 is kept for no transfer). The gather expands a patch's transfers again
+//      just before it walks them.
+//      A list is only final once SwapTransfers, or for -hierarchical the totals of
+//      every patch, have seen all the others, so the float lists all exist at once
+//      and the peak memory of MakeScales is the same; only the bounces use less.
+//
+// =====================================================================================
+
+#define TRANSFER_LOG_STEPS 16
+
+static vec_t s_transfer_log[256];
+static unsigned g_transfer_compact_bytes = 0;
+
+static void CompactPatchTransfers(const int patchnum) {
+    patch_t *patch = &g_patches[patchnum];
+    const transfer_data_t *tData = patch->tData;
+    vec_t largest = 0;
+    unsigned x;
+
+    if (!patch->iData) {
+        return;
+    }
+
+    for (x = 0; x < patch->iData; x++) {
+        // non-finite transfers are dropped by the gather anyway
+        if (isfinite(tData[x]) && tData[x] > largest) {
+            largest = tData[x];
+        }
+    }
+    patch->tCompactScale = largest;
+    patch->tCompact = (byte *) AllocBlock(patch->iData * (g_transfer_bits / 8));
+    hlassume(patch->tCompact != NULL, assume_NoMemory);
+
+    if (g_transfer_bits == 16) {
+        unsigned short *q = (unsigned short *) patch->tCompact;
+
+        for (x = 0; x < patch->iData; x++) {
+            if (largest > 0 && isfinite(tData[x]) && tData[x] > 0) {
+                q[x] = (unsigned short) floor(tData[x] / largest * USHRT_MAX + 0.5);
+            }
+        }
+    } else {
+        byte *q = patch->tCompact;
+
+        for (x = 0; x < patch->iData; x++) {
+            if (largest > 0 && isfinite(tData[x]) && tData[x] > 0) {
+                int step = 255 + (int) floor(log(tData[x] / largest) / log(2.0) * TRANSFER_LOG_STEPS + 0.5);
+
+                if (step >= 1) {
+                    q[x] = (byte) step;
+                } else if (tData[x] >= s_transfer_log[1] * largest * 0.5) {
+                    q[x] = 1;
+                }
+            }
+        }
+    }
+
+    if (!transfersfromcache()) {
+        FreeBlock(patch->tData);
+    }
+    patch->tData = NULL;
+
+    ThreadLock();
+    g_transfer_compact_bytes += patch->iData * (g_transfer_bits / 8);
+    ThreadUnlock();
+}
+
+void CompactTransfers() {
+    int i;
+
+    if (g_transfer_bits == 32) {
+        return;
+    }
+#ifdef HLRAD_HULLU
+    if (g_rgb_transfers) {
+        Warning("-transferbits has no effect with -rgbtransfers, which are already 16 bit fixed point");
+        return;
+    }
+#endif
+
+    s_transfer_log[0] = 0;
+    for (i = 1; i < 256; i++) {
+        s_transfer_log[i] = pow(2.0, (i - 255) / (double) TRANSFER_LOG_STEPS);
+    }
+
+    NamedRunThreadsOnIndividual(g_num_patches, g_estimate, CompactPatchTransfers);
+}
+
+// =====================================================================================
+//  ExpandTransfers
+//      The transfers of a compacted patch, as floats in buffer (g_num_patches long)
+// =====================================================================================
+transfer_data_t *ExpandTransfers(const patch_t *const patch, transfer_data_t *buffer) {
+    unsigned x;
+
+    if (!patch->tCompact) {
+        return patch->tData;
+    }
+
+    if (g_transfer_bits == 16) {
+        const unsigned short *q = (const unsigned short *) patch->tCompact;
+        const vec_t scale = patch->tCompactScale / USHRT_MAX;
+
+        for (x = 0; x < patch->iData; x++) {
+            buffer[x] = q[x] * scale;
+        }
+    } else {
+        const byte *q = patch->tCompact;
+        const vec_t scale = patch->tCompactScale;
+
+        for (x = 0; x < patch->iData; x++) {
+            buffer[x] = s_transfer_log[q[x]] * scale;
+        }
+    }
+    return buffer;
+}
+
+// =====================================================================================
+//  GetTransfer
+//      A single transfer of patch, by its position in the list, compacted or not
+// =====================================================================================
+transfer_data_t GetTransfer(const patch_t *const patch, const unsigned offset) {
+    if (!patch->tCompact) {
+        return patch->tData[offset];
+    }
+
+    if (g_transfer_bits == 16) {
+        const vec_t scale = patch->tCompactScale / USHRT_MAX;
+
+        return ((const unsigned short *) patch->tCompact)[offset] * scale;
+    } else {
+        return s_transfer_log[patch->tCompact[offset]] * patch->tCompactScale;
+    }
+}
+
 #ifndef HLRAD_HULLU
 
 void DumpTransfersMemoryUsage() {
     Log("Transfer Lists : %u transfers\n       Indices : %u bytes\n          Data : %u bytes\n",
         g_total_transfer, g_transfer_index_bytes, g_transfer_data_bytes);
+    if (g_transfer_compact_bytes) {
+        Log("  Compact Data : %u bytes (%u bit, %u bytes less)\n",
+            g_transfer_compact_bytes, g_transfer_bits, g_transfer_data_bytes - g_transfer_compact_bytes);
+    }
 }
 
 #else
@@ -630,7 +1167,17 @@ void DumpTransfersMemoryUsage() {
     else if (g_transfer_data_bytes > 1024)
         Log("          Data : %11u : %7.2fk bytes\n", g_transfer_data_bytes, g_transfer_data_bytes / 1024.0f);
     else
-        Log("       Indices : %11u bytes\n", g_transfer_data_bytes);
+        Log("          Data : %11u bytes\n", g_transfer_data_bytes);
+
+    if (g_transfer_compact_bytes) {
+        if (g_transfer_compact_bytes > 1024 * 1024)
+            Log("  Compact Data : %11u : %7.2fM bytes", g_transfer_compact_bytes, g_transfer_compact_bytes / (1024.0f * 1024.0f));
+        else if (g_transfer_compact_bytes > 1024)
+            Log("  Compact Data : %11u : %7.2fk bytes", g_transfer_compact_bytes, g_transfer_compact_bytes / 1024.0f);
+        else
+            Log("  Compact Data : %11u bytes", g_transfer_compact_bytes);
+        Log(" (%u bit, %4.2f of Data)\n", g_transfer_bits, g_transfer_compact_bytes / (float) g_transfer_data_bytes);
+    }
 }
 
 #endif
@@ -280,25 +280,67 @@ static int AllPortalsDone() {
 // NETVIS
 ///////////
 
+#ifndef ZHLT_NETVIS
+static portal_t **s_portalorder = NULL;// see SortPortals
+static volatile int s_nextportal = 0;  // in s_portalorder
+
+// =====================================================================================
+//  SortPortals
+//      The order GetNextPortal hands out the portals in, from the least complex, so the
+//      later ones can reuse the earlier information. nummightsee doesn't change once
+//      BasePortalVis is done, so the order is worked out once instead of looking through
+//      all the portals, under the lock, for each one handed out. Ties go to the lower
+//      portal number, like the search did.
+// =====================================================================================
+static int CDECL portal_sorter(const void *p1, const void *p2) {
+    const portal_t *portal1 = *(const portal_t *const *) p1;
+    const portal_t *portal2 = *(const portal_t *const *) p2;
+
+    if (portal1->nummightsee != portal2->nummightsee) {
+        return (portal1->nummightsee < portal2->nummightsee) ? -1 : 1;
+    }
+    return (portal1 < portal2) ? -1 : (portal1 > portal2);
+}
+
+static void SortPortals() {
+    int i;
+
+    s_portalorder = (portal_t **) malloc((g_numportals * 2 + 1) * sizeof(portal_t *));
+    hlassume(s_portalorder != NULL, assume_NoMemory);
+
+    for (i = 0; i < g_numportals * 2; i++) {
+        s_portalorder[i] = &g_portals[i];
+    }
+    qsort(s_portalorder, g_numportals * 2, sizeof(portal_t *), portal_sorter);
+    s_nextportal = 0;
+}
+#endif
+
 // =====================================================================================
 //  GetNextPortal
 //      Returns the next portal for a thread to work on
 //      Returns the portals from the least complex, so the later ones can reuse the earlier information.
 // =====================================================================================
 static portal_t *GetNextPortal() {
+#ifndef ZHLT_NETVIS
+    portal_t *p;
+
+    // GetThreadWork hands out as many items as there are portals, and keeps the progress
+    if (GetThreadWork() == -1) {
+        return NULL;
+    }
+    p = s_portalorder[ThreadAtomicAdd(&s_nextportal, 1)];
+    p->status = stat_working;
+
+    return p;
+#else
     int j;
     portal_t *p;
     portal_t *tp;
     int min;
 
-#ifdef ZHLT_NETVIS
+    // a dropped client's portals go back to stat_none, so the server looks for them each time
     if (g_vismode == VIS_MODE_SERVER) {
-#else
-    {
-        if (GetThreadWork() == -1) {
-            return NULL;
-        }
-#endif
         ThreadLock();
 
         min = 99999;
@@ -308,9 +350,7 @@ static portal_t *GetNextPortal() {
             if (tp->nummightsee < min && tp->status == stat_none) {
                 min = tp->nummightsee;
                 p = tp;
-#ifdef ZHLT_NETVIS
                 g_visportalindex = j;
-#endif
             }
         }
 
@@ -321,9 +361,7 @@ static portal_t *GetNextPortal() {
         ThreadUnlock();
 
         return p;
-    }
-#ifdef ZHLT_NETVIS
-    else// AS CLIENT
+    } else// AS CLIENT
     {
         while (getWorkFromClientQueue() == WAITING_FOR_PORTAL_INDEX) {
             unsigned delay = 100;
@@ -595,7 +633,10 @@ static void CalcPortalVis() {
 #ifdef ZHLT_NETVIS
     LeafThread(0);
 #else
+    SortPortals();
     NamedRunThreadsOn(g_numportals * 2, g_estimate, LeafThread);
+    free(s_portalorder);
+    s_portalorder = NULL;
 #endif
 }
 
@@ -1096,6 +1137,7 @@ static void Usage() {
     Log("    -low | -high    : run program an altered priority level\n");
     Log("    -nolog          : don't generate the compile logfiles\n");
     Log("    -threads #      : manually specify the number of threads to run\n");
+    Log("    -affinity mode  : none, pin threads to CPUs, or keep them on one numa node\n");
 #ifdef SYSTEM_WIN32
     Log("    -estimate       : display estimated time during compile\n");
 #endif
@@ -1173,6 +1215,7 @@ static void Settings() {
             break;
     }
     Log("priority            [ %7s ] [ %7s ]\n", tmp, "Normal");
+    Log("affinity            [ %7s ] [ %7s ]\n", ThreadAffinityName(g_threadaffinity), ThreadAffinityName(DEFAULT_THREAD_AFFINITY));
     Log("\n");
 
     // HLVIS Specific Settings
@@ -1291,6 +1334,15 @@ int main(const int argc, char **argv) {
             g_threadpriority = eThreadPriorityLow;
         } else if (!strcasecmp(argv[i], "-high")) {
             g_threadpriority = eThreadPriorityHigh;
+        } else if (!strcasecmp(argv[i], "-affinity")) {
+            if (i + 1 < argc) {
+                if (!ThreadSetAffinity(argv[++i])) {
+                    Log("Expected none, pin or numa for '-affinity'\n");
+                    Usage();
+                }
+            } else {
+                Usage();
+            }
         } else if (!strcasecmp(argv[i], "-nolog")) {
             g_log = false;
         } else if (!strcasecmp(argv[i], "-texdata")) {
@@ -84,6 +84,9 @@ class ReferenceCounter {
 #ifdef HAVE_ATOMIC
   atomic_t m_atom;
 #endif
+#ifdef HAVE_SYNC_BUILTINS
+  volatile int m_atom;
+#endif
 
 #endif//SINGLE_THREADED
 };
@@ -232,6 +235,49 @@ inline void ReferenceCounter::copy(const ReferenceCounter& other)
     m_atom.counter = other.read();
 }
 #endif//HAVE_ATOMIC
+
+#ifdef HAVE_SYNC_BUILTINS
+inline ReferenceCounter::ReferenceCounter()
+{
+    m_atom = 0;
+}
+inline ReferenceCounter::ReferenceCounter(int InitialValue)
+{
+    m_atom = InitialValue;
+}
+inline int ReferenceCounter::add(int amt)
+{
+    return __sync_fetch_and_add(&m_atom, amt);
+}
+inline int ReferenceCounter::sub(int amt)
+{
+    return __sync_fetch_and_sub(&m_atom, amt);
+}
+inline int ReferenceCounter::inc()
+{
+    return __sync_add_and_fetch(&m_atom, 1);
+}
+inline int ReferenceCounter::dec()
+{
+    return __sync_sub_and_fetch(&m_atom, 1);
+}
+inline int ReferenceCounter::swap(int newvalue)
+{
+    return __sync_lock_test_and_set(&m_atom, newvalue);
+}
+inline void ReferenceCounter::write(int newvalue)
+{
+    __sync_lock_test_and_set(&m_atom, newvalue);
+}
+inline int ReferenceCounter::read() const
+{
+    return m_atom;
+}
+inline void ReferenceCounter::copy(const ReferenceCounter& other)
+{
+    m_atom = other.read();
+}
+#endif//HAVE_SYNC_BUILTINS
 #endif//SINGLE_THREADED
 
 #endif//ReferenceCounter_H__